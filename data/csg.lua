@@ -1,5 +1,5 @@
 -- two boxes
-function simplescene()
+local function simplescene()
   local groundbox = box(50.0, 4.0, 50.0, mat_simple_index)
   local ground = translation(0.0, -3.0, 0.0, groundbox)
   local small = box(5.0, 2.0, 5.0, mat_simple_index)
@@ -7,19 +7,13 @@ function simplescene()
 end
 setfenv(simplescene, csg)
 
-function capped_cylinder(x, z, r, ymin, ymax, matindex)
-  local cyl = cylinderxz(x, z, r, matindex)
-  local plane0 = plane(0.0, 1.0,0.0,-ymin, matindex)
-  local plane1 = plane(0.0,-1.0,0.0, ymax, matindex)
-  local ccyl = D(D(cyl, plane0), plane1);
-  ccyl:setmin(x-r,ymin,z-r)
-  ccyl:setmax(x+r,ymax,z+r)
-  return ccyl;
+local function capped_cylinder(x, z, r, ymin, ymax, matindex)
+  return cappedcylinderxz(x, z, r, ymin, ymax, matindex)
 end
 setfenv(capped_cylinder, csg)
 
 -- build a very simple arcade
-function arcade()
+local function arcade()
   local big = box(3.0, 4.0, 20.0, mat_simple_index);
   local b = box(2.0, 2.0, 20.0, mat_simple_index);
   local cut = translation(0.0, -2.0, 0.0, b);
@@ -35,7 +29,7 @@ end
 setfenv(arcade, csg)
 
 -- more complex with more than one material
-function complexscene()
+local function complexscene()
   -- a bunch of cylinder with a hole in the middle
   local s = sphere(4.2, mat_simple_index);
   local b0 = rotation(0.0, 25.0, 0.0, box(4.0,4.0,4.0,mat_simple_index))
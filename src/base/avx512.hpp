@@ -0,0 +1,19 @@
+/*-------------------------------------------------------------------------
+ - mini.q - a minimalistic multiplayer FPS
+ - avx512.hpp -> exposes 16-wide AVX-512 vectors
+ -------------------------------------------------------------------------*/
+#pragma once
+#if defined(__AVX512F__)
+#include "avx.hpp"
+
+namespace q {
+  struct avx512b;
+  struct avx512i;
+  struct avx512f;
+} /* namespace q */
+
+#include "avx512b.hpp"
+#include "avx512i.hpp"
+#include "avx512f.hpp"
+#endif /* __AVX512F__ */
+
@@ -0,0 +1,65 @@
+/*-------------------------------------------------------------------------
+ - mini.q - a minimalistic multiplayer FPS
+ - avx512b.hpp -> implements 16-wide masks with AVX-512 mask registers
+ -------------------------------------------------------------------------*/
+#pragma once
+#include "sys.hpp"
+#include "math.hpp"
+
+#define op operator
+namespace q {
+
+/*-------------------------------------------------------------------------
+ - 16-wide AVX-512 bool type. unlike sse and avx, masks are bit fields
+ -------------------------------------------------------------------------*/
+struct avx512b {
+  typedef avx512b masktype; // mask type for us
+  enum {size = 16};         // number of SIMD elements
+  __mmask16 v;              // data
+
+  // constructors, assignment & cast operators
+  INLINE avx512b() {}
+  INLINE avx512b(const avx512b &a) : v(a.v) {}
+  INLINE avx512b &op=(const avx512b &a) {v = a.v; return *this;}
+  INLINE avx512b(const __mmask16 a) : v(a) {}
+  INLINE op const __mmask16&(void) const {return v;}
+  INLINE avx512b(bool a) : v(a ? 0xffff : 0) {}
+
+  // constants
+  INLINE avx512b(falsetype) : v(0) {}
+  INLINE avx512b(truetype) : v(0xffff) {}
+
+  // array access
+  INLINE bool op [](const size_t i) const {assert(i < 16); return (v >> i) & 1;}
+};
+
+// unary operators
+INLINE avx512b op !(const avx512b &a) {return _mm512_knot(a);}
+
+// binary operators
+INLINE avx512b op& (const avx512b &a, const avx512b &b) {return _mm512_kand(a, b);}
+INLINE avx512b op| (const avx512b &a, const avx512b &b) {return _mm512_kor(a, b);}
+INLINE avx512b op^ (const avx512b &a, const avx512b &b) {return _mm512_kxor(a, b);}
+INLINE avx512b op&= (avx512b &a, const avx512b &b) {return a = a & b;}
+INLINE avx512b op|= (avx512b &a, const avx512b &b) {return a = a | b;}
+INLINE avx512b op^= (avx512b &a, const avx512b &b) {return a = a ^ b;}
+INLINE avx512b andnot(const avx512b &a, const avx512b &b) {return _mm512_kandn(a, b);}
+
+// comparison operators + select
+INLINE avx512b op !=(const avx512b &a, const avx512b &b) {return a ^ b;}
+INLINE avx512b op ==(const avx512b &a, const avx512b &b) {return _mm512_kxnor(a, b);}
+INLINE avx512b select(const avx512b &m, const avx512b &t, const avx512b &f) {
+  return (m & t) | andnot(m, f);
+}
+
+// reductions
+INLINE size_t popcnt(const avx512b &a)   {return __builtin_popcount(a.v);}
+INLINE bool reduce_and(const avx512b &a) {return a.v == 0xffff;}
+INLINE bool reduce_or (const avx512b &a) {return a.v != 0;}
+INLINE bool all(const avx512b &a)  {return a.v == 0xffff;}
+INLINE bool none(const avx512b &a) {return a.v == 0;}
+INLINE bool any(const avx512b &a)  {return a.v != 0;}
+INLINE u32 movemask(const avx512b &a) {return a.v;}
+} /* namespace q */
+#undef op
+
@@ -0,0 +1,150 @@
+/*-------------------------------------------------------------------------
+ - mini.q - a minimalistic multiplayer FPS
+ - avx512f.hpp -> implements FP operations with AVX-512 vectors
+ -------------------------------------------------------------------------*/
+#pragma once
+#include "sys.hpp"
+
+#define op operator
+namespace q {
+
+/*-------------------------------------------------------------------------
+ - 16-wide AVX-512 float type
+ -------------------------------------------------------------------------*/
+struct avx512f {
+  typedef struct avx512b masktype; // mask type for us
+  typedef struct avx512i inttype;  // int type for us
+
+  enum {size = 16}; // number of SIMD elements
+  union {__m512 m512; float v[16];}; // data
+
+  // constructors, assignment & cast operators
+  INLINE avx512f() {}
+  INLINE avx512f(const avx512f &other) {m512 = other.m512;}
+  INLINE avx512f &op=(const avx512f &other) {m512 = other.m512; return *this;}
+  INLINE avx512f(__m512 a) : m512(a) {}
+  INLINE op const __m512&(void) const {return m512;}
+  INLINE op __m512&(void) {return m512;}
+  INLINE avx512f(const float &a) : m512(_mm512_set1_ps(a)) {}
+  INLINE explicit avx512f(const __m512i a) : m512(_mm512_cvtepi32_ps(a)) {}
+
+  // loads
+  static INLINE avx512f load(const void* const ptr) {return _mm512_load_ps(ptr);}
+  static INLINE avx512f loadu(const void* const ptr) {return _mm512_loadu_ps(ptr);}
+
+  // constants
+  INLINE avx512f(zerotype) : m512(_mm512_setzero_ps()) {}
+  INLINE avx512f(onetype) : m512(_mm512_set1_ps(1.0f)) {}
+  static INLINE avx512f broadcast(const void* const a) {
+    return _mm512_set1_ps(*(const float*)a);
+  }
+
+  // array access
+  INLINE const float &op [](const size_t i) const {assert(i < 16); return v[i];}
+  INLINE       float &op [](const size_t i)       {assert(i < 16); return v[i];}
+};
+
+// unary operators
+INLINE avx512f cast(const avx512i &a) {return _mm512_castsi512_ps(a);}
+INLINE avx512i cast(const avx512f &a) {return _mm512_castps_si512(a);}
+INLINE avx512f op +(const avx512f &a) {return a;}
+INLINE avx512f op -(const avx512f &a) {
+  return _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(a),
+                                              _mm512_set1_epi32(0x80000000)));
+}
+INLINE avx512f abs(const avx512f &a) {
+  return _mm512_castsi512_ps(_mm512_and_si512(_mm512_castps_si512(a),
+                                              _mm512_set1_epi32(0x7fffffff)));
+}
+INLINE avx512f rcp(const avx512f &a) {return _mm512_div_ps(avx512f(one), a);}
+INLINE avx512f sqr  (const avx512f &a) {return _mm512_mul_ps(a,a);}
+INLINE avx512f sqrt (const avx512f &a) {return _mm512_sqrt_ps(a);}
+INLINE avx512f rsqrt(const avx512f &a) {
+  const avx512f r = _mm512_rsqrt14_ps(a);
+  return _mm512_fmadd_ps(_mm512_set1_ps(1.5f), r,
+    _mm512_mul_ps(_mm512_mul_ps(_mm512_mul_ps(a, _mm512_set1_ps(-0.5f)), r),
+      _mm512_mul_ps(r, r)));
+}
+
+// binary operators
+INLINE avx512f op+ (const avx512f &a, const avx512f &b) {return _mm512_add_ps(a, b);}
+INLINE avx512f op+ (const avx512f &a, const float b) {return a + avx512f(b);}
+INLINE avx512f op+ (const float a, const avx512f &b) {return avx512f(a) + b;}
+INLINE avx512f op- (const avx512f &a, const avx512f &b) {return _mm512_sub_ps(a, b);}
+INLINE avx512f op- (const avx512f &a, const float b) {return a - avx512f(b);}
+INLINE avx512f op- (const float a, const avx512f &b) {return avx512f(a) - b;}
+INLINE avx512f op* (const avx512f &a, const avx512f &b) {return _mm512_mul_ps(a, b);}
+INLINE avx512f op* (const avx512f &a, const float b) {return a * avx512f(b);}
+INLINE avx512f op* (const float a, const avx512f &b) {return avx512f(a) * b;}
+INLINE avx512f op/ (const avx512f &a, const avx512f &b) {return _mm512_div_ps(a, b);}
+INLINE avx512f op/ (const avx512f &a, const float b) {return a / avx512f(b);}
+INLINE avx512f op/ (const float a, const avx512f &b) {return avx512f(a) / b;}
+INLINE avx512f min(const avx512f &a, const avx512f &b) {return _mm512_min_ps(a, b);}
+INLINE avx512f min(const avx512f &a, const float b) {return _mm512_min_ps(a, avx512f(b));}
+INLINE avx512f min(const float a, const avx512f &b) {return _mm512_min_ps(avx512f(a), b);}
+INLINE avx512f max(const avx512f &a, const avx512f &b) {return _mm512_max_ps(a, b);}
+INLINE avx512f max(const avx512f &a, const float b) {return _mm512_max_ps(a, avx512f(b));}
+INLINE avx512f max(const float a, const avx512f &b) {return _mm512_max_ps(avx512f(a), b);}
+
+// ternary operators
+INLINE avx512f madd(const avx512f &a, const avx512f &b, const avx512f &c) {return _mm512_fmadd_ps(a,b,c);}
+INLINE avx512f msub(const avx512f &a, const avx512f &b, const avx512f &c) {return _mm512_fmsub_ps(a,b,c);}
+INLINE avx512f nmadd(const avx512f &a, const avx512f &b, const avx512f &c) {return _mm512_fnmadd_ps(a,b,c);}
+INLINE avx512f nmsub(const avx512f &a, const avx512f &b, const avx512f &c) {return _mm512_fnmsub_ps(a,b,c);}
+
+// assignment operators
+INLINE avx512f &op+= (avx512f &a, const avx512f &b) {return a = a + b;}
+INLINE avx512f &op+= (avx512f &a, const float b) {return a = a + b;}
+INLINE avx512f &op-= (avx512f &a, const avx512f &b) {return a = a - b;}
+INLINE avx512f &op-= (avx512f &a, const float b) {return a = a - b;}
+INLINE avx512f &op*= (avx512f &a, const avx512f &b) {return a = a * b;}
+INLINE avx512f &op*= (avx512f &a, const float b) {return a = a * b;}
+INLINE avx512f &op/= (avx512f &a, const avx512f &b) {return a = a / b;}
+INLINE avx512f &op/= (avx512f &a, const float b) {return a = a / b;}
+
+// comparison operators + select
+#define CMP(OP, PRED)\
+INLINE avx512b op OP (const avx512f &a, const avx512f &b) {return _mm512_cmp_ps_mask(a, b, PRED);}\
+INLINE avx512b op OP (const avx512f &a, const float b) {return _mm512_cmp_ps_mask(a, avx512f(b), PRED);}\
+INLINE avx512b op OP (const float a, const avx512f &b) {return _mm512_cmp_ps_mask(avx512f(a), b, PRED);}
+CMP(==, _CMP_EQ_OQ)
+CMP(!=, _CMP_NEQ_OQ)
+CMP(<,  _CMP_LT_OQ)
+CMP(>=, _CMP_GE_OQ)
+CMP(>,  _CMP_GT_OQ)
+CMP(<=, _CMP_LE_OQ)
+#undef CMP
+
+INLINE avx512f select(const avx512b &m, const avx512f &t, const avx512f &f) {
+  return _mm512_mask_blend_ps(m, f, t);
+}
+
+// rounding functions
+INLINE avx512f round_even(const avx512f &a) {return _mm512_roundscale_ps(a, _MM_FROUND_TO_NEAREST_INT);}
+INLINE avx512f round_down(const avx512f &a) {return _mm512_roundscale_ps(a, _MM_FROUND_TO_NEG_INF);}
+INLINE avx512f round_up(const avx512f &a) {return _mm512_roundscale_ps(a, _MM_FROUND_TO_POS_INF);}
+INLINE avx512f round_zero(const avx512f &a) {return _mm512_roundscale_ps(a, _MM_FROUND_TO_ZERO);}
+INLINE avx512f floor(const avx512f &a) {return round_down(a);}
+INLINE avx512f ceil(const avx512f &a) {return round_up(a);}
+
+// movement functions
+INLINE avx512f splat0(const avx512f &a) {
+  return _mm512_broadcastss_ps(_mm512_castps512_ps128(a));
+}
+
+// reductions
+INLINE float reduce_min(const avx512f &v) {return _mm512_reduce_min_ps(v);}
+INLINE float reduce_max(const avx512f &v) {return _mm512_reduce_max_ps(v);}
+INLINE float reduce_add(const avx512f &v) {return _mm512_reduce_add_ps(v);}
+
+// memory load and store operations
+INLINE avx512f load16f(const void* const a) {return _mm512_load_ps(a);}
+INLINE void store16f(void *ptr, const avx512f &f) {_mm512_store_ps(ptr, f);}
+INLINE void storeu16f(void *ptr, const avx512f &f) {_mm512_storeu_ps(ptr, f);}
+INLINE void store16f(const avx512b &mask, void *ptr, const avx512f &f) {
+  _mm512_mask_store_ps(ptr, mask, f);
+}
+INLINE void store16f_nt(void *ptr, const avx512f &v) {_mm512_stream_ps((float*)ptr, v);}
+} /* namespace q */
+#undef op
+
@@ -0,0 +1,87 @@
+/*-------------------------------------------------------------------------
+ - mini.q - a minimalistic multiplayer FPS
+ - avx512i.hpp -> implements integer operations with AVX-512 vectors
+ -------------------------------------------------------------------------*/
+#pragma once
+#include "sys.hpp"
+#include "math.hpp"
+
+#define op operator
+namespace q {
+
+/*-------------------------------------------------------------------------
+ - 16-wide AVX-512 int type
+ -------------------------------------------------------------------------*/
+struct avx512i {
+  typedef avx512b masktype; // mask type for us
+  enum {size = 16};         // number of SIMD elements
+  union {__m512i m512; s32 v[16];}; // data
+
+  // constructors, assignment & cast ops
+  INLINE avx512i() {}
+  INLINE avx512i(const avx512i &a) {m512 = a.m512;}
+  INLINE avx512i &op=(const avx512i &a) {m512 = a.m512; return *this;}
+  INLINE avx512i(const __m512i a) : m512(a) {}
+  INLINE op const __m512i&(void) const {return m512;}
+  INLINE op       __m512i&(void)       {return m512;}
+  INLINE avx512i(s32 a) : m512(_mm512_set1_epi32(a)) {}
+  INLINE explicit avx512i(const __m512 a) : m512(_mm512_cvtps_epi32(a)) {}
+
+  // loads
+  static INLINE avx512i load(const void* const ptr) {return _mm512_load_si512(ptr);}
+  static INLINE avx512i loadu(const void* const ptr) {return _mm512_loadu_si512(ptr);}
+
+  // constants
+  INLINE avx512i(zerotype) : m512(_mm512_setzero_si512()) {}
+  INLINE avx512i(onetype)  : m512(_mm512_set1_epi32(1)) {}
+
+  // array access
+  INLINE const s32 &op [](const size_t i) const {assert(i < 16); return v[i];}
+  INLINE       s32 &op [](const size_t i)       {assert(i < 16); return v[i];}
+};
+
+// unary ops
+INLINE avx512i op+ (const avx512i &a) {return a;}
+INLINE avx512i op- (const avx512i &a) {return _mm512_sub_epi32(_mm512_setzero_si512(), a);}
+INLINE avx512i abs(const avx512i &a) {return _mm512_abs_epi32(a);}
+
+// binary ops
+INLINE avx512i op+ (const avx512i &a, const avx512i &b) {return _mm512_add_epi32(a, b);}
+INLINE avx512i op- (const avx512i &a, const avx512i &b) {return _mm512_sub_epi32(a, b);}
+INLINE avx512i op* (const avx512i &a, const avx512i &b) {return _mm512_mullo_epi32(a, b);}
+INLINE avx512i op& (const avx512i &a, const avx512i &b) {return _mm512_and_si512(a, b);}
+INLINE avx512i op| (const avx512i &a, const avx512i &b) {return _mm512_or_si512(a, b);}
+INLINE avx512i op^ (const avx512i &a, const avx512i &b) {return _mm512_xor_si512(a, b);}
+INLINE avx512i op<< (const avx512i &a, const s32 n) {return _mm512_slli_epi32(a, n);}
+INLINE avx512i op>> (const avx512i &a, const s32 n) {return _mm512_srai_epi32(a, n);}
+INLINE avx512i min(const avx512i &a, const avx512i &b) {return _mm512_min_epi32(a, b);}
+INLINE avx512i max(const avx512i &a, const avx512i &b) {return _mm512_max_epi32(a, b);}
+
+// assignment ops
+INLINE avx512i &op+= (avx512i &a, const avx512i &b) {return a = a + b;}
+INLINE avx512i &op-= (avx512i &a, const avx512i &b) {return a = a - b;}
+INLINE avx512i &op*= (avx512i &a, const avx512i &b) {return a = a * b;}
+
+// comparison ops + select
+INLINE avx512b op== (const avx512i &a, const avx512i &b) {return _mm512_cmpeq_epi32_mask(a, b);}
+INLINE avx512b op!= (const avx512i &a, const avx512i &b) {return _mm512_cmpneq_epi32_mask(a, b);}
+INLINE avx512b op<  (const avx512i &a, const avx512i &b) {return _mm512_cmplt_epi32_mask(a, b);}
+INLINE avx512b op>= (const avx512i &a, const avx512i &b) {return _mm512_cmpge_epi32_mask(a, b);}
+INLINE avx512b op>  (const avx512i &a, const avx512i &b) {return _mm512_cmpgt_epi32_mask(a, b);}
+INLINE avx512b op<= (const avx512i &a, const avx512i &b) {return _mm512_cmple_epi32_mask(a, b);}
+INLINE avx512i select(const avx512b &m, const avx512i &t, const avx512i &f) {
+  return _mm512_mask_blend_epi32(m, f, t);
+}
+
+// reductions
+INLINE s32 reduce_min(const avx512i &v) {return _mm512_reduce_min_epi32(v);}
+INLINE s32 reduce_max(const avx512i &v) {return _mm512_reduce_max_epi32(v);}
+INLINE s32 reduce_add(const avx512i &v) {return _mm512_reduce_add_epi32(v);}
+
+// memory load and store operations
+INLINE void store16i(void *ptr, const avx512i &i) {_mm512_store_si512(ptr, i);}
+INLINE void storeu16i(void *ptr, const avx512i &i) {_mm512_storeu_si512(ptr, i);}
+INLINE void store16i_nt(void *ptr, const avx512i &i) {_mm512_stream_si512((__m512i*)ptr, i);}
+} /* namespace q */
+#undef op
+
@@ -91,7 +91,9 @@ void start() {
              "  setfenv = _G.setfenv,\n"
              "  setmetatable = _G.setmetatable\n"
              "}\n"
+             "newindexnum = 0\n"
              "local newindex = function (t, k, v)\n"
+             "  newindexnum = newindexnum + 1\n"
              "  if q[k] ~= nil then\n"
              "    q[k] = v\n"
              "  else\n"
@@ -109,7 +111,9 @@ int execstring(const char *p) {
   return luareport(lua_pcall(L, 0, 0, 0));
 }
 
+static u32 execnum = 0;
 bool execfile(const char *cfgfile) {
+  ++execnum;
   fixedstring s(cfgfile);
   const auto buf = sys::loadfile(sys::path(s.c_str()), NULL);
   if (!buf) {
@@ -127,6 +131,14 @@ void execscript(const char *cfgfile) {
 }
 CMD(execscript);
 
+u32 sideeffects(void) {
+  auto L = luastate();
+  lua_getglobal(L, "newindexnum");
+  const auto n = u32(lua_tointeger(L, -1));
+  lua_pop(L, 1);
+  return n + execnum;
+}
+
 void resetcomplete(void) { completesize = 0; }
 void complete(fixedstring &s) {
   if (*s.c_str()!='/') {
@@ -28,6 +28,9 @@ int execstring(const char *p);
 void execscript(const char *cfgfile);
 // execute a file and says if this succeeded
 bool execfile(const char *cfgfile);
+// count the global writes of the scripts (new globals or variables) and the
+// files they ran. a script that does not change it has no side effect
+u32 sideeffects();
 // init the environment for all scripts
 void start();
 } /* namespace script */
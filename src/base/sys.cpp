@@ -6,9 +6,11 @@
 #include "intrusive_list.hpp"
 #include "console.hpp"
 #include "string.hpp"
+#include "algorithm.hpp"
 #if defined(__UNIX__)
 #include <pthread.h>
 #include <unistd.h>
+#include <time.h>
 #endif
 #if defined(__LINUX__)
 #include <sched.h>
@@ -48,6 +50,13 @@ u32 threadnumber() {
   return sysinfo.dwNumberOfProcessors;
 #endif
 }
+#elif defined(__LINUX__)
+// only count the cpus we are allowed to run on
+u32 threadnumber() {
+  cpu_set_t set;
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) return CPU_COUNT(&set);
+  return sysconf(_SC_NPROCESSORS_ONLN);
+}
 #else
 u32 threadnumber() { return sysconf(_SC_NPROCESSORS_CONF); }
 #endif
@@ -73,20 +82,24 @@ static void set_affinity(HANDLE thread, int affinity) {
     groupAffinity.Reserved[0] = 0;
     groupAffinity.Reserved[1] = 0;
     groupAffinity.Reserved[2] = 0;
-    if (!SetThreadGroupAffinity(thread, &groupAffinity, NULL))
-      fatal("thread: cannot set thread group affinity");
+    if (!SetThreadGroupAffinity(thread, &groupAffinity, NULL)) {
+      con::out("thread: cannot set thread group affinity");
+      return;
+    }
 
     PROCESSOR_NUMBER processorNumber;
     processorNumber.Group = group;
     processorNumber.Number = number;
     processorNumber.Reserved = 0;
     if (!SetThreadIdealProcessorEx(thread, &processorNumber, NULL))
-      fatal("thread: cannot set ideal processor");
+      con::out("thread: cannot set ideal processor");
 #else
-    if (!SetThreadAffinityMask(thread, DWORD_PTR(u64(1) << affinity)))
-      fatal("thread: cannot set thread affinity mask");
+    if (!SetThreadAffinityMask(thread, DWORD_PTR(u64(1) << affinity))) {
+      con::out("thread: cannot set thread affinity mask");
+      return;
+    }
     if (SetThreadIdealProcessor(thread, (DWORD)affinity) == (DWORD)-1)
-      fatal("thread: cannot set ideal processor");
+      con::out("thread: cannot set ideal processor");
 #endif
 }
 void set_affinity(int affinity) {
@@ -99,23 +112,78 @@ void set_affinity(int affinity) {
     ap.affinity_tag = affinity;
     if (thread_policy_set(mach_thread_self(),THREAD_AFFINITY_POLICY,
         (integer_t*)&ap,THREAD_AFFINITY_POLICY_COUNT) != KERN_SUCCESS)
-      fatal("thread: cannot set affinity");
+      con::out("thread: cannot set affinity %d", affinity);
   }
 }
 #elif defined(__LINUX__)
 void set_affinity(int affinity) {
-  int wrap = threadnumber()/2;
-  affinity = (affinity/2) + wrap*(affinity%2);
-  if (affinity >= 0 && affinity < 64*64) {
-    union { u64 u; cpu_set_t set; } mask[64];
-    for (size_t i=0; i<64; i++) mask[i].u = 0;
-    mask[affinity/64].u= u64(1) << (affinity % 64);
-    if (pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask[0].set) < 0)
-      fatal("thread: cannot set affinity");
+  if (affinity >= 0 && affinity < CPU_SETSIZE) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(affinity, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+      con::out("thread: cannot set affinity %d", affinity);
   }
 }
 #endif
 
+#if defined(__LINUX__)
+// read the first integer of a sysfs file. -1 if missing
+static int sysfsint(const char *fmt, u32 cpu) {
+  char path[256];
+  sprintf(path, fmt, cpu);
+  const auto f = fopen(path, "r");
+  if (f == NULL) return -1;
+  int x = -1;
+  if (fscanf(f, "%d", &x) != 1) x = -1;
+  fclose(f);
+  return x;
+}
+#define SYSFS_CPU "/sys/devices/system/cpu/cpu%u/"
+
+static void getcpuinfo(cpuinfo &info, u32 cpu) {
+  const auto core = sysfsint(SYSFS_CPU "topology/core_id", cpu);
+  const auto package = sysfsint(SYSFS_CPU "topology/physical_package_id", cpu);
+  const auto cache = sysfsint(SYSFS_CPU "cache/index2/id", cpu);
+  info.id = cpu;
+  info.core = core < 0 ? cpu : u32(core);
+  info.package = package < 0 ? 0u : u32(package);
+  info.cache = cache < 0 ? info.core : u32(cache);
+  info.smt = 0;
+}
+#undef SYSFS_CPU
+#else
+static void getcpuinfo(cpuinfo &info, u32 cpu) {
+  info.id = info.core = info.cache = cpu;
+  info.package = info.smt = 0;
+}
+#endif
+
+u32 cputopology(cpuinfo *cpus, u32 maxnum) {
+  u32 n = 0;
+#if defined(__LINUX__)
+  // only the cpus we are allowed to run on. cpu ids may have holes
+  cpu_set_t set;
+  const auto hasset = sched_getaffinity(0, sizeof(set), &set) == 0;
+  for (u32 cpu = 0; cpu < CPU_SETSIZE && n < maxnum; ++cpu)
+    if (hasset ? CPU_ISSET(cpu, &set) : cpu < threadnumber())
+      getcpuinfo(cpus[n++], cpu);
+#else
+  for (; n < threadnumber() && n < maxnum; ++n) getcpuinfo(cpus[n], n);
+#endif
+  loopi(n) loopj(i)
+    if (cpus[j].package == cpus[i].package && cpus[j].core == cpus[i].core)
+      cpus[i].smt++;
+  quicksort(cpus, n, [](const cpuinfo &a, const cpuinfo &b) {
+    if (a.smt != b.smt) return a.smt < b.smt;
+    if (a.package != b.package) return a.package < b.package;
+    if (a.cache != b.cache) return a.cache < b.cache;
+    if (a.core != b.core) return a.core < b.core;
+    return a.id < b.id;
+  });
+  return n;
+}
+
 #if defined(MEMORY_DEBUGGER)
 struct DEFAULT_ALIGNED memblock : intrusive_list_node {
   INLINE memblock(size_t sz, const char *file, int linenum) :
@@ -306,12 +374,22 @@ float millis() {
   static double first = double(val.QuadPart) / double(freq.QuadPart) * 1e3;
   return float(double(val.QuadPart) / double(freq.QuadPart) * 1e3 - first);
 }
+u64 nanos() {
+  LARGE_INTEGER freq, val;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&val);
+  return u64(double(val.QuadPart) / double(freq.QuadPart) * 1e9);
+}
 #else
 float millis() {
   struct timeval tp; gettimeofday(&tp,NULL);
   static double first = double(tp.tv_sec)*1e3 + double(tp.tv_usec)*1e-3;
   return float(double(tp.tv_sec)*1e3 + double(tp.tv_usec)*1e-3 - first);
 }
+u64 nanos() {
+  struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+  return u64(ts.tv_sec)*1000000000ull + u64(ts.tv_nsec);
+}
 #endif
 
 void writebmp(const int *data, int w, int h, const char *filename) {
@@ -420,14 +498,20 @@ template <int lvl, int bit, int reg> static INLINE bool hasex() {
   cpuid_count(flags, lvl, 0);
   return (flags[reg] & (1<<bit)) != 0;
 }
-static INLINE int check_xcr0_ymm() {
+static INLINE u32 xcr0() {
   u32 xcr0;
 #if defined(__MSVC__)
   xcr0 = u32(_xgetbv(0));
 #else
   asm ("xgetbv" : "=a" (xcr0) : "c" (0) : "%edx" );
 #endif
-  return ((xcr0 & 6) == 6); // checking if xmm and ymm state are enabled in XCR0
+  return xcr0;
+}
+static INLINE int check_xcr0_ymm() {
+  return ((xcr0() & 6) == 6); // checking if xmm and ymm state are enabled in XCR0
+}
+static INLINE int check_xcr0_zmm() {
+  return ((xcr0() & 0xe6) == 0xe6); // same plus opmask and both zmm halves
 }
 
 bool hasfeature(cpufeature feature) {
@@ -446,6 +530,8 @@ bool hasfeature(cpufeature feature) {
     case CPU_FMA:   return has<1,12,ecx>();
     case CPU_F16C:  return has<1,29,ecx>();
     case CPU_YMM:   return 0 != check_xcr0_ymm();
+    case CPU_AVX512F: return hasex<7,16,ebx>();
+    case CPU_ZMM:   return 0 != check_xcr0_zmm();
     default: return false;
   }
 }
@@ -465,6 +551,8 @@ const char *featurename(cpufeature feature) {
     case CPU_FMA:   return "fma";
     case CPU_F16C:  return "f16c";
     case CPU_YMM:   return "ymmstate";
+    case CPU_AVX512F: return "avx512f";
+    case CPU_ZMM:   return "zmmstate";
     default:        return "unknown";
   };
 }
@@ -663,6 +663,7 @@ void fatal(const char *s, const char *o = "");
 void quit(const char *msg = NULL);
 void keyrepeat(bool on);
 float millis();
+u64 nanos(); // monotonic clock with an arbitrary origin
 char *path(char *s);
 char *loadfile(const char *fn, int *size=NULL);
 void initendiancheck();
@@ -670,6 +671,20 @@ int islittleendian();
 void endianswap(void *memory, int stride, int length);
 u32 threadnumber();
 void set_affinity(int affinity);
+
+// logical cpu and its position in the machine topology
+struct cpuinfo {
+  u32 id;      // logical cpu index as used by set_affinity
+  u32 package; // physical package (socket)
+  u32 cache;   // shared l2 cache
+  u32 core;    // physical core in the package
+  u32 smt;     // rank of the hardware thread in its core
+};
+// fill up to maxnum cpus among the ones the process may run on, ordered for
+// thread placement: one hardware thread per physical core first with cores
+// sharing a l2 cache next to each other, then the smt siblings. return the
+// number of cpus written
+u32 cputopology(cpuinfo *cpus, u32 maxnum);
 void writebmp(const int *data, int w, int h, const char *filename);
 void textinput(bool on);
 
@@ -679,7 +694,7 @@ void textinput(bool on);
 enum cpufeature {
   CPU_SSE, CPU_SSE2, CPU_SSE3, CPU_SSSE3, CPU_SSE41,
   CPU_SSE42, CPU_AVX, CPU_AVX2, CPU_BMI1, CPU_BMI2,
-  CPU_LZCNT, CPU_FMA, CPU_F16C, CPU_YMM,
+  CPU_LZCNT, CPU_FMA, CPU_F16C, CPU_YMM, CPU_AVX512F, CPU_ZMM,
   CPU_FEATURE_NUM
 };
 bool hasfeature(cpufeature feature);
@@ -754,6 +769,10 @@ INLINE s32 atomic_add(volatile s32* m, const s32 v) {
 INLINE s32 atomic_cmpxchg(volatile s32* m, const s32 v, const s32 c) {
   return _InterlockedCompareExchange((volatile long*)m,v,c);
 }
+template <typename T>
+INLINE T *atomic_cmpxchg(T *volatile *m, T *v, T *c) {
+  return (T*) _InterlockedCompareExchangePointer((void*volatile*)m,v,c);
+}
 #elif defined(__JAVASCRIPT__)
 INLINE s32 atomic_add(s32 volatile* value, s32 input) {
   const s32 initial = value;
@@ -765,6 +784,12 @@ INLINE s32 atomic_cmpxchg(volatile s32* m, const s32 v, const s32 c) {
   if (*m == c) *m = v;
   return initial;
 }
+template <typename T>
+INLINE T *atomic_cmpxchg(T *volatile *m, T *v, T *c) {
+  T *initial = *m;
+  if (*m == c) *m = v;
+  return initial;
+}
 #else
 INLINE s32 atomic_add(s32 volatile* value, s32 input) {
   asm volatile("lock xadd %0,%1" : "+r"(input), "+m"(*value) : "r"(input), "m"(*value));
@@ -775,6 +800,12 @@ INLINE s32 atomic_cmpxchg(s32 volatile* value, const s32 input, s32 comparand) {
   asm volatile("lock cmpxchg %2,%0" : "=m"(*value), "=a"(comparand) : "r"(input), "m"(*value), "a"(comparand) : "flags");
   return comparand;
 }
+
+template <typename T>
+INLINE T *atomic_cmpxchg(T *volatile *value, T *input, T *comparand) {
+  asm volatile("lock cmpxchg %2,%0" : "=m"(*value), "=a"(comparand) : "r"(input), "m"(*value), "a"(comparand) : "flags", "memory");
+  return comparand;
+}
 #endif // __MSVC__
 
 #if defined(__X86__) || defined(__X86_64__) || defined(__JAVASCRIPT__)
@@ -791,6 +822,16 @@ INLINE void storerelease(volatile T *ptr, T x) {
   *ptr = x;
   COMPILER_READ_WRITE_BARRIER;
 }
+// full store-load barrier. x86 may reorder a store with a later load
+INLINE void memfence(void) {
+#if defined(__MSVC__)
+  _mm_mfence();
+#elif defined(__JAVASCRIPT__)
+  COMPILER_READ_WRITE_BARRIER;
+#else
+  asm volatile("mfence" ::: "memory");
+#endif
+}
 #else
 #error "unknown platform"
 #endif
@@ -7,6 +7,8 @@
 #include "base/math.hpp"
 #include "base/intrusive_list.hpp"
 #include "base/sys.hpp"
+#include "base/script.hpp"
+#include "base/algorithm.hpp"
 #include <SDL_thread.h>
 
 namespace q {
@@ -20,137 +22,709 @@ enum {
   DONE = 3
 };
 
+// number of times a worker looks for work before going to sleep
+static const u32 SPINNUM = 64;
+
 // all queues as instantiated by the user
 static vector<struct queue*> queues;
 
-// a set of threads subscribes this queue and share the work in the list of the
-// tasks. threads terminate when "terminatethreads" become true
+// one item of a dependency list. it holds a reference on the task. nodes come
+// from chunks shared by all threads and are recycled through per-thread free
+// lists such that building a graph does not lock anything in the common case
+struct depnode {
+  task *job;
+  depnode *volatile next;
+};
+static const u32 DEPNODE_CHUNK = 256;
+static SDL_mutex *depmutex = NULL;
+static vector<depnode*> depchunks;
+static THREAD depnode *depfree = NULL;
+
+// the chunks are freed once the tasking system and all the tasks are gone (see
+// livetasknum). the free lists of all threads then point to freed memory so
+// each thread drops its list when the generation changes
+static atomic depgeneration(0);
+static THREAD s32 depthreadgeneration = 0;
+static INLINE depnode *&threaddepfree(void) {
+  if (depthreadgeneration != depgeneration) {
+    depthreadgeneration = depgeneration;
+    depfree = NULL;
+  }
+  return depfree;
+}
+
+// tasks alive plus one for the tasking system itself (from start to finish).
+// the dependency chunks are freed once it drops to zero, by finish or by the
+// last task that outlives it
+static atomic livetasknum(0);
+static void freedepchunks(void) {
+  loopv(depchunks) FREE(depchunks[i]);
+  depchunks = vector<depnode*>();
+  ++depgeneration;
+}
+
+static depnode *newdepnode(task *job) {
+  auto &depfree = threaddepfree();
+  if (depfree == NULL) {
+    const auto chunk = (depnode*) MALLOC(sizeof(depnode)*DEPNODE_CHUNK);
+    SDL_LockMutex(depmutex);
+    depchunks.push_back(chunk);
+    SDL_UnlockMutex(depmutex);
+    loopi(DEPNODE_CHUNK) {
+      chunk[i].next = depfree;
+      depfree = chunk+i;
+    }
+  }
+  const auto node = depfree;
+  depfree = node->next;
+  node->job = job;
+  node->next = NULL;
+  job->acquire();
+  return node;
+}
+
+static void freedepnode(depnode *node) {
+  auto &depfree = threaddepfree();
+  node->job->release();
+  node->next = depfree;
+  depfree = node;
+}
+
+static void freedeplist(depnode *node) {
+  while (node) {
+    const auto next = node->next;
+    freedepnode(node);
+    node = next;
+  }
+}
+
+// lists only grow until they are consumed so a simple cas loop is enough
+static void pushdep(depnode *volatile *list, depnode *node) {
+  for (;;) {
+    const auto head = *list;
+    node->next = head;
+    if (atomic_cmpxchg(list, node, head) == head) break;
+  }
+}
+
+// lock-free work-stealing deque (chase-lev). the owner pushes and pops at the
+// bottom, other workers steal at the top. the ring is bounded: when it is full,
+// the queue falls back to its shared (locked) inbox. counters wrap so all the
+// size computations are done with unsigned arithmetic
+struct taskdeque {
+  static const u32 CAPACITY = 1024u;
+  static const u32 MASK = CAPACITY-1;
+  INLINE taskdeque(void) : top(0), bottom(0) {}
+  INLINE s32 size(void) const { return s32(u32(s32(bottom))-u32(s32(top))); }
+  INLINE bool empty(void) const { return size() <= 0; }
+  bool push(task*);
+  task *pop(void);
+  task *steal(void);
+  CACHE_LINE_ALIGNED atomic top;    // where thieves steal
+  CACHE_LINE_ALIGNED atomic bottom; // where the owner pushes and pops
+  CACHE_LINE_ALIGNED task *volatile items[CAPACITY];
+};
+
+bool taskdeque::push(task *job) {
+  const s32 b = bottom, t = top;
+  if (s32(u32(b)-u32(t)) >= s32(CAPACITY)) return false;
+  items[u32(b) & MASK] = job;
+  storerelease(bottom, s32(u32(b)+1u));
+  return true;
+}
+
+task *taskdeque::pop(void) {
+  const s32 b = s32(u32(s32(bottom))-1u);
+  bottom = b;
+  memfence();
+  const s32 t = top;
+  const s32 sz = s32(u32(b)-u32(t));
+  if (sz < 0) {
+    storerelease(bottom, s32(u32(b)+1u));
+    return NULL;
+  }
+  task *job = items[u32(b) & MASK];
+  if (sz > 0) return job;
+
+  // last item: we race with the thieves for it
+  if (cmpxchg(top, s32(u32(t)+1u), t) != t) job = NULL;
+  storerelease(bottom, s32(u32(b)+1u));
+  return job;
+}
+
+task *taskdeque::steal(void) {
+  const s32 t = top;
+  COMPILER_READ_BARRIER;
+  const s32 b = bottom;
+  if (s32(u32(b)-u32(t)) <= 0) return NULL;
+  task *job = items[u32(t) & MASK];
+  COMPILER_READ_WRITE_BARRIER;
+  if (cmpxchg(top, s32(u32(t)+1u), t) != t) return NULL;
+  return job;
+}
+
+// one worker thread. it owns two deques, one per priority
+struct worker {
+  INLINE worker(queue *q, u32 index, s32 affinity) :
+    q(q), index(index), affinity(affinity), seed(index+1) {}
+  INLINE u32 random(void) {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+  }
+  taskdeque deque[2]; // indexed by the HI_PRIO bit
+  queue *q;
+  u32 index;
+  s32 affinity; // logical cpu the thread is pinned to (-1 if none)
+  u32 seed;
+};
+
+// worker running on the current thread (NULL if not a worker)
+static THREAD worker *thisworker = NULL;
+
+// task whose element is run by the current thread (NULL if none)
+static THREAD task *runningjob = NULL;
+
+/*-------------------------------------------------------------------------
+ - scratch arenas. created on demand for every thread that runs elements
+ -------------------------------------------------------------------------*/
+static SDL_mutex *arenamutex = NULL;
+static vector<arena*> arenas;
+static THREAD arena *thisarena = NULL;
+
+static arena &getarena(void) {
+  if (thisarena == NULL) {
+    thisarena = NEWE(arena);
+    SDL_LockMutex(arenamutex);
+    arenas.push_back(thisarena);
+    SDL_UnlockMutex(arenamutex);
+  }
+  return *thisarena;
+}
+
+/*-------------------------------------------------------------------------
+ - timeline tracer. each thread records the elements it runs and the
+ - dependencies it resolves in its own ring buffer. only the owner thread
+ - writes in it. buffers are dumped as chrome trace json (chrome://tracing or
+ - ui.perfetto.dev) together with the idle time per thread and the critical
+ - path of the recorded task graph
+ -------------------------------------------------------------------------*/
+enum { TRACE_RUN, TRACE_STARTS, TRACE_ENDS, TRACE_SPAWN };
+struct traceevent {
+  u64 start, end;   // rdtsc time stamps
+  const char *name; // name of the task for TRACE_RUN
+  u32 kind;         // TRACE_*
+  u32 uid;          // task that runs or that resolves a dependency
+  u32 other;        // element index for TRACE_RUN, dependent task otherwise
+};
+
+struct tracebuffer {
+  static const u32 SIZE = 1u<<15;
+  static const u32 MASK = SIZE-1;
+  INLINE tracebuffer(s32 workerindex) : head(0), workerindex(workerindex) {}
+  INLINE traceevent &next(void) { return events[head & MASK]; }
+  INLINE void commit(void) { storerelease(&head, head+1); }
+  INLINE u32 first(void) const { return head > SIZE ? head-SIZE : 0u; }
+  traceevent events[SIZE];
+  volatile u32 head; // number of events ever written
+  s32 workerindex;   // -1 if the thread is not a worker
+};
+
+static volatile bool tracing = false;
+static SDL_mutex *tracemutex = NULL;
+static vector<tracebuffer*> tracebuffers;
+static THREAD tracebuffer *thistrace = NULL;
+static u64 tracetick = 0;
+static float tracemillis = 0.f;
+static atomic uidgenerator(0);
+
+static tracebuffer *gettracebuffer(void) {
+  if (thistrace == NULL) {
+    thistrace = NEW(tracebuffer, thisworker ? s32(thisworker->index) : -1);
+    SDL_LockMutex(tracemutex);
+    tracebuffers.push_back(thistrace);
+    SDL_UnlockMutex(tracemutex);
+  }
+  return thistrace;
+}
+
+static void tracerun(const char *name, u32 uid, u32 elt, u64 start, u64 end) {
+  const auto buffer = gettracebuffer();
+  auto &e = buffer->next();
+  e.start = start;
+  e.end = end;
+  e.name = name;
+  e.kind = TRACE_RUN;
+  e.uid = uid;
+  e.other = elt;
+  buffer->commit();
+}
+
+static void traceedge(u32 kind, u32 from, u32 to) {
+  const auto buffer = gettracebuffer();
+  auto &e = buffer->next();
+  e.start = e.end = __rdtsc();
+  e.name = NULL;
+  e.kind = kind;
+  e.uid = from;
+  e.other = to;
+  buffer->commit();
+}
+
+// per task data used to compute the critical path
+struct traceinfo {
+  const char *name;
+  u64 first, last; // first element start and last element end
+  u64 weight;      // longest element i.e. minimum time to run the task
+  u64 finish;      // earliest finish time with infinite resources
+  u32 pred;        // predecessor on the critical path (0 if none)
+};
+
+static void tracereport(double tickpermicro) {
+  u64 first = ~0ull, last = 0ull;
+  u32 minuid = ~0u, maxuid = 0u;
+  loopv(tracebuffers) {
+    const auto b = tracebuffers[i];
+    for (auto j = b->first(); j < b->head; ++j) {
+      const auto &e = b->events[j & tracebuffer::MASK];
+      if (e.kind != TRACE_RUN) continue;
+      first = min(first, e.start);
+      last = max(last, e.end);
+      minuid = min(minuid, e.uid);
+      maxuid = max(maxuid, e.uid);
+    }
+  }
+  if (first >= last) return;
+  const auto tomillis = 1e-3 / tickpermicro;
+  const auto span = double(last-first) * tomillis;
+
+  // idle time per thread over the whole recorded span
+  loopv(tracebuffers) {
+    const auto b = tracebuffers[i];
+    u64 busy = 0;
+    for (auto j = b->first(); j < b->head; ++j) {
+      const auto &e = b->events[j & tracebuffer::MASK];
+      if (e.kind == TRACE_RUN) busy += e.end-e.start;
+    }
+    const auto idle = span - double(busy) * tomillis;
+    printf("task: trace: thread %d: busy %.2f ms, idle %.2f ms (%.1f%%)\n",
+           i, double(busy)*tomillis, idle, 100.0*idle/span);
+  }
+
+  // gather per task data
+  const auto n = maxuid-minuid+1;
+  vector<traceinfo> info(n);
+  loopi(n) {
+    info[i].name = NULL;
+    info[i].first = ~0ull;
+    info[i].last = info[i].weight = info[i].finish = 0ull;
+    info[i].pred = 0;
+  }
+  loopv(tracebuffers) {
+    const auto b = tracebuffers[i];
+    for (auto j = b->first(); j < b->head; ++j) {
+      const auto &e = b->events[j & tracebuffer::MASK];
+      if (e.kind != TRACE_RUN) continue;
+      auto &t = info[e.uid-minuid];
+      t.name = e.name ? e.name : "unnamed";
+      t.first = min(t.first, e.start);
+      t.last = max(t.last, e.end);
+      t.weight = max(t.weight, e.end-e.start);
+    }
+  }
+
+  // dependencies indexed by the dependent task
+  vector<traceevent> edges;
+  loopv(tracebuffers) {
+    const auto b = tracebuffers[i];
+    for (auto j = b->first(); j < b->head; ++j) {
+      const auto &e = b->events[j & tracebuffer::MASK];
+      if (e.kind == TRACE_RUN || e.uid < minuid || e.uid > maxuid) continue;
+      if (e.other < minuid || e.other > maxuid) continue;
+      edges.push_back(e);
+    }
+  }
+  if (edges.size() != 0)
+    quicksort(&edges[0], edges.size(), [](const traceevent &a, const traceevent &b) {
+      return a.other < b.other;
+    });
+
+  // tasks finish after their dependencies so the actual end time gives us a
+  // topological order
+  vector<u32> order;
+  loopi(n) if (info[i].name != NULL) order.push_back(i);
+  if (order.size() == 0) return;
+  quicksort(&order[0], order.size(), [&info](u32 a, u32 b) {
+    return info[a].last < info[b].last;
+  });
+  u32 critical = order[0];
+  loopv(order) {
+    const auto idx = order[i];
+    auto &t = info[idx];
+    const auto uid = idx+minuid;
+    auto lo = 0, hi = edges.size();
+    while (lo < hi) {
+      const auto mid = (lo+hi)/2;
+      if (edges[mid].other < uid) lo = mid+1; else hi = mid;
+    }
+    u64 start = 0ull;
+    for (auto j = lo; j < edges.size() && edges[j].other == uid; ++j) {
+      const auto &pred = info[edges[j].uid-minuid];
+      if (edges[j].kind != TRACE_ENDS && pred.finish > start) {
+        start = pred.finish;
+        t.pred = edges[j].uid;
+      }
+    }
+    t.finish = start + t.weight;
+    for (auto j = lo; j < edges.size() && edges[j].other == uid; ++j) {
+      const auto &pred = info[edges[j].uid-minuid];
+      if (edges[j].kind == TRACE_ENDS && pred.finish > t.finish) {
+        t.finish = pred.finish;
+        t.pred = edges[j].uid;
+      }
+    }
+    if (t.finish > info[critical].finish) critical = idx;
+  }
+
+  // output the critical path from its end to its beginning
+  printf("task: trace: wall %.2f ms, critical path %.2f ms\n",
+         span, double(info[critical].finish)*tomillis);
+  for (auto uid = critical+minuid; uid != 0; uid = info[uid-minuid].pred) {
+    const auto &t = info[uid-minuid];
+    if (t.name == NULL) break;
+    printf("task: trace:   %s (task %u): %.3f ms\n", t.name, uid, double(t.weight)*tomillis);
+  }
+}
+
+// write all events as chrome trace json and stop tracing
+static bool dumptrace(const char *filename) {
+  tracing = false;
+  const auto micros = double(sys::millis()-tracemillis) * 1e3;
+  const auto ticks = double(__rdtsc()-tracetick);
+  const auto tickpermicro = micros > 0.0 ? ticks/micros : 1.0;
+  auto f = fopen(filename, "wb");
+  if (f == NULL) return false;
+  SDL_LockMutex(tracemutex);
+  fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  auto sep = "";
+  loopv(tracebuffers) {
+    const auto b = tracebuffers[i];
+    fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,"
+               "\"args\":{\"name\":\"%s %d\"}}",
+               sep, i, b->workerindex >= 0 ? "worker" : "thread",
+               b->workerindex >= 0 ? b->workerindex : i);
+    sep = ",\n";
+    for (auto j = b->first(); j < b->head; ++j) {
+      const auto &e = b->events[j & tracebuffer::MASK];
+      if (e.kind != TRACE_RUN) continue;
+      fprintf(f, "%s{\"name\":\"%s\",\"cat\":\"task\",\"ph\":\"X\",\"pid\":0,"
+                 "\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+                 "\"args\":{\"task\":%u,\"elt\":%u}}",
+                 sep, e.name ? e.name : "unnamed", i,
+                 double(e.start-tracetick)/tickpermicro,
+                 double(e.end-e.start)/tickpermicro, e.uid, e.other);
+    }
+  }
+  fprintf(f, "\n]}\n");
+  fclose(f);
+  tracereport(tickpermicro);
+  loopv(tracebuffers) tracebuffers[i]->head = 0;
+  SDL_UnlockMutex(tracemutex);
+  return true;
+}
+
+// a set of threads subscribes this queue. each thread owns a deque where it
+// pushes the tasks it makes ready and steals from the others when it runs out
+// of work. tasks that become ready outside the worker threads go through the
+// inbox. threads terminate when "terminatethreads" become true
+//
+// threads blocked in task::wait help the queue and sleep on "waitcond" when
+// there is nothing to do. they are woken up by new work or when a task ends
+//
+// every copy of a task pointer stored in a deque or in the inbox holds a
+// reference. a task with several elements is published again each time a
+// worker picks it up and some elements remain such that other workers can
+// help. copies found once all elements are gone are simply dropped
 struct queue {
-  queue(u32 threadnum);
+  queue(u32 threadnum, const s32 *affinity);
   ~queue(void);
   void append(task*);
-  void remove(task*);
+  void append(task *const*, u32 n);
+  void push(task*);
   void terminate(task*);
+  void runjob(task*);
+  void runelement(task*, s32 elt);
+  task *popinbox(u32 prio);
+  task *steal(worker*, u32 prio);
+  task *getjob(worker&);
+  task *getjob(void);
+  bool haswork(void) const;
+  bool sleep(void);
+  void sleep(task*);
   static int threadfunc(void*);
-  SDL_cond *cond;
+  SDL_cond *cond, *waitcond;
   SDL_mutex *mutex;
   vector<SDL_Thread*> threads;
-  intrusive_list<task> readylist;
+  vector<worker*> workers;
+  intrusive_list<task> inbox;
+  atomic inboxnum;
+  atomic sleepernum;
+  atomic waitingnum;
   volatile bool terminatethreads;
 };
 
 void queue::append(task *job) {
   assert(job->owner == this && job->tostart == 0);
-  SDL_LockMutex(job->owner->mutex);
-    if (job->elemnum > 0) {
-      job->acquire();
-      if (job->policy & task::HI_PRIO)
-        job->owner->readylist.push_front(job);
-      else
-        job->owner->readylist.push_back(job);
-    }
+  if (job->elemnum > 0) push(job);
+}
+
+// append a batch of ready tasks. the inbox is locked once for all of them
+void queue::append(task *const *jobs, u32 n) {
+  const auto w = thisworker;
+  if (w != NULL && w->q == this) {
+    loopi(n) append(jobs[i]);
+    return;
+  }
+  SDL_LockMutex(mutex);
+  loopi(n) {
+    const auto job = jobs[i];
+    assert(job->owner == this && job->tostart == 0);
+    if (job->elemnum <= 0 || job->in_list()) continue;
+    job->acquire();
+    if (job->policy & task::HI_PRIO)
+      inbox.push_front(job);
+    else
+      inbox.push_back(job);
+    ++inboxnum;
+  }
   SDL_CondBroadcast(cond);
-  SDL_UnlockMutex(job->owner->mutex);
+  if (waitingnum > 0) SDL_CondBroadcast(waitcond);
+  SDL_UnlockMutex(mutex);
 }
 
-void queue::remove(task *job) {
-  assert(job->owner == this);
-  SDL_LockMutex(job->owner->mutex);
-  if (!job->in_list()) {
-    SDL_UnlockMutex(job->owner->mutex);
+void queue::push(task *job) {
+  job->acquire();
+  const auto prio = job->policy & task::HI_PRIO;
+  const auto w = thisworker;
+  if (w != NULL && w->q == this && w->deque[prio].push(job)) {
+    memfence();
+    if (sleepernum > 0 || waitingnum > 0) {
+      SDL_LockMutex(mutex);
+      SDL_CondSignal(cond);
+      if (waitingnum > 0) SDL_CondBroadcast(waitcond);
+      SDL_UnlockMutex(mutex);
+    }
     return;
   }
-  job->owner->readylist.erase(job);
-  SDL_UnlockMutex(job->owner->mutex);
-  job->release();
+
+  // not a worker of this queue or deque is full
+  SDL_LockMutex(mutex);
+  if (job->in_list())
+    job->release();
+  else {
+    if (prio)
+      inbox.push_front(job);
+    else
+      inbox.push_back(job);
+    ++inboxnum;
+  }
+  SDL_CondSignal(cond);
+  if (waitingnum > 0) SDL_CondBroadcast(waitcond);
+  SDL_UnlockMutex(mutex);
 }
 
 void queue::terminate(task *job) {
   assert(job->owner == this && job->toend == 0);
   storerelease(&job->state, u16(DONE));
 
-  // go over all tasks that depend on us
-  loopi(job->tasktostartnum) {
-    if (--job->tasktostart[i]->tostart == 0)
-      append(job->tasktostart[i]);
-    job->tasktostart[i] = NULL;
+  // go over all tasks that depend on us. nobody can append to these lists
+  // anymore since we are done
+  auto node = job->tasktostart;
+  job->tasktostart = NULL;
+  while (node) {
+    const auto next = node->next;
+    const auto other = node->job;
+    if (tracing) traceedge(TRACE_STARTS, job->uid, other->uid);
+    if (--other->tostart == 0) other->owner->append(other);
+    freedepnode(node);
+    node = next;
+  }
+  node = job->tasktoend;
+  job->tasktoend = NULL;
+  while (node) {
+    const auto next = node->next;
+    const auto other = node->job;
+    if (tracing) traceedge(TRACE_ENDS, job->uid, other->uid);
+    if (--other->toend == 0) other->owner->terminate(other);
+    freedepnode(node);
+    node = next;
   }
-  loopi(job->tasktoendnum) {
-    if (--job->tasktoend[i]->toend == 0)
-      terminate(job->tasktoend[i]);
-    job->tasktoend[i] = NULL;
+
+  // toend is zero: threads sleeping in task::wait may be waiting for us
+  if (waitingnum > 0) {
+    SDL_LockMutex(mutex);
+    SDL_CondBroadcast(waitcond);
+    SDL_UnlockMutex(mutex);
   }
-  job->tasktoendnum = 0;
-  job->tasktostartnum = 0;
 }
 
-struct thread_data {
-  queue *q;
-  int index;
-};
+task *queue::popinbox(u32 prio) {
+  if (inboxnum == 0) return NULL;
+  task *job = NULL;
+  SDL_LockMutex(mutex);
+  if (!inbox.empty() && (inbox.front()->policy & task::HI_PRIO) >= prio) {
+    job = inbox.front();
+    inbox.pop_front();
+    --inboxnum;
+  }
+  SDL_UnlockMutex(mutex);
+  return job;
+}
+
+// seed used to pick the first victim when the thread is not a worker
+static THREAD u32 helperseed = 0;
+
+task *queue::steal(worker *w, u32 prio) {
+  const auto n = u32(workers.size());
+  if (n == 0 || (w != NULL && n == 1)) return NULL;
+  const auto start = (w ? w->random() : helperseed++) % n;
+  loopi(n) {
+    const auto victim = workers[(start+i) % n];
+    if (victim == w) continue;
+    if (const auto job = victim->deque[prio].steal()) return job;
+  }
+  return NULL;
+}
+
+// hi-prio first: our own deque, then the inbox and finally the other workers
+task *queue::getjob(worker &w) {
+  for (s32 prio = task::HI_PRIO; prio >= 0; --prio) {
+    if (const auto job = w.deque[prio].pop()) return job;
+    if (const auto job = popinbox(prio)) return job;
+    if (const auto job = steal(&w, prio)) return job;
+  }
+  return NULL;
+}
+
+// same for threads that are not workers of this queue
+task *queue::getjob(void) {
+  const auto w = thisworker;
+  if (w != NULL && w->q == this) return getjob(*w);
+  for (s32 prio = task::HI_PRIO; prio >= 0; --prio) {
+    if (const auto job = popinbox(prio)) return job;
+    if (const auto job = steal(NULL, prio)) return job;
+  }
+  return NULL;
+}
+
+bool queue::haswork(void) const {
+  if (inboxnum > 0) return true;
+  loopv(workers) loopj(2) if (!workers[i]->deque[j].empty()) return true;
+  return false;
+}
+
+// return true if the thread must terminate
+bool queue::sleep(void) {
+  SDL_LockMutex(mutex);
+  ++sleepernum; // locked operation also acts as a full fence
+  if (!terminatethreads && !haswork())
+    SDL_CondWait(cond, mutex);
+  --sleepernum;
+  const bool terminate = terminatethreads;
+  SDL_UnlockMutex(mutex);
+  return terminate;
+}
+
+// sleep until the task ends or some work is available
+void queue::sleep(task *job) {
+  SDL_LockMutex(mutex);
+  ++waitingnum; // full fence. pairs with the toend decrement in terminate
+  if (job->toend != 0 && !haswork())
+    SDL_CondWait(waitcond, mutex);
+  --waitingnum;
+  SDL_UnlockMutex(mutex);
+}
+
+// elements may nest when run() waits for another task. the scratch arena is
+// therefore rewound to its state before the element and not simply cleared
+void queue::runelement(task *job, s32 elt) {
+  auto &scratch = getarena();
+  const auto marker = scratch.mark();
+  const auto prev = runningjob;
+  runningjob = job;
+  // elements of cancelled tasks are skipped but still count as done
+  if (!job->token || !job->token->cancelled()) {
+    if (tracing) {
+      const auto start = __rdtsc();
+      job->run(elt);
+      tracerun(job->name, job->uid, elt, start, __rdtsc());
+    } else
+      job->run(elt);
+  }
+  runningjob = prev;
+  scratch.rewind(marker);
+  if (--job->toend == 0) terminate(job);
+}
+
+void queue::runjob(task *job) {
+  // if unfair, we run all elements until there is nothing else to do in this
+  // job. we do not care if a hi-prio job arrives while we run
+  if (job->policy & task::UNFAIR) {
+    auto elt = --job->elemnum;
+    if (elt > 0) push(job);
+    while (elt >= 0) {
+      runelement(job, elt);
+      elt = --job->elemnum;
+    }
+  }
+  // if fair, we run once and go back to the deques to possibly run something
+  // with hi-prio that just arrived
+  else {
+    const auto elt = --job->elemnum;
+    if (elt > 0) push(job);
+    if (elt >= 0) runelement(job, elt);
+  }
+  job->release();
+}
 
 int queue::threadfunc(void *data) {
 #if defined(__X86__) || defined(__X86_64__)
   // flush to zero and no denormals
   _mm_setcsr(_mm_getcsr() | (1<<15) | (1<<6));
 #endif
-  const auto td = (thread_data*) data;
-  const auto q = (queue*) td->q;
-#if defined(__WIN32__) // TODO investigate why this is a disaster on the workstation
-  sys::set_affinity(td->index+1);
-#endif /* __WIN32__ */
-  DEL(td);
+  const auto w = (worker*) data;
+  const auto q = w->q;
+  thisworker = w;
+  if (w->affinity >= 0) sys::set_affinity(w->affinity);
   for (;;) {
-    SDL_LockMutex(q->mutex);
-    while (q->readylist.empty() && !q->terminatethreads)
-      SDL_CondWait(q->cond, q->mutex);
-    if (q->terminatethreads) {
-      SDL_UnlockMutex(q->mutex);
-      break;
-    }
-    auto job = q->readylist.front();
-
-    // if unfair, we run all elements until there is nothing else to do in this
-    // job. we do not care if a hi-prio job arrives while we run
-    job->acquire();
-    if (job->policy & task::UNFAIR) {
-      SDL_UnlockMutex(q->mutex);
-      for (;;) {
-        const auto elt = --job->elemnum;
-        if (elt >= 0) {
-          job->run(elt);
-          if (--job->toend == 0) q->terminate(job);
-        }
-        if (elt == 0) q->remove(job);
-        if (elt <= 0) break;
-      }
-    }
-    // if fair, we run once and go back to the queue to possibly run something
-    // with hi-prio that just arrived
-    else {
-      const auto elt = --job->elemnum;
-      if (elt == 0) q->remove(job);
-      SDL_UnlockMutex(q->mutex);
-      if (elt >= 0) {
-        job->run(elt);
-        if (--job->toend == 0) q->terminate(job);
-      }
+    task *job = NULL;
+    loopi(SPINNUM) {
+      if (q->terminatethreads || (job = q->getjob(*w)) != NULL) break;
+#if defined(__SSE__)
+      _mm_pause();
+#endif /* __SSE__ */
     }
-    job->release();
+    if (job != NULL)
+      q->runjob(job);
+    else if (q->sleep())
+      break;
   }
-
+  thisworker = NULL;
+  thistrace = NULL;
+  thisarena = NULL;
   return 0;
 }
 
-queue::queue(u32 threadnum) : terminatethreads(false) {
+queue::queue(u32 threadnum, const s32 *affinity) :
+  inboxnum(0), sleepernum(0), waitingnum(0), terminatethreads(false)
+{
   mutex = SDL_CreateMutex();
   cond = SDL_CreateCond();
-  loopi(threadnum) {
-    const auto td = NEWE(thread_data);
-    td->index = i;
-    td->q = this;
-    threads.push_back(SDL_CreateThread(threadfunc, "worker thread", td));
-  }
+  waitcond = SDL_CreateCond();
+  loopi(threadnum) workers.push_back(NEW(worker, this, i, affinity[i]));
+  loopi(threadnum)
+    threads.push_back(SDL_CreateThread(threadfunc, "worker thread", workers[i]));
 }
 
 queue::~queue(void) {
@@ -159,120 +733,279 @@ queue::~queue(void) {
   SDL_CondBroadcast(cond);
   SDL_UnlockMutex(mutex);
   loopv(threads) SDL_WaitThread(threads[i], NULL);
+
+  // drop the references still held by the deques and the inbox
+  loopv(workers) {
+    loopj(2) while (const auto job = workers[i]->deque[j].pop()) job->release();
+    DEL(workers[i]);
+  }
+  while (!inbox.empty()) {
+    const auto job = inbox.front();
+    inbox.pop_front();
+    job->release();
+  }
   SDL_DestroyMutex(mutex);
   SDL_DestroyCond(cond);
+  SDL_DestroyCond(waitcond);
 }
 } /* namespace tasking */
 
+// console commands to record the timeline of the tasks
+static void tasktrace(void) { task::starttrace(); }
+static void taskdump(const char *filename) {
+  if (!task::dumptrace(filename && filename[0] ? filename : "tasks.json"))
+    printf("task: unable to write trace file %s\n", filename);
+}
+CMD(tasktrace);
+CMD(taskdump);
+
+static void taskscratch(void) {
+  SDL_LockMutex(tasking::arenamutex);
+  loopv(tasking::arenas)
+    printf("task: scratch arena %d: peak %.1f KB\n", i, float(tasking::arenas[i]->peak())/1024.f);
+  SDL_UnlockMutex(tasking::arenamutex);
+}
+CMD(taskscratch);
+
+arena::~arena(void) {
+  loopv(chunks) ALIGNEDFREE(chunks[i].data);
+}
+
+void *arena::grow(size_t size, size_t align) {
+  // use the next chunk that is large enough or append a new one
+  const auto n = u32(chunks.size());
+  auto next = curr+1;
+  while (next < n && ALIGN(size, align) > chunks[next].size) ++next;
+  if (next >= n) {
+    const auto last = n == 0 ? size_t(64*1024) : 2*chunks.back().size;
+    const auto bytes = ALIGN(size, align) > last ? ALIGN(size, align) : last;
+    const chunk c = {(char*) ALIGNEDMALLOC(bytes, CACHE_LINE_ALIGNMENT), bytes};
+    chunks.push_back(c);
+    next = n;
+  }
+  if (n != 0) used += chunks[curr].size-top;
+  curr = next;
+  top = 0;
+  return alloc(size, align);
+}
+
+void arena::rewind(const marker &m) {
+  curr = m.chunk;
+  top = m.top;
+  used = m.used;
+
+  // empty arena spread over several chunks: merge them into one
+  if (used == 0 && chunks.size() > 1) {
+    size_t bytes = 0;
+    loopv(chunks) {
+      bytes += chunks[i].size;
+      ALIGNEDFREE(chunks[i].data);
+    }
+    const chunk c = {(char*) ALIGNEDMALLOC(bytes, CACHE_LINE_ALIGNMENT), bytes};
+    chunks.resize(0);
+    chunks.push_back(c);
+    curr = 0;
+  }
+}
+
 task::task(const char *name, u32 n, u32 waiternum, u32 queue, u16 policy) :
+  tasktostart(NULL), tasktoend(NULL),
   owner(tasking::queues[queue]), name(name), elemnum(n), tostart(1), toend(n),
-  depnum(0), waiternum(waiternum), tasktostartnum(0), tasktoendnum(0),
-  policy(policy), state(tasking::UNSCHEDULED)
+  waiternum(waiternum),
+  token(tasking::runningjob ? tasking::runningjob->token.ptr : NULL),
+  uid(u32(++tasking::uidgenerator)), policy(policy),
+  state(tasking::UNSCHEDULED)
 {
   assert(n > 0 && "cannot create a task with no work to do");
+  ++tasking::livetasknum;
+}
+task::~task() {
+  tasking::freedeplist(tasktostart);
+  tasking::freedeplist(tasktoend);
+  if (--tasking::livetasknum == 0) tasking::freedepchunks();
 }
-task::~task() {}
 
-void task::start(const u32 *queueinfo, u32 n) {
-#if defined(__WIN32__) // TODO investigate why this is a disaster on the workstation
-  sys::set_affinity(0);
-#endif /* __WIN32__ */
-  tasking::queues.resize(n);
-  loopi(n) tasking::queues[i] = NEW(tasking::queue, queueinfo[i]);
+void task::start(const u32 *queueinfo, u32 n, u32 flags) {
+  using namespace tasking;
+  ++livetasknum;
+  depmutex = SDL_CreateMutex();
+  tracemutex = SDL_CreateMutex();
+  arenamutex = SDL_CreateMutex();
+
+  // the main thread takes the first cpu of the topology. workers get the
+  // next ones in order such that they spread over the physical cores first
+  vector<s32> cpus;
+  if (flags & PIN_THREADS) {
+    vector<sys::cpuinfo> info(sys::threadnumber());
+    const auto cpunum = sys::cputopology(&info[0], info.size());
+    loopi(s32(cpunum)) {
+      const auto &cpu = info[i];
+      const auto samecore = cpu.package == info[0].package && cpu.core == info[0].core;
+      if (i != 0 && (flags & PHYSICAL_CORES) && cpu.smt != 0) continue;
+      if (i != 0 && (flags & OWN_MAIN_CORE) && samecore) continue;
+      cpus.push_back(cpu.id);
+    }
+    if (cpus.size() > 0) sys::set_affinity(cpus[0]);
+  }
+
+  // when cpus are left out, there are no more workers than the cpus we keep.
+  // the first queues are served first
+  const auto filtered = (flags & (PHYSICAL_CORES|OWN_MAIN_CORE)) && cpus.size() > 0;
+  u32 left = filtered ? u32(cpus.size())-1 : ~0u;
+  queues.resize(n);
+  u32 next = 1;
+  loopi(n) {
+    const auto workernum = min(queueinfo[i], left);
+    if (filtered) left -= workernum;
+    vector<s32> affinity(workernum);
+    loopj(workernum) affinity[j] = next < u32(cpus.size()) ? cpus[next++] : -1;
+    queues[i] = NEW(queue, workernum, affinity.size() ? &affinity[0] : NULL);
+  }
+}
+
+u32 task::pinflags(const char *arg) {
+  if (arg == NULL || arg[0] != '-' || arg[1] != 'a') return 0u;
+  u32 flags = PIN_THREADS;
+  for (auto c = arg+2; *c; ++c)
+    if (*c == 'p') flags |= PHYSICAL_CORES;
+    else if (*c == 'm') flags |= OWN_MAIN_CORE;
+    else return 0u;
+  return flags;
+}
+
+u32 task::threadnum(u32 queue) {
+  return queue < u32(tasking::queues.size()) ? tasking::queues[queue]->workers.size() : 0u;
+}
+
+void task::starttrace(void) {
+  using namespace tasking;
+  SDL_LockMutex(tracemutex);
+  loopv(tracebuffers) tracebuffers[i]->head = 0;
+  tracetick = __rdtsc();
+  tracemillis = sys::millis();
+  SDL_UnlockMutex(tracemutex);
+  tracing = true;
+}
+
+bool task::dumptrace(const char *filename) {
+  return tasking::dumptrace(filename);
+}
+
+bool task::cancelled(void) {
+  const auto job = tasking::runningjob;
+  return job != NULL && job->token && job->token->cancelled();
+}
+
+void task::settoken(canceltoken *t) {
+  assert(state == tasking::UNSCHEDULED);
+  token = t;
+}
+
+arena &task::scratch(void) {
+  return tasking::getarena();
+}
+
+size_t task::scratchpeak(void) {
+  using namespace tasking;
+  size_t peak = 0;
+  SDL_LockMutex(arenamutex);
+  loopv(arenas) if (arenas[i]->peak() > peak) peak = arenas[i]->peak();
+  SDL_UnlockMutex(arenamutex);
+  return peak;
 }
 
 void task::finish(void) {
+  if (tasking::tracing) tasking::dumptrace("tasks.json");
   loopv(tasking::queues) DEL(tasking::queues[i]);
   tasking::queues = vector<tasking::queue*>();
+  if (--tasking::livetasknum == 0) tasking::freedepchunks();
+  SDL_DestroyMutex(tasking::depmutex);
+  tasking::depmutex = NULL;
+  loopv(tasking::tracebuffers) DEL(tasking::tracebuffers[i]);
+  tasking::tracebuffers = vector<tasking::tracebuffer*>();
+  tasking::thistrace = NULL;
+  SDL_DestroyMutex(tasking::tracemutex);
+  tasking::tracemutex = NULL;
+  loopv(tasking::arenas) DEL(tasking::arenas[i]);
+  tasking::arenas = vector<arena*>();
+  tasking::thisarena = NULL;
+  SDL_DestroyMutex(tasking::arenamutex);
+  tasking::arenamutex = NULL;
 }
 
 void task::scheduled(void) {
   assert(state == tasking::UNSCHEDULED);
   storerelease(&state, u16(tasking::SCHEDULED));
+  if (tasking::tracing && tasking::runningjob)
+    tasking::traceedge(tasking::TRACE_SPAWN, tasking::runningjob->uid, uid);
   if (--tostart == 0) {
     storerelease(&state, u16(tasking::RUNNING));
     owner->append(this);
   }
 }
 
+void task::schedule(taskgraph &graph) {
+  const auto n = graph.tasks.size();
+  vector<task*> ready;
+  loopi(n) {
+    const auto job = graph.tasks[i].ptr;
+    assert(job->state == tasking::UNSCHEDULED);
+    storerelease(&job->state, u16(tasking::SCHEDULED));
+    if (tasking::tracing && tasking::runningjob)
+      tasking::traceedge(tasking::TRACE_SPAWN, tasking::runningjob->uid, job->uid);
+    if (--job->tostart == 0) {
+      storerelease(&job->state, u16(tasking::RUNNING));
+      ready.push_back(job);
+    }
+  }
+
+  // group the ready tasks per queue to lock each inbox once
+  loopv(tasking::queues) {
+    const auto q = tasking::queues[i];
+    vector<task*> batch;
+    loopvj(ready) if (ready[j]->owner == q) batch.push_back(ready[j]);
+    if (batch.size() != 0) q->append(&batch[0], batch.size());
+  }
+  graph.tasks.resize(0);
+}
+
 void task::starts(task &other) {
   assert(state == tasking::UNSCHEDULED && other.state == tasking::UNSCHEDULED);
   other.tostart++;
-
-  // compare-and-swap loop to safely both number of tasks to start and the task
-  // itself. Be careful with race condition, we first need to put the task and
-  // then to update the counter
-  auto old = 0;
-  do {
-    old = tasktostartnum;
-    assert(old < task::MAXSTART);
-    tasktostart[old] = &other;
-  } while (cmpxchg(tasktostartnum, old+1, old));
-
-  // same strategy for the dependency array
-  do {
-    old = other.depnum;
-    assert(old < task::MAXDEP);
-    other.deps[old] = this;
-  } while (cmpxchg(other.depnum, old+1, old));
+  tasking::pushdep(&tasktostart, tasking::newdepnode(&other));
 }
 
 void task::ends(task &other) {
   assert(state == tasking::UNSCHEDULED && other.state < tasking::DONE);
   other.toend++;
+  tasking::pushdep(&tasktoend, tasking::newdepnode(&other));
+}
 
-  // compare-and-swap loop as above
-  auto old = 0;
-  do {
-    old = tasktoendnum;
-    assert(old < task::MAXEND);
-    tasktoend[old] = &other;
-  } while (old != cmpxchg(tasktoendnum, old+1, old));
-
-  // same strategy for the dependency array
-  do {
-    old = other.depnum;
-    assert(old < task::MAXDEP);
-    other.deps[old] = this;
-  } while (old != cmpxchg(other.depnum, old+1, old));
-}
-
-void task::wait(bool recursivewait) {
-  assert((recursivewait || state >= tasking::SCHEDULED) &&
-         (recursivewait || waiternum > 0));
+// the waiting thread behaves as an extra worker: it runs the elements of the
+// task as soon as it is ready and any other job of the queue in the meantime.
+// it only sleeps when there is nothing to do
+void task::wait(void) {
+  assert(state >= tasking::SCHEDULED && waiternum > 0);
   acquire();
-
-  // execute all starting dependencies
-  while (tostart) loopi(depnum)
-    if (deps[i]->toend) deps[i]->wait(true);
-
-  // execute the run function
-  for (;;) {
-    const auto elt = --elemnum;
-    if (elt == 0) owner->remove(this);
-    if (elt >= 0) {
-      run(elt);
-      if (--toend == 0) owner->terminate(this);
-    }
-    if (elt <= 0) break;
-  }
-
-  // execute all ending dependencies. n.a.u.g.h.t.y -> busy waiting here
-#if defined(__SSE__)
-  int pausenum = 1;
-#endif /* __SSE__ */
-
+  u32 spinnum = 0;
   while (toend) {
-    loopi(depnum)
-      if (deps[i]->toend) deps[i]->wait(true);
+    if (tostart == 0 && elemnum > 0) {
+      const auto elt = --elemnum;
+      if (elt >= 0) owner->runelement(this, elt);
+      spinnum = 0;
+    } else if (const auto job = owner->getjob()) {
+      owner->runjob(job);
+      spinnum = 0;
+    } else if (++spinnum < tasking::SPINNUM) {
 #if defined(__SSE__)
-      else
-        loopj(pausenum) _mm_pause();
-      pausenum = min(pausenum*2, 64);
+      _mm_pause();
 #endif /* __SSE__ */
+    } else {
+      owner->sleep(this);
+      spinnum = 0;
+    }
   }
   release();
 }
 
 } /* namespace q */
-
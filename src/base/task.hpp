@@ -6,47 +6,188 @@
 #include "atomics.hpp"
 #include "ref.hpp"
 #include "intrusive_list.hpp"
+#include "vector.hpp"
 #include "sys.hpp"
 
 namespace q {
 namespace tasking {
 struct queue;
+struct depnode;
 } /* namespace tasking */
+struct taskgraph;
+
+/*-------------------------------------------------------------------------
+ - growing bump allocator used as scratch memory by the tasks. each thread
+ - owns one (see task::scratch) which is rewound when an element returns.
+ - chunks are merged into one once the arena is empty such that it stops
+ - allocating when the peak usage is reached
+ -------------------------------------------------------------------------*/
+class arena : public noncopyable {
+public:
+  struct marker { u32 chunk; size_t top, used; };
+  INLINE arena(void) : curr(0), top(0), used(0), highwater(0) {}
+  ~arena(void);
+  INLINE void *alloc(size_t size, size_t align = 16) {
+    const auto start = ALIGN(top, align);
+    if (curr < u32(chunks.size()) && start+size <= chunks[curr].size) {
+      used += start+size-top;
+      top = start+size;
+      if (used > highwater) highwater = used;
+      return chunks[curr].data+start;
+    }
+    return grow(size, align);
+  }
+  // the alignment of an aligned typedef is lost when the type is given as a
+  // template argument. arrays of elements of a cache line or more are then
+  // always aligned on cache lines
+  template <typename T> INLINE T *alloc(u32 n) {
+    const size_t minalign = sizeof(T) >= CACHE_LINE_ALIGNMENT ? CACHE_LINE_ALIGNMENT : 16;
+    return (T*) alloc(sizeof(T)*n, alignof(T) > minalign ? alignof(T) : minalign);
+  }
+  INLINE marker mark(void) const { return {curr, top, used}; }
+  void rewind(const marker&);
+  INLINE size_t size(void) const { return used; }
+  INLINE size_t peak(void) const { return highwater; }
+private:
+  void *grow(size_t size, size_t align);
+  struct chunk { char *data; size_t size; };
+  vector<chunk> chunks;
+  u32 curr;             // chunk we allocate from
+  size_t top;           // first free byte in the current chunk
+  size_t used;          // bytes allocated including padding
+  size_t highwater;     // maximum of "used" since creation
+};
+
+/*-------------------------------------------------------------------------
+ - shared by a set of tasks that may be abandoned together. once cancelled,
+ - the remaining elements of the tasks are skipped but dependencies are
+ - still honored. long elements may poll task::cancelled()
+ -------------------------------------------------------------------------*/
+struct canceltoken : public refcount, public noncopyable {
+  INLINE canceltoken(void) : flag(false) {}
+  INLINE void cancel(void) { flag = true; }
+  INLINE bool cancelled(void) const { return flag; }
+  volatile bool flag;
+};
 
 class CACHE_LINE_ALIGNED task : public noncopyable, public intrusive_list_node, public refcount {
 public:
-  static void start(const u32 *queueinfo, u32 n);
+  static void start(const u32 *queueinfo, u32 n, u32 flags=0);
   static void finish(void);
+  static u32 threadnum(u32 queue=0);
+  static void schedule(taskgraph&);
+  static void starttrace(void);
+  static bool dumptrace(const char *filename);
+  static arena &scratch(void);
+  static size_t scratchpeak(void);
+  static bool cancelled(void);
   task(const char *name, u32 elem=1, u32 waiter=0, u32 queue=0, u16 policy=0);
   virtual ~task(void);
   virtual void run(u32) = 0;
   void starts(task&);
   void ends(task&);
   void scheduled(void);
-  void wait(bool recursivewait=false);
+  void wait(void);
+  void settoken(canceltoken*);
   static const u32 LO_PRIO = 0u;
   static const u32 HI_PRIO = 1u;
   static const u32 FAIR    = 0u;
   static const u32 UNFAIR  = 2u;
-  static const u32 MAXSTART = 4; // maximum number of tasks we may start
-  static const u32 MAXEND   = 4; // maximum number of tasks we may end
-  static const u32 MAXDEP   = 8; // maximum number of tasks we may depend on
+  // thread placement flags for start. workers that do not find a free cpu
+  // are not pinned. the last two flags only apply with PIN_THREADS and then
+  // cap the number of workers to the cpus they keep
+  static const u32 PIN_THREADS    = 1u; // pin main thread and workers to cpus
+  static const u32 PHYSICAL_CORES = 2u; // at most one worker per physical core
+  static const u32 OWN_MAIN_CORE  = 4u; // keep the main thread core for itself
+  // parse the "-a[p][m]" option of the command lines: -a pins the threads, p
+  // adds PHYSICAL_CORES and m OWN_MAIN_CORE. returns 0 for anything else
+  static u32 pinflags(const char *arg);
 private:
   friend tasking::queue;
-  ref<task> tasktostart[MAXSTART]; // all the tasks that wait for us to start
-  ref<task> tasktoend[MAXEND];     // all the tasks that wait for us to finish
-  ref<task> deps[MAXDEP];          // all the tasks we depend on to finish or start
+  tasking::depnode *volatile tasktostart; // all the tasks that wait for us to start
+  tasking::depnode *volatile tasktoend;   // all the tasks that wait for us to finish
   tasking::queue * const owner;// where the task runs when ready
   const char *name;            // name of the task (may be NULL)
   atomic elemnum;              // number of items still to run in the set
   atomic tostart;              // mbz to start
   atomic toend;                // mbz to end
-  atomic depnum;               // number of tasks we depend to finish
   atomic waiternum;            // number of wait() that still need to be done
-  atomic tasktostartnum;       // number of tasks we need to start
-  atomic tasktoendnum;         // number of tasks we need to end
+  ref<canceltoken> token;      // inherited from the task that created us
+  const u32 uid;               // unique identifier used by the tracer
   const u16 policy;            // handle fairness and priority
   volatile u16 state;          // track task state (useful to debug)
 };
+
+// vector allocator that takes its memory from the scratch arena of the calling
+// thread. nothing is given back before the arena is rewound
+struct scratchallocator {
+  INLINE void *allocate(u32 bytes, int = 0) { return task::scratch().alloc(bytes); }
+  INLINE void deallocate(void*, u32) {}
+};
+
+// set of tasks scheduled in one batch. dependencies are expressed between the
+// tasks with starts and ends before calling task::schedule
+struct taskgraph : noncopyable {
+  INLINE task &add(task *job) {
+    tasks.push_back(job);
+    return *job;
+  }
+  vector<ref<task>> tasks;
+};
+
+// number of chunks per thread we aim for when the grain size is automatic. more
+// chunks balance irregular work better, fewer chunks reduce the overhead
+static const u32 CHUNKS_PER_THREAD = 8;
+
+// compute the grain size for a range of n indices. a zero grain means that we
+// derive it from the number of threads running the queue
+INLINE u32 grainsize(u32 n, u32 grain, u32 queue=0) {
+  if (grain != 0) return grain;
+  const auto chunknum = CHUNKS_PER_THREAD * (task::threadnum(queue)+1);
+  return n > chunknum ? (n + chunknum - 1) / chunknum : 1u;
+}
+
+// run fn(i) for all i in [first,last). each task element processes one chunk of
+// 'grain' consecutive indices
+template <typename F>
+struct task_parallel_for : public task {
+  INLINE task_parallel_for(const char *name, u32 first, u32 last, u32 grain,
+                           const F &fn, u32 waiternum=0, u32 queue=0, u16 policy=0) :
+    task(name, first < last ? chunknum(first,last,grain,queue) : 1u, waiternum, queue, policy),
+    fn(fn), first(first), last(last), grain(grainsize(last-first,grain,queue))
+  {}
+  static INLINE u32 chunknum(u32 first, u32 last, u32 grain, u32 queue) {
+    const auto n = last-first;
+    const auto sz = grainsize(n, grain, queue);
+    return (n + sz - 1) / sz;
+  }
+  virtual void run(u32 idx) {
+    const auto begin = first + idx*grain;
+    const auto end = last-begin > grain ? begin+grain : last;
+    for (auto i = begin; i < end; ++i) fn(i);
+  }
+  F fn;
+  u32 first, last, grain;
+};
+
+// create the task without scheduling it such that it may be part of a graph
+template <typename F>
+INLINE ref<task> make_parallel_for(const char *name, u32 first, u32 last,
+                                   u32 grain, const F &fn, u32 waiternum=0,
+                                   u16 policy=task::FAIR)
+{
+  return NEW(task_parallel_for<F>, name, first, last, grain, fn, waiternum, 0, policy);
+}
+
+// run the loop and wait for its completion. the calling thread participates.
+// with an unfair policy, a thread runs chunks until the loop is exhausted
+template <typename F>
+INLINE void parallel_for(u32 first, u32 last, u32 grain, const F &fn,
+                         u16 policy=task::FAIR) {
+  if (first >= last) return;
+  ref<task> job = make_parallel_for("parallel_for", first, last, grain, fn, 1, policy);
+  job->scheduled();
+  job->wait();
+}
 } /* namespace q */
 
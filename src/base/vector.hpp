@@ -415,7 +415,7 @@ public:
   static INLINE int heapparent(int i) { return (i - 1) >> 1; }
   static INLINE int heapchild(int i) { return (i << 1) + 1; }
 
-  void buildheap() { for(int i = size()/2; i >= 0; i--) downheap(i); }
+  void buildheap() { for(int i = size()/2-1; i >= 0; i--) downheap(i); }
 
   int upheap(int i) {
     auto score = at(i);
@@ -304,9 +304,11 @@ void compiler::compile(void) {
 }
 
 intersector::intersector(primitive *prims, int n) {
-  if (n==0)
+  if (n==0) {
     root = NULL;
-  else {
+    nodenum = 0;
+    hasintersector = 0;
+  } else {
     compiler c;
     c.injection(prims, n);
     c.compile();
@@ -0,0 +1,8 @@
+/*-------------------------------------------------------------------------
+ - mini.q - a minimalistic multiplayer fps
+ - csgavx2.cpp -> instantiates avx2 routines for csg evulation
+ -------------------------------------------------------------------------*/
+#define NAMESPACE avx2
+#include "csg.simd.cxx"
+#undef avx2
+
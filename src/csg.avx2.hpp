@@ -0,0 +1,16 @@
+/*-------------------------------------------------------------------------
+ - mini.q - a minimalistic multiplayer fps
+ - csgavx2.hpp -> exposes csg evaluation routines in avx2
+ -------------------------------------------------------------------------*/
+#pragma once
+#include "soa.hpp"
+
+namespace q {
+namespace csg {
+namespace avx2 {
+#include "csgdecl.hxx"
+} /* namespace avx2 */
+} /* namespace csg */
+} /* namespace q */
+
+
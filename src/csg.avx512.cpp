@@ -0,0 +1,8 @@
+/*-------------------------------------------------------------------------
+ - mini.q - a minimalistic multiplayer fps
+ - csgavx512.cpp -> instantiates avx512 routines for csg evulation
+ -------------------------------------------------------------------------*/
+#define NAMESPACE avx512
+#include "csg.simd.cxx"
+#undef avx512
+
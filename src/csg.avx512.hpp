@@ -0,0 +1,16 @@
+/*-------------------------------------------------------------------------
+ - mini.q - a minimalistic multiplayer fps
+ - csgavx512.hpp -> exposes csg evaluation routines in avx512
+ -------------------------------------------------------------------------*/
+#pragma once
+#include "soa.hpp"
+
+namespace q {
+namespace csg {
+namespace avx512 {
+#include "csgdecl.hxx"
+} /* namespace avx512 */
+} /* namespace csg */
+} /* namespace q */
+
+
@@ -5,22 +5,700 @@
 #include "csg.hpp"
 #include "csginternal.hpp"
 #include "base/math.hpp"
+#include "base/algorithm.hpp"
+#include "base/console.hpp"
+#include "base/hash.hpp"
 #include "base/script.hpp"
 #include "base/sys.hpp"
 
 namespace q {
 namespace csg {
 static ref<node> root;
-static void setroot(const ref<node> &node) {root = node;}
+
+/*--------------------------------------------------------------------------
+ - union chains as built by scripts are rebuilt as a bounding volume
+ - hierarchy. union is commutative (min for distances, max for materials)
+ - so only the normal distance selection may prefer the other operand. we
+ - keep the unions with a user defined box as they are
+ -------------------------------------------------------------------------*/
+namespace {
+struct rebalancer {
+  ref<node> run(const ref<node> &n) {
+    switch (n->type) {
+      case C_UNION: return unions(n);
+      case C_DIFFERENCE: case C_INTERSECTION: case C_REPLACE: {
+        // same layout for all binary nodes
+        auto b = n.cast<U>();
+        b->left = run(b->left);
+        b->right = run(b->right);
+      }
+      break;
+      case C_TRANSLATION: {
+        auto t = n.cast<translation>();
+        t->n = run(t->n);
+      }
+      break;
+      case C_ROTATION: {
+        auto r = n.cast<rotation>();
+        r->n = run(r->n);
+      }
+      break;
+      default: break;
+    }
+    return n;
+  }
+
+  // unions may be flattened if their box is the one computed at creation
+  INLINE bool flattenable(const ref<node> &n) {
+    if (n->type != C_UNION) return false;
+    const auto u = n.cast<U>();
+    const auto box = sum(u->left->box, u->right->box);
+    return all(eq(box.pmin, n->box.pmin)) && all(eq(box.pmax, n->box.pmax));
+  }
+  void gather(const ref<node> &n, vector<ref<node>> &operands) {
+    if (flattenable(n)) {
+      const auto u = n.cast<U>();
+      gather(u->left, operands);
+      gather(u->right, operands);
+    } else if (n->type != C_EMPTY && !isempty(n->box))
+      operands.push_back(run(n));
+  }
+
+  ref<node> unions(const ref<node> &n) {
+    if (!flattenable(n)) {
+      auto u = n.cast<U>();
+      u->left = run(u->left);
+      u->right = run(u->right);
+      return n;
+    }
+    vector<ref<node>> operands, bounded;
+    gather(n, operands);
+    if (operands.size() == 0) return NEWE(emptynode);
+
+    // unbounded operands (planes, cylinders...) cannot be culled anyway
+    ref<node> unbounded;
+    loopv(operands)
+      if (isbounded(operands[i]->box))
+        bounded.push_back(operands[i]);
+      else
+        unbounded = unbounded ? ref<node>(NEW(U, unbounded, operands[i])) : operands[i];
+    if (bounded.size() == 0) return unbounded;
+    vector<int> ids(bounded.size());
+    loopv(ids) ids[i] = i;
+    auto hierarchy = build(bounded, &ids[0], ids.size());
+    return unbounded ? ref<node>(NEW(U, hierarchy, unbounded)) : hierarchy;
+  }
+
+  // top-down SAH build with a full sweep along the three axes
+  ref<node> build(const vector<ref<node>> &nodes, int *ids, int n) {
+    if (n == 1) return nodes[ids[0]];
+    vector<float> rightarea(n);
+    auto bestcost = FLT_MAX;
+    int bestaxis = 0, bestsplit = n/2;
+    loopk(3) {
+      sort(nodes, ids, n, k);
+      auto box = aabb::empty();
+      for (int i = n-1; i > 0; --i) {
+        box = sum(box, nodes[ids[i]]->box);
+        rightarea[i] = box.halfarea();
+      }
+      box = aabb::empty();
+      for (int i = 0; i < n-1; ++i) {
+        box = sum(box, nodes[ids[i]]->box);
+        const auto cost = box.halfarea()*float(i+1) + rightarea[i+1]*float(n-i-1);
+        if (cost < bestcost) {
+          bestcost = cost;
+          bestaxis = k;
+          bestsplit = i+1;
+        }
+      }
+    }
+    sort(nodes, ids, n, bestaxis);
+    const auto left = build(nodes, ids, bestsplit);
+    const auto right = build(nodes, ids+bestsplit, n-bestsplit);
+    return NEW(U, left, right);
+  }
+  INLINE void sort(const vector<ref<node>> &nodes, int *ids, int n, int axis) {
+    quicksort(ids, n, [&](int a, int b) {
+      const auto &ba = nodes[a]->box, &bb = nodes[b]->box;
+      return ba.pmin[axis]+ba.pmax[axis] < bb.pmin[axis]+bb.pmax[axis];
+    });
+  }
+};
+
+#if USE_STATS
+// number of nodes the evaluators visit for a query box
+u32 visitnum(const node *n, const aabb &box) {
+  if (isempty(intersection(n->box, box))) return 0;
+  switch (n->type) {
+    case C_UNION: case C_DIFFERENCE: case C_INTERSECTION: case C_REPLACE: {
+      const auto b = static_cast<const U*>(n);
+      return 1 + visitnum(b->left, box) + visitnum(b->right, box);
+    }
+    case C_TRANSLATION: {
+      const auto t = static_cast<const translation*>(n);
+      return 1 + visitnum(t->n, aabb(box.pmin-t->p, box.pmax-t->p));
+    }
+    case C_ROTATION: {
+      const auto r = static_cast<const rotation*>(n);
+      return 1 + visitnum(r->n, rotatedaabb(conj(r->q), box));
+    }
+    default: return 1;
+  }
+}
+
+// box of the scene without the unbounded primitives
+aabb boundedbox(const node *n) {
+  if (isbounded(n->box)) return n->box;
+  switch (n->type) {
+    case C_UNION: {
+      const auto u = static_cast<const U*>(n);
+      return sum(boundedbox(u->left), boundedbox(u->right));
+    }
+    case C_DIFFERENCE: case C_REPLACE:
+      return boundedbox(static_cast<const D*>(n)->left);
+    case C_INTERSECTION: {
+      const auto i = static_cast<const I*>(n);
+      return intersection(boundedbox(i->left), boundedbox(i->right));
+    }
+    case C_TRANSLATION: {
+      const auto t = static_cast<const translation*>(n);
+      const auto box = boundedbox(t->n);
+      return aabb(box.pmin+t->p, box.pmax+t->p);
+    }
+    case C_ROTATION: {
+      const auto r = static_cast<const rotation*>(n);
+      return rotatedaabb(r->q, boundedbox(r->n));
+    }
+    default: return aabb::empty();
+  }
+}
+
+// visits for a grid of query boxes spanning the bounded part of the scene
+u32 visitnum(const node *n) {
+  static const int GRIDDIM = 16;
+  const auto box = boundedbox(n);
+  if (isempty(box)) return 0;
+  const auto cell = (box.pmax-box.pmin) / float(GRIDDIM);
+  u32 num = 0;
+  loopxyz(vec3i(zero), vec3i(GRIDDIM)) {
+    const auto pmin = box.pmin + vec3f(xyz)*cell;
+    num += visitnum(n, aabb(pmin, pmin+cell));
+  }
+  return num;
+}
+#endif /* USE_STATS */
+} /* namespace */
+
+#if USE_STATS
+// output the node visits before and after the rebalancing. it walks the tree
+// for a whole grid of boxes so it is off by default
+VAR(csgstats, 0, 0, 1);
+#endif /* USE_STATS */
+
+static u32 rootnum = 0; // number of setroot so far
+static void setroot(const ref<node> &node) {
+  ++rootnum;
+  if (!node) {
+    root = node;
+    return;
+  }
+#if USE_STATS
+  const auto before = csgstats ? visitnum(node) : 0u;
+#endif /* USE_STATS */
+  root = rebalancer().run(node);
+#if USE_STATS
+  if (csgstats)
+    con::out("csg: unions rebalanced, %u -> %u node visits", before, visitnum(root));
+#endif /* USE_STATS */
+}
 node *makescene() {
   return root.ptr;
 }
 
+node *setscene(const ref<node> &n) {
+  setroot(n);
+  return root.ptr;
+}
+
 void destroyscene(node *n) {
   assert(n == root.ptr);
   root = NULL;
 }
 
+/*--------------------------------------------------------------------------
+ - binary scene cache. the (already rebalanced) tree is stored in preorder
+ - with the boxes as they are since scripts may set them. the file starts
+ - with the hash of the script that built it so an unchanged script does not
+ - need to run again, and with the node layout of the build that wrote it.
+ - scripts that define globals, set variables or run other scripts are never
+ - cached since skipping them would lose these side effects
+ -------------------------------------------------------------------------*/
+namespace {
+static const u32 SCENEMAGIC = 0x67736371u; // "qcsg"
+static const u32 SCENEVERSION = 2;
+
+struct scenewriter {
+  INLINE scenewriter(FILE *f) : f(f) {}
+  template <typename T> INLINE void put(const T &x) {fwrite(&x, sizeof(T), 1, f);}
+  void run(const node *n) {
+    put(u32(n->type));
+    put(n->box);
+    switch (n->type) {
+      case C_UNION: case C_DIFFERENCE: case C_INTERSECTION: case C_REPLACE: {
+        const auto b = static_cast<const U*>(n);
+        run(b->left.ptr);
+        run(b->right.ptr);
+        return;
+      }
+      case C_TRANSLATION: {
+        const auto t = static_cast<const translation*>(n);
+        put(t->p);
+        run(t->n.ptr);
+        return;
+      }
+      case C_ROTATION: {
+        const auto r = static_cast<const rotation*>(n);
+        put(r->q);
+        run(r->n.ptr);
+        return;
+      }
+      case C_EMPTY: return;
+      default: break;
+    }
+    put(static_cast<const materialnode*>(n)->matindex);
+    switch (n->type) {
+      case C_SPHERE: put(static_cast<const sphere*>(n)->r); break;
+      case C_BOX: put(static_cast<const box*>(n)->extent); break;
+      case C_PLANE: put(static_cast<const plane*>(n)->p); break;
+      case C_CYLINDERXZ: {
+        const auto c = static_cast<const cylinderxz*>(n);
+        put(c->cxz); put(c->r);
+        break;
+      }
+      case C_CYLINDERXY: {
+        const auto c = static_cast<const cylinderxy*>(n);
+        put(c->cxy); put(c->r);
+        break;
+      }
+      case C_CYLINDERYZ: {
+        const auto c = static_cast<const cylinderyz*>(n);
+        put(c->cyz); put(c->r);
+        break;
+      }
+      case C_CAPPEDCYLINDERXZ: case C_CAPPEDCYLINDERXY: case C_CAPPEDCYLINDERYZ: {
+        const auto c = static_cast<const cappedcylinder*>(n);
+        put(c->c); put(c->r); put(c->h);
+        break;
+      }
+      case C_CAPSULE: {
+        const auto c = static_cast<const capsule*>(n);
+        put(c->h); put(c->r);
+        break;
+      }
+      case C_TORUS: {
+        const auto t = static_cast<const torus*>(n);
+        put(t->R); put(t->r);
+        break;
+      }
+      case C_CONE: {
+        const auto c = static_cast<const cone*>(n);
+        put(c->h); put(c->r0); put(c->r1);
+        break;
+      }
+      case C_ROUNDBOX: {
+        const auto b = static_cast<const roundbox*>(n);
+        put(b->extent); put(b->r);
+        break;
+      }
+      default: assert(false && "unknown csg node"); break;
+    }
+  }
+  FILE *f;
+};
+
+// any truncated or unknown input makes the whole load fail
+struct scenereader {
+  INLINE scenereader(const char *data, const char *end) :
+    data(data), end(end), ok(true) {}
+  template <typename T> INLINE T get() {
+    T x;
+    if (data+sizeof(T) > end) {
+      ok = false;
+      memset((void*)&x, 0, sizeof(T));
+      return x;
+    }
+    memcpy((void*)&x, data, sizeof(T));
+    data += sizeof(T);
+    return x;
+  }
+  ref<node> run() {
+    const auto type = get<u32>();
+    const auto box = get<aabb>();
+    if (!ok) return NULL;
+    ref<node> n;
+    switch (type) {
+      case C_EMPTY: n = NEWE(emptynode); break;
+      case C_UNION: case C_DIFFERENCE: case C_INTERSECTION: case C_REPLACE: {
+        const auto left = run();
+        const auto right = run();
+        if (!ok) return NULL;
+        if (type == C_UNION) n = NEW(U, left, right);
+        else if (type == C_DIFFERENCE) n = NEW(D, left, right);
+        else if (type == C_INTERSECTION) n = NEW(I, left, right);
+        else n = NEW(R, left, right);
+        break;
+      }
+      case C_TRANSLATION: {
+        const auto p = get<vec3f>();
+        const auto child = run();
+        if (!ok) return NULL;
+        n = NEW(translation, p, child);
+        break;
+      }
+      case C_ROTATION: {
+        const auto q = get<quat3f>();
+        const auto child = run();
+        if (!ok) return NULL;
+        n = NEW(rotation, q, child);
+        break;
+      }
+      default: n = leaf(type); break;
+    }
+    if (!ok || !n) return NULL;
+    n->box = box;
+    return n;
+  }
+  ref<node> leaf(u32 type) {
+    const auto mat = get<u32>();
+    switch (type) {
+      case C_SPHERE: return NEW(sphere, get<float>(), mat);
+      case C_BOX: return NEW(box, get<vec3f>(), mat);
+      case C_PLANE: return NEW(plane, get<vec4f>(), mat);
+      case C_CYLINDERXZ: {
+        const auto c = get<vec2f>();
+        return NEW(cylinderxz, c, get<float>(), mat);
+      }
+      case C_CYLINDERXY: {
+        const auto c = get<vec2f>();
+        return NEW(cylinderxy, c, get<float>(), mat);
+      }
+      case C_CYLINDERYZ: {
+        const auto c = get<vec2f>();
+        return NEW(cylinderyz, c, get<float>(), mat);
+      }
+      case C_CAPPEDCYLINDERXZ: case C_CAPPEDCYLINDERXY: case C_CAPPEDCYLINDERYZ: {
+        // the fields are copied as they are to avoid any rounding
+        ref<cappedcylinder> c;
+        if (type == C_CAPPEDCYLINDERXZ) c = NEW(cappedcylinderxz,0.f,0.f,0.f,0.f,0.f,mat);
+        else if (type == C_CAPPEDCYLINDERXY) c = NEW(cappedcylinderxy,0.f,0.f,0.f,0.f,0.f,mat);
+        else c = NEW(cappedcylinderyz,0.f,0.f,0.f,0.f,0.f,mat);
+        c->c = get<vec3f>();
+        c->r = get<float>();
+        c->h = get<float>();
+        return c.ptr;
+      }
+      case C_CAPSULE: {
+        const auto h = get<float>();
+        return NEW(capsule, h, get<float>(), mat);
+      }
+      case C_TORUS: {
+        const auto R = get<float>();
+        return NEW(torus, R, get<float>(), mat);
+      }
+      case C_CONE: {
+        const auto h = get<float>();
+        const auto r0 = get<float>();
+        return NEW(cone, h, r0, get<float>(), mat);
+      }
+      case C_ROUNDBOX: {
+        const auto extent = get<vec3f>();
+        return NEW(roundbox, extent, get<float>(), mat);
+      }
+      default: ok = false; return NULL;
+    }
+  }
+  const char *data, *end;
+  bool ok;
+};
+
+struct sceneheader {u32 magic, version, layout, hash, size;};
+
+// layout of the nodes in this build. a new node type or a new field changes it
+// so that the caches written by other builds are not read
+static u32 scenelayout() {
+  const u32 layout[] = {
+    u32(C_ROTATION), u32(sizeof(aabb)), u32(sizeof(vec3f)), u32(sizeof(quat3f)),
+    u32(sizeof(U)), u32(sizeof(D)), u32(sizeof(I)), u32(sizeof(R)),
+    u32(sizeof(sphere)), u32(sizeof(box)), u32(sizeof(plane)),
+    u32(sizeof(cylinderxz)), u32(sizeof(cylinderxy)), u32(sizeof(cylinderyz)),
+    u32(sizeof(cappedcylinderxz)), u32(sizeof(cappedcylinderxy)),
+    u32(sizeof(cappedcylinderyz)), u32(sizeof(capsule)), u32(sizeof(torus)),
+    u32(sizeof(cone)), u32(sizeof(roundbox)),
+    u32(sizeof(translation)), u32(sizeof(rotation))
+  };
+  return murmurhash2(layout);
+}
+
+static void writescene(const char *filename, const sceneheader &header, const node &n) {
+  auto f = fopen(filename, "wb");
+  if (f == NULL) {
+    con::out("csg: unable to write %s", filename);
+    return;
+  }
+  fwrite(&header, sizeof(header), 1, f);
+  scenewriter(f).run(&n);
+  fclose(f);
+}
+
+static ref<node> readscene(const char *filename, const sceneheader &header) {
+  int len = 0;
+  const auto buf = sys::loadfile(filename, &len);
+  if (buf == NULL) return NULL;
+  ref<node> n;
+  if (len >= int(sizeof(header)) && memcmp(buf, &header, sizeof(header)) == 0) {
+    scenereader reader(buf+sizeof(header), buf+len);
+    n = reader.run();
+    if (reader.data != reader.end) n = NULL;
+  }
+  FREE(buf);
+  return n;
+}
+} /* namespace */
+
+node *loadscene(const char *script) {
+  fixedstring s(script);
+  int len = 0;
+  const auto buf = sys::loadfile(sys::path(s.c_str()), &len);
+  if (buf == NULL) {
+    con::out("csg: unable to find %s", script);
+    return NULL;
+  }
+  const sceneheader header = {
+    SCENEMAGIC, SCENEVERSION, scenelayout(), murmurhash2(buf, len), u32(len)
+  };
+  fixedstring cache(fmt, "%s.bin", script);
+  sys::path(cache.c_str());
+  const auto cached = readscene(cache.c_str(), header);
+  if (cached) {
+    con::out("csg: %s is unchanged, scene loaded from %s", script, cache.c_str());
+    root = cached;
+  } else {
+    // only a script that just sets the root can be skipped next time
+    const auto prevroot = rootnum;
+    const auto preveffects = script::sideeffects();
+    script::execstring(buf);
+    if (rootnum == prevroot)
+      con::out("csg: %s does not set a root, scene not cached", script);
+    else if (script::sideeffects() != preveffects)
+      con::out("csg: %s has side effects, scene not cached", script);
+    else if (root)
+      writescene(cache.c_str(), header, *root);
+  }
+  FREE(buf);
+  return root.ptr;
+}
+
+/*--------------------------------------------------------------------------
+ - lower the tree into a program. "org" is the sum of the translations met
+ - since the last rotation. the frame maps the positions of the current
+ - register back to world space to get the culling boxes. nodes outside of
+ - the bounds are culled by any query inside them so they are not emitted at
+ - all and the operators left with one operand reduce to it
+ -------------------------------------------------------------------------*/
+namespace {
+struct frame {
+  INLINE frame() : q(1.f), org(zero), rotated(false) {}
+  INLINE frame(const quat3f &q, const vec3f &org) : q(q), org(org), rotated(true) {}
+  quat3f q;
+  vec3f org;
+  bool rotated;
+};
+
+struct compiler {
+  INLINE compiler(program &prog, const aabb &bounds) : prog(prog), bounds(bounds) {}
+  INLINE bool visible(const aabb &box) const {
+    return !isempty(intersection(box, bounds));
+  }
+  INLINE aabb cullbox(const node *n, const vec3f &org, const frame &f) const {
+    const aabb box(n->box.pmin+org, n->box.pmax+org);
+    if (!f.rotated) return box;
+    const auto world = rotatedaabb(f.q, box);
+    return isbounded(world) ? aabb(world.pmin+f.org, world.pmax+f.org) : world;
+  }
+  INLINE u32 emit(u32 op, const aabb &left, const aabb &right, u32 d, u32 m, u32 p, u32 t) {
+    instruction in;
+    in.box[0] = left;
+    in.box[1] = right;
+    in.param = vec4f(zero);
+    in.q = quat3f(1.f);
+    in.org = vec3f(zero);
+    in.op = op;
+    in.matindex = MAT_AIR_INDEX;
+    in.d = d; in.m = m; in.p = p; in.t = t;
+    in.right = in.next = 0;
+    prog.code.push_back(in);
+    return prog.code.size()-1;
+  }
+  void binary(u32 op, const node *left, const node *right, u32 d, u32 m, u32 p,
+              u32 depth, const vec3f &org, const frame &f)
+  {
+    const auto t = depth+1;
+    const auto lbox = cullbox(left, org, f);
+    const auto rbox = cullbox(right, org, f);
+    const auto isec = op == OP_INTERSECTION;
+    const auto goleft = visible(lbox), goright = visible(rbox);
+    if (!goleft || !goright) {
+      if (goleft && !isec)
+        build(left, d, m, p, depth, org, f);
+      else if (goright && op == OP_UNION)
+        build(right, d, m, p, depth, org, f);
+      return;
+    }
+    prog.regnum = max(prog.regnum, t+1);
+    const auto first = emit(op, lbox, rbox, d, m, p, t);
+    build(left, d, m, p, depth+1, org, f);
+    const auto mid = isec ? first : emit(op+1, lbox, rbox, d, m, p, t);
+    prog.code[first].right = prog.code.size();
+    build(right, t, isec ? m : t, p, depth+1, org, f);
+    emit(isec ? op+1 : op+2, lbox, rbox, d, m, p, t);
+    prog.code[first].next = prog.code[mid].next = prog.code.size();
+  }
+  u32 leaf(u32 op, const node *n, u32 d, u32 m, u32 p, const vec3f &org, const frame &f) {
+    const auto box = cullbox(n, org, f);
+    const auto idx = emit(op, box, box, d, m, p, 0);
+    auto &in = prog.code[idx];
+    in.matindex = static_cast<const materialnode*>(n)->matindex;
+    in.org = org;
+    in.q = f.q;
+    in.next = idx+1;
+    return idx;
+  }
+  void build(const node *n, u32 d, u32 m, u32 p, u32 depth, const vec3f &org, const frame &f) {
+    // the operators test the boxes of their operands like the interpreter
+    const auto op = n->type >= C_UNION && n->type <= C_REPLACE;
+    if (!op && n->type != C_TRANSLATION && !visible(cullbox(n, org, f))) return;
+    switch (n->type) {
+      case C_UNION: {
+        const auto u = static_cast<const U*>(n);
+        binary(OP_UNION, u->left, u->right, d, m, p, depth, org, f);
+      }
+      break;
+      case C_REPLACE: {
+        const auto r = static_cast<const R*>(n);
+        binary(OP_REPLACE, r->left, r->right, d, m, p, depth, org, f);
+      }
+      break;
+      case C_INTERSECTION: {
+        const auto i = static_cast<const I*>(n);
+        binary(OP_INTERSECTION, i->left, i->right, d, m, p, depth, org, f);
+      }
+      break;
+      case C_DIFFERENCE: {
+        const auto dn = static_cast<const D*>(n);
+        binary(OP_DIFFERENCE, dn->left, dn->right, d, m, p, depth, org, f);
+      }
+      break;
+      case C_TRANSLATION: {
+        const auto t = static_cast<const translation*>(n);
+        build(t->n, d, m, p, depth, org+t->p, f);
+      }
+      break;
+      case C_ROTATION: {
+        const auto r = static_cast<const rotation*>(n);
+        const auto box = cullbox(n, org, f);
+        const auto tp = prog.posnum++;
+        const auto first = emit(OP_ROTATION, box, box, d, m, p, tp);
+        prog.code[first].q = conj(r->q);
+        prog.code[first].org = org;
+        const frame rf(f.q*r->q, xfmpoint(f.q, org)+f.org);
+        build(r->n, d, m, tp, depth, vec3f(zero), rf);
+        prog.code[first].next = prog.code.size();
+      }
+      break;
+      case C_PLANE: {
+        const auto pl = static_cast<const plane*>(n);
+        const auto idx = leaf(OP_PLANE, n, d, m, p, org, f);
+        const auto nrm = pl->p.xyz();
+        prog.code[idx].param = vec4f(nrm, pl->p.w-dot(nrm, org));
+      }
+      break;
+#define CYL(NAME, COORD)\
+      case C_CYLINDER##NAME: {\
+        const auto c = static_cast<const cylinder##COORD*>(n);\
+        const auto idx = leaf(OP_CYLINDER##NAME, n, d, m, p, org, f);\
+        const auto cc = c->c##COORD + org.COORD();\
+        prog.code[idx].param = vec4f(cc.x, cc.y, c->r, 0.f);\
+      }\
+      break;
+      CYL(XY,xy); CYL(XZ,xz); CYL(YZ,yz);
+#undef CYL
+      case C_SPHERE: {
+        const auto s = static_cast<const sphere*>(n);
+        const auto idx = leaf(OP_SPHERE, n, d, m, p, org, f);
+        prog.code[idx].param = vec4f(s->r, 0.f, 0.f, 0.f);
+      }
+      break;
+      case C_BOX: {
+        const auto b = static_cast<const struct box*>(n);
+        const auto idx = leaf(OP_BOX, n, d, m, p, org, f);
+        prog.code[idx].param = vec4f(b->extent, 0.f);
+      }
+      break;
+#define CAPPEDCYL(NAME)\
+      case C_CAPPEDCYLINDER##NAME: {\
+        const auto c = static_cast<const cappedcylinder*>(n);\
+        const auto idx = leaf(OP_CAPPEDCYLINDER##NAME, n, d, m, p, org, f);\
+        prog.code[idx].org += c->c;\
+        prog.code[idx].param = vec4f(c->r, c->h, 0.f, 0.f);\
+      }\
+      break;
+      CAPPEDCYL(XY); CAPPEDCYL(XZ); CAPPEDCYL(YZ);
+#undef CAPPEDCYL
+      case C_CAPSULE: {
+        const auto c = static_cast<const capsule*>(n);
+        const auto idx = leaf(OP_CAPSULE, n, d, m, p, org, f);
+        prog.code[idx].param = vec4f(c->h, c->r, 0.f, 0.f);
+      }
+      break;
+      case C_TORUS: {
+        const auto t = static_cast<const torus*>(n);
+        const auto idx = leaf(OP_TORUS, n, d, m, p, org, f);
+        prog.code[idx].param = vec4f(t->R, t->r, 0.f, 0.f);
+      }
+      break;
+      case C_CONE: {
+        const auto c = static_cast<const cone*>(n);
+        const auto idx = leaf(OP_CONE, n, d, m, p, org, f);
+        prog.code[idx].param = vec4f(c->h, c->r0, c->r1, 0.f);
+      }
+      break;
+      case C_ROUNDBOX: {
+        const auto b = static_cast<const roundbox*>(n);
+        const auto idx = leaf(OP_ROUNDBOX, n, d, m, p, org, f);
+        prog.code[idx].param = vec4f(b->extent, b->r);
+      }
+      break;
+      case C_EMPTY: break;
+      case C_INVALID: assert("unreachable" && false);
+    }
+  }
+  program &prog;
+  aabb bounds;
+};
+} /* namespace */
+
+program *compile(const node &n, const aabb &bounds, program *prog) {
+  if (prog == NULL) prog = NEWE(program);
+  prog->root = &n;
+  prog->code.resize(0);
+  prog->regnum = prog->posnum = 1;
+  compiler(*prog, bounds).build(&n, 0, 0, 0, 0, vec3f(zero), frame());
+  return prog;
+}
+
+void destroyprogram(program *prog) { DEL(prog); }
+
 void start() {
 #define ENUM(NAMESPACE,NAME,VALUE)\
   static const u32 NAME = VALUE;\
@@ -57,6 +735,13 @@ void start() {
     ADDCLASS(cylinderxz,void(*)(float,float,float,u32))
     ADDCLASS(cylinderxy,void(*)(float,float,float,u32))
     ADDCLASS(cylinderyz,void(*)(float,float,float,u32))
+    ADDCLASS(cappedcylinderxz,void(*)(float,float,float,float,float,u32))
+    ADDCLASS(cappedcylinderxy,void(*)(float,float,float,float,float,u32))
+    ADDCLASS(cappedcylinderyz,void(*)(float,float,float,float,float,u32))
+    ADDCLASS(capsule,void(*)(float,float,u32))
+    ADDCLASS(torus,void(*)(float,float,u32))
+    ADDCLASS(cone,void(*)(float,float,float,u32))
+    ADDCLASS(roundbox,void(*)(float,float,float,float,u32))
     ADDCLASS(translation,void(*)(float,float,float,const ref<node>&))
     ADDCLASS(rotation,void(*)(float,float,float,const ref<node>&))
   .endNamespace()
@@ -39,6 +39,8 @@ material *getmaterial(u32 matindex);
 enum CSGOP {
   C_EMPTY, C_UNION, C_DIFFERENCE, C_INTERSECTION, C_REPLACE,
   C_SPHERE, C_BOX, C_PLANE, C_CYLINDERXZ, C_CYLINDERYZ, C_CYLINDERXY,
+  C_CAPPEDCYLINDERXZ, C_CAPPEDCYLINDERYZ, C_CAPPEDCYLINDERXY,
+  C_CAPSULE, C_TORUS, C_CONE, C_ROUNDBOX,
   C_TRANSLATION, C_ROTATION,
   C_INVALID = 0xffffffff
 };
@@ -54,8 +56,22 @@ struct node : refcount {
 };
 
 node *makescene();
+// replace the root of the scene from code. it is rebalanced like the ones set
+// by the scripts and the new root is returned
+node *setscene(const ref<node> &n);
+// run the script that builds the scene. its tree is cached in "<script>.bin"
+// and loaded from there while the script contents do not change. scripts
+// with side effects (globals, variables, other scripts) are never cached
+node *loadscene(const char *script);
 void destroyscene(node *n);
 
+// flat version of a tree run by the many points evaluators. only the nodes
+// touching the bounds are kept and the program then only gives the distance
+// for queries inside them. an existing program can be given to reuse it
+struct program;
+program *compile(const node &n, const aabb &bounds = aabb::all(), program *prog = NULL);
+void destroyprogram(program *p);
+
 /*--------------------------------------------------------------------------
  - for soa computations
  -------------------------------------------------------------------------*/
@@ -8,6 +8,43 @@
 
 namespace q {
 namespace csg {
+static float finitedist(const node *n, const vec3f &pos) {
+  switch (n->type) {
+    case C_CAPPEDCYLINDERXZ: {
+      const auto c = static_cast<const cappedcylinder*>(n);
+      const auto p = pos-c->c;
+      return cappedcylinderdist(p.xz(), p.y, c->r, c->h);
+    }
+    case C_CAPPEDCYLINDERXY: {
+      const auto c = static_cast<const cappedcylinder*>(n);
+      const auto p = pos-c->c;
+      return cappedcylinderdist(p.xy(), p.z, c->r, c->h);
+    }
+    case C_CAPPEDCYLINDERYZ: {
+      const auto c = static_cast<const cappedcylinder*>(n);
+      const auto p = pos-c->c;
+      return cappedcylinderdist(p.yz(), p.x, c->r, c->h);
+    }
+    case C_CAPSULE: {
+      const auto c = static_cast<const capsule*>(n);
+      return capsuledist(pos, c->h, c->r);
+    }
+    case C_TORUS: {
+      const auto t = static_cast<const torus*>(n);
+      return torusdist(pos, t->R, t->r);
+    }
+    case C_CONE: {
+      const auto c = static_cast<const cone*>(n);
+      return conedist(pos, c->h, c->r0, c->r1);
+    }
+    case C_ROUNDBOX: {
+      const auto b = static_cast<const roundbox*>(n);
+      return roundboxdist(pos, b->extent, b->r);
+    }
+    default: assert("unreachable" && false); return FLT_MAX;
+  }
+}
+
 static void distr(const node *RESTRICT n, const array3f &RESTRICT pos,
                   const arrayf *RESTRICT normaldist, arrayf &RESTRICT dist,
                   arrayi &RESTRICT matindex, int num, const aabb &RESTRICT box)
@@ -117,8 +154,9 @@ static void distr(const node *RESTRICT n, const array3f &RESTRICT pos,
       if (any(gt(isec.pmin, isec.pmax))) break;
       const auto r = static_cast<const rotation*>(n);
       array3f tpos;
-      loopi(num) set(tpos, xfmpoint(conj(r->q), get(pos,i)), i);
-      distr(r->n, tpos, normaldist, dist, matindex, num, aabb::all());
+      const auto rq = conj(r->q);
+      loopi(num) set(tpos, xfmpoint(rq, get(pos,i)), i);
+      distr(r->n, tpos, normaldist, dist, matindex, num, rotatedaabb(rq, box));
     }
     break;
     case C_PLANE: {
@@ -168,6 +206,17 @@ static void distr(const node *RESTRICT n, const array3f &RESTRICT pos,
       }
     }
     break;
+    case C_CAPPEDCYLINDERXZ: case C_CAPPEDCYLINDERXY: case C_CAPPEDCYLINDERYZ:
+    case C_CAPSULE: case C_TORUS: case C_CONE: case C_ROUNDBOX: {
+      const auto isec = intersection(n->box, box);
+      if (any(gt(isec.pmin, isec.pmax))) break;
+      const auto mat = static_cast<const materialnode*>(n)->matindex;
+      loopi(num) {
+        dist[i] = finitedist(n, get(pos,i));
+        matindex[i] = dist[i] < 0.f ? mat : matindex[i];
+      }
+    }
+    break;
     case C_EMPTY: break;
     case C_INVALID: assert("unreachable" && false);
   }
@@ -182,6 +231,27 @@ void dist(const node *RESTRICT n, const array3f &RESTRICT pos,
   distr(n, pos, normaldist, d, mat, num, box);
 }
 
+// no flattening for the slow path. we simply walk the original tree and
+// use finite differences for the gradients
+void dist(const program *RESTRICT prog, const array3f &RESTRICT pos,
+          const arrayf *RESTRICT normaldist, arrayf &RESTRICT d,
+          arrayi &RESTRICT mat, int num, const aabb &RESTRICT box,
+          array3f *RESTRICT grad)
+{
+  dist(prog->root, pos, normaldist, d, mat, num, box);
+  if (grad == NULL) return;
+  const auto h = 1e-3f;
+  const aabb gradbox(box.pmin-vec3f(h), box.pmax);
+  loopj(3) {
+    array3f p = pos;
+    arrayf dh;
+    arrayi mh;
+    loopi(num) p[j][i] -= h;
+    dist(prog->root, p, normaldist, dh, mh, num, gradbox);
+    loopi(num) (*grad)[j][i] = (d[i]-dh[i]) / h;
+  }
+}
+
 float dist(const node *n, const vec3f &pos, const aabb &box) {
   const auto isec = intersection(box, n->box);
   if (any(gt(isec.pmin, isec.pmax))) return FLT_MAX;
@@ -214,7 +284,8 @@ float dist(const node *n, const vec3f &pos, const aabb &box) {
     }
     case C_ROTATION: {
       const auto r = static_cast<const rotation*>(n);
-      return dist(r->n, xfmpoint(conj(r->q), pos), aabb::all());
+      const auto rq = conj(r->q);
+      return dist(r->n, xfmpoint(rq, pos), rotatedaabb(rq, box));
     }
     case C_PLANE: {
       const auto p = static_cast<const plane*>(n);
@@ -241,10 +312,89 @@ float dist(const node *n, const vec3f &pos, const aabb &box) {
       const auto dist = min(max(d.x,max(d.y,d.z)),0.0f)+length(max(d,vec3f(zero)));
       return dist;
     }
+    case C_CAPPEDCYLINDERXZ: case C_CAPPEDCYLINDERXY: case C_CAPPEDCYLINDERYZ:
+    case C_CAPSULE: case C_TORUS: case C_CONE: case C_ROUNDBOX:
+      return finitedist(n, pos);
     case C_EMPTY: return FLT_MAX;
     default: assert("unreachable" && false); return FLT_MAX;
   }
 }
+
+/*--------------------------------------------------------------------------
+ - interval evaluation. primitives give exact ranges or use their center
+ - distance and the fact they are 1-lipschitz. everything outside a node
+ - box is outside of the node so we use the box to box distance there. as
+ - csg operators only bound the distance, only the sign of the range is
+ - guaranteed for all points of the box
+ -------------------------------------------------------------------------*/
+static INLINE float boxdist(const aabb &b0, const aabb &b1) {
+  const auto d = max(max(b0.pmin-b1.pmax, b1.pmin-b0.pmax), vec3f(zero));
+  return min(length(d), FLT_MAX);
+}
+template <typename T>
+static INLINE intervalf centerdist(const T &pmin, const T &pmax, float r) {
+  const auto nearest = max(max(pmin, -pmax), T(zero));
+  const auto farthest = max(abs(pmin), abs(pmax));
+  return intervalf(length(nearest)-r, length(farthest)-r);
+}
+
+intervalf dist(const node *n, const aabb &box) {
+  if (!isbounded(box)) return intervalf(-FLT_MAX, FLT_MAX);
+  if (n->type == C_EMPTY) return intervalf(FLT_MAX, FLT_MAX);
+  if (isempty(intersection(box, n->box)))
+    return intervalf(boxdist(box, n->box), FLT_MAX);
+  switch (n->type) {
+    case C_UNION: {
+      const auto u = static_cast<const U*>(n);
+      const auto left = dist(u->left, box), right = dist(u->right, box);
+      return intervalf(min(left.m,right.m), min(left.M,right.M));
+    }
+    case C_INTERSECTION: {
+      const auto i = static_cast<const I*>(n);
+      const auto left = dist(i->left, box), right = dist(i->right, box);
+      return intervalf(max(left.m,right.m), max(left.M,right.M));
+    }
+    case C_DIFFERENCE: {
+      const auto d = static_cast<const D*>(n);
+      const auto left = dist(d->left, box), right = dist(d->right, box);
+      return intervalf(max(left.m,-right.M), max(left.M,-right.m));
+    }
+    case C_REPLACE: return dist(static_cast<const R*>(n)->left, box);
+    case C_TRANSLATION: {
+      const auto t = static_cast<const translation*>(n);
+      return dist(t->n, aabb(box.pmin-t->p, box.pmax-t->p));
+    }
+    case C_ROTATION: {
+      const auto r = static_cast<const rotation*>(n);
+      return dist(r->n, rotatedaabb(conj(r->q), box));
+    }
+    case C_PLANE: {
+      const auto p = static_cast<const plane*>(n);
+      const auto center = (box.pmin+box.pmax)*0.5f, extent = (box.pmax-box.pmin)*0.5f;
+      const auto d = dot(center, p->p.xyz()) + p->p.w;
+      const auto r = dot(extent, abs(p->p.xyz()));
+      return intervalf(d-r, d+r);
+    }
+#define CYL(NAME, COORD)\
+    case C_CYLINDER##NAME: {\
+      const auto c = static_cast<const cylinder##COORD*>(n);\
+      return centerdist(box.pmin.COORD()-c->c##COORD, box.pmax.COORD()-c->c##COORD, c->r);\
+    }
+    CYL(XY,xy); CYL(XZ,xz); CYL(YZ,yz);
+#undef CYL
+    case C_SPHERE:
+      return centerdist(box.pmin, box.pmax, static_cast<const sphere*>(n)->r);
+    case C_BOX: case C_CAPPEDCYLINDERXZ: case C_CAPPEDCYLINDERXY:
+    case C_CAPPEDCYLINDERYZ: case C_CAPSULE: case C_TORUS: case C_CONE:
+    case C_ROUNDBOX: {
+      const auto center = (box.pmin+box.pmax)*0.5f;
+      const auto r = length(box.pmax-box.pmin)*0.5f;
+      const auto d = dist(n, center);
+      return intervalf(d-r, d+r);
+    }
+    default: assert("unreachable" && false); return intervalf(-FLT_MAX, FLT_MAX);
+  }
+}
 } /* namespace csg */
 } /* namespace q */
 
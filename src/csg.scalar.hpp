@@ -10,6 +10,9 @@ namespace csg {
 // single point csg evaluation
 float dist(const node*, const vec3f&, const aabb &box = aabb::all());
 
+// conservative range of the distance field over a box
+intervalf dist(const node*, const aabb&);
+
 INLINE void set(array3f &v, vec3f u, u32 idx) {
   v[0][idx]=u.x; v[1][idx]=u.y; v[2][idx]=u.z;
 }
@@ -5,6 +5,7 @@
 #include "csginternal.hpp"
 #include "csg.hpp"
 #include "soa.hpp"
+#include "base/task.hpp"
 
 namespace q {
 namespace csg {
@@ -25,6 +26,107 @@ INLINE bool empty(const ssebox &box) {
   return (movemask(box.pmin>box.pmax)&0x7) != 0;
 }
 
+INLINE soaf boxdist(const soa3f &pd) {
+  return min(max(pd.x,max(pd.y,pd.z)),soaf(zero)) + length(max(pd,soa3f(zero)));
+}
+
+// unit vector or zero when the direction is undefined
+INLINE soa3f unit(const soa3f &v) {
+  const auto len = length(v);
+  return v * select(len>soaf(zero), soaf(1.f)/len, soaf(zero));
+}
+INLINE soa2f unit(const soa2f &v) {
+  const auto len = length(v);
+  return v * select(len>soaf(zero), soaf(1.f)/len, soaf(zero));
+}
+INLINE soaf signof(const soaf &x) {
+  return select(x<soaf(zero), soaf(-1.f), soaf(1.f));
+}
+
+// gradient of boxdist for a box centered on the origin. outside, this is the
+// direction to the closest point. inside, this is the axis of the closest face
+INLINE soa3f boxgrad(const soa3f &p, const soa3f &pd) {
+  const auto m = max(pd.x,max(pd.y,pd.z));
+  const auto ix = pd.x>=m, iy = (pd.y>=m) & (pd.x<m), iz = (pd.x<m) & (pd.y<m);
+  const auto one = soaf(1.f);
+  const auto inside = soa3f(select(ix,one,soaf(zero)),
+                            select(iy,one,soaf(zero)),
+                            select(iz,one,soaf(zero)));
+  const auto g = select(m>soaf(zero), unit(max(pd,soa3f(zero))), inside);
+  return soa3f(select(p.x<soaf(zero),-g.x,g.x),
+               select(p.y<soaf(zero),-g.y,g.y),
+               select(p.z<soaf(zero),-g.z,g.z));
+}
+
+// gradients of the finite primitives. p is relative to their center
+INLINE soa3f cappedcylindergrad(const soa3f &p, const vec3f &axis, float r, float h) {
+  const auto a = dot(p, soa3f(axis));
+  const auto radial = p - soa3f(axis)*a;
+  const auto q = soa2f(length(radial)-soaf(r), abs(a)-soaf(h));
+  const auto m = max(q.x,q.y);
+  const auto g = select(m>soaf(zero), unit(max(q,soa2f(zero))),
+    soa2f(select(q.x>=m,soaf(1.f),soaf(zero)), select(q.x>=m,soaf(zero),soaf(1.f))));
+  return unit(radial)*g.x + soa3f(axis)*(signof(a)*g.y);
+}
+INLINE soa3f capsulegrad(const soa3f &p, float h) {
+  return unit(soa3f(p.x, p.y-clamp(p.y,soaf(-h),soaf(h)), p.z));
+}
+INLINE soa3f torusgrad(const soa3f &p, float R) {
+  const auto ring = unit(p.xz())*soaf(R);
+  return unit(soa3f(p.x-ring.x, p.y, p.z-ring.y));
+}
+// same closest feature as conedist in the (radius, height) plane
+INLINE soa3f conegrad(const soa3f &p, float h, float r0, float r1) {
+  const soa2f q(length(p.xz()), p.y);
+  const auto k1 = soa2f(soaf(r1), soaf(h)), k2 = soa2f(soaf(r1-r0), soaf(2.f*h));
+  const auto rcp = soaf(1.f/((r1-r0)*(r1-r0)+4.f*h*h));
+  const soa2f ca(q.x-min(q.x, select(q.y<soaf(zero), soaf(r0), soaf(r1))), abs(q.y)-soaf(h));
+  const auto cb = q - k1 + k2*clamp(dot(k1-q,k2)*rcp, soaf(zero), soaf(1.f));
+  const auto s = select((cb.x<soaf(zero)) & (ca.y<soaf(zero)), soaf(-1.f), soaf(1.f));
+  const auto closecap = dot(ca,ca) < dot(cb,cb);
+  const soa2f v(select(closecap, ca.x, cb.x), select(closecap, ca.y*signof(q.y), cb.y));
+  const auto g = unit(v)*s;
+  const auto radial = unit(p.xz());
+  return soa3f(radial.x*g.x, g.y, radial.y*g.x);
+}
+
+INLINE soaf finitedist(const node *n, const soa3f &pos) {
+  switch (n->type) {
+    case C_CAPPEDCYLINDERXZ: {
+      const auto c = static_cast<const cappedcylinder*>(n);
+      const auto p = pos-soa3f(c->c);
+      return cappedcylinderdist(p.xz(), p.y, c->r, c->h);
+    }
+    case C_CAPPEDCYLINDERXY: {
+      const auto c = static_cast<const cappedcylinder*>(n);
+      const auto p = pos-soa3f(c->c);
+      return cappedcylinderdist(p.xy(), p.z, c->r, c->h);
+    }
+    case C_CAPPEDCYLINDERYZ: {
+      const auto c = static_cast<const cappedcylinder*>(n);
+      const auto p = pos-soa3f(c->c);
+      return cappedcylinderdist(p.yz(), p.x, c->r, c->h);
+    }
+    case C_CAPSULE: {
+      const auto c = static_cast<const capsule*>(n);
+      return capsuledist(pos, c->h, c->r);
+    }
+    case C_TORUS: {
+      const auto t = static_cast<const torus*>(n);
+      return torusdist(pos, t->R, t->r);
+    }
+    case C_CONE: {
+      const auto c = static_cast<const cone*>(n);
+      return conedist(pos, c->h, c->r0, c->r1);
+    }
+    case C_ROUNDBOX: {
+      const auto b = static_cast<const roundbox*>(n);
+      return roundboxdist(pos, b->extent, b->r);
+    }
+    default: assert("unreachable" && false); return soaf(FLT_MAX);
+  }
+}
+
 static void distr(const node *RESTRICT n, const array3f &RESTRICT pos,
                   const arrayf *RESTRICT normaldist, arrayf &RESTRICT dist,
                   arrayi &RESTRICT matindex, int packetnum,
@@ -178,7 +280,12 @@ static void distr(const node *RESTRICT n, const array3f &RESTRICT pos,
       const auto rq = quat<soaf>(conj(r->q));
       CACHE_LINE_ALIGNED array3f tpos;
       loopi(packetnum) sset(tpos, xfmpoint(rq, sget(pos,i)), i);
-      distr(r->n, tpos, normaldist, dist, matindex, packetnum, aabb::all());
+      CACHE_LINE_ALIGNED vec4f pmin, pmax;
+      storeu4f(&pmin, box.pmin);
+      storeu4f(&pmax, box.pmax);
+      const aabb rbox(pmin.xyz(), pmax.xyz());
+      distr(r->n, tpos, normaldist, dist, matindex, packetnum,
+            ssebox(rotatedaabb(conj(r->q), rbox)));
     }
     break;
     case C_PLANE: {
@@ -254,6 +361,20 @@ static void distr(const node *RESTRICT n, const array3f &RESTRICT pos,
       }
     }
     break;
+    case C_CAPPEDCYLINDERXZ: case C_CAPPEDCYLINDERXY: case C_CAPPEDCYLINDERYZ:
+    case C_CAPSULE: case C_TORUS: case C_CONE: case C_ROUNDBOX: {
+      const auto isec = intersection(ssebox(n->box), box);
+      if (empty(isec)) break;
+      const auto newindex = soai(static_cast<const materialnode*>(n)->matindex);
+      loopi(packetnum) {
+        const auto idx = i*soaf::size;
+        const auto oldindex = soai::load(&matindex[idx]);
+        const auto nd = finitedist(n, sget(pos,i));
+        store(&dist[idx], nd);
+        store(&matindex[idx], select(nd<soaf(zero), newindex, oldindex));
+      }
+    }
+    break;
     case C_EMPTY: break;
     case C_INVALID: assert("unreachable" && false);
   }
@@ -271,6 +392,299 @@ void dist(const node *RESTRICT n, const array3f &RESTRICT pos,
   distr(n, pos, normaldist, d, mat, packetnum, ssebox(box));
   AVX_ZERO_UPPER();
 }
+
+/*--------------------------------------------------------------------------
+ - interpreter for compiled programs. the union retargets its temporary
+ - register to its destination when only the right operand is visited,
+ - which is what the recursive version does. when requested, the gradients
+ - live in registers indexed as the distances. the primitives output them in
+ - world space and the operators select them as they select the distances
+ -------------------------------------------------------------------------*/
+INLINE bool culled(const aabb &box, const ssebox &qbox) {
+  return empty(intersection(ssebox(box), qbox));
+}
+INLINE void cleargrad(array3f &grad, int packetnum) {
+  loopi(packetnum) sset(grad, soa3f(zero), i);
+}
+
+void dist(const program *RESTRICT prog, const array3f &RESTRICT pos,
+          const arrayf *RESTRICT normaldist, arrayf &RESTRICT d,
+          arrayi &RESTRICT mat, int num, const aabb &RESTRICT box,
+          array3f *RESTRICT grad)
+{
+  const auto packetnum = num/soaf::size + (num%soaf::size?1:0);
+  loopi(packetnum) {
+    store(&d[i*soaf::size], soaf(FLT_MAX));
+    store(&mat[i*soaf::size], soai(int(MAT_AIR_INDEX)));
+  }
+  if (grad) cleargrad(*grad, packetnum);
+
+  // register files. they live in the scratch memory of the thread. the
+  // alignment of the array typedefs is lost as template argument
+  auto &scratch = task::scratch();
+  const auto marker = scratch.mark();
+  const auto regnum = prog->regnum, posnum = prog->posnum;
+  const auto dstore = scratch.alloc<arrayf>(regnum);
+  const auto mstore = scratch.alloc<arrayi>(regnum);
+  const auto pstore = scratch.alloc<array3f>(posnum);
+  const auto gstore = grad ? scratch.alloc<array3f>(regnum) : NULL;
+  const auto dreg = scratch.alloc<arrayf*>(regnum);
+  const auto mreg = scratch.alloc<arrayi*>(regnum);
+  const auto preg = scratch.alloc<const array3f*>(posnum);
+  const auto greg = scratch.alloc<array3f*>(regnum);
+  dreg[0] = &d;
+  mreg[0] = &mat;
+  preg[0] = &pos;
+  greg[0] = grad;
+
+  const ssebox qbox(box);
+  const auto code = prog->code.data();
+  const u32 codenum = prog->code.size();
+  for (u32 pc = 0; pc < codenum;) {
+    const auto &in = code[pc];
+    switch (in.op) {
+      case OP_UNION: {
+        const auto goleft = !culled(in.box[0], qbox);
+        const auto goright = !culled(in.box[1], qbox);
+        if (goleft && goright) {
+          auto &td = *(dreg[in.t] = dstore+in.t);
+          auto &tm = *(mreg[in.t] = mstore+in.t);
+          loopi(packetnum) {
+            const auto idx = i*soaf::size;
+            store(&td[idx], soaf(FLT_MAX));
+            store(&tm[idx], soai(int(MAT_AIR_INDEX)));
+          }
+          if (grad) cleargrad(*(greg[in.t] = gstore+in.t), packetnum);
+        } else if (goright) {
+          dreg[in.t] = dreg[in.d];
+          mreg[in.t] = mreg[in.m];
+          greg[in.t] = greg[in.d];
+        }
+        pc = goleft ? pc+1 : (goright ? in.right : in.next);
+      }
+      break;
+      case OP_UNION_RIGHT:
+        pc = culled(in.box[1], qbox) ? in.next : pc+1;
+      break;
+      case OP_UNION_END: {
+        pc++;
+        if (culled(in.box[0], qbox)) break;
+        auto &dist = *dreg[in.d];
+        const auto &tempdist = *dreg[in.t];
+        auto &matindex = *mreg[in.m];
+        const auto &tempmatindex = *mreg[in.t];
+        loopi(packetnum) {
+          const auto idx = i*soaf::size;
+          const auto old = soai::load(&matindex[idx]);
+          const auto tmp = soai::load(&tempmatindex[idx]);
+          store(&matindex[idx], select(old > tmp, old, tmp));
+        }
+        if (grad) loopi(packetnum) {
+          const auto idx = i*soaf::size;
+          const auto d = soaf::load(&dist[idx]);
+          const auto td = soaf::load(&tempdist[idx]);
+          auto take = td<d;
+          if (normaldist) take |= abs(td)<soaf::load(&(*normaldist)[idx]);
+          sset(*greg[in.d], select(take, sget(*greg[in.t],i), sget(*greg[in.d],i)), i);
+        }
+        if (normaldist) loopi(packetnum) {
+          const auto idx = i*soaf::size;
+          const auto d = soaf::load(&dist[idx]);
+          const auto td = soaf::load(&tempdist[idx]);
+          const auto nd = soaf::load(&(*normaldist)[idx]);
+          store(&dist[idx], select(abs(td)<nd, td, min(d, td)));
+        } else loopi(packetnum) {
+          const auto idx = i*soaf::size;
+          const auto d = soaf::load(&dist[idx]);
+          const auto td = soaf::load(&tempdist[idx]);
+          store(&dist[idx], min(d,td));
+        }
+      }
+      break;
+      case OP_REPLACE:
+        pc = culled(in.box[0], qbox) ? in.next : pc+1;
+      break;
+      case OP_REPLACE_RIGHT: {
+        if (culled(in.box[1], qbox)) {
+          pc = in.next;
+          break;
+        }
+        auto &td = *(dreg[in.t] = dstore+in.t);
+        auto &tm = *(mreg[in.t] = mstore+in.t);
+        loopi(packetnum) {
+          const auto idx = i*soaf::size;
+          store(&td[idx], soaf(FLT_MAX));
+          store(&tm[idx], soai(int(MAT_AIR_INDEX)));
+        }
+        if (grad) cleargrad(*(greg[in.t] = gstore+in.t), packetnum);
+        pc++;
+      }
+      break;
+      case OP_REPLACE_END: {
+        pc++;
+        auto &dist = *dreg[in.d];
+        const auto &tempdist = *dreg[in.t];
+        auto &matindex = *mreg[in.m];
+        const auto &tempmatindex = *mreg[in.t];
+        loopi(packetnum) {
+          const auto idx = i*soaf::size;
+          const auto d = soaf::load(&dist[idx]);
+          const auto td = soaf::load(&tempdist[idx]);
+          const auto insideright = (td<soaf(zero)) & (d<soaf(zero));
+          const auto tmpindex = soai::load(&tempmatindex[idx]);
+          const auto oldindex = soai::load(&matindex[idx]);
+          store(&matindex[idx], select(insideright, tmpindex, oldindex));
+        }
+        if (normaldist) loopi(packetnum) {
+          const auto idx = i*soaf::size;
+          const auto d = soaf::load(&dist[idx]);
+          const auto td = soaf::load(&tempdist[idx]);
+          const auto nd = soaf::load(&(*normaldist)[idx]);
+          const auto take = (d<soaf(zero)) & (abs(td)<nd);
+          if (grad)
+            sset(*greg[in.d], select(take, sget(*greg[in.t],i), sget(*greg[in.d],i)), i);
+          store(&dist[idx], select(take, td, d));
+        }
+      }
+      break;
+      case OP_INTERSECTION: {
+        if (culled(in.box[0], qbox) || culled(in.box[1], qbox)) {
+          pc = in.next;
+          break;
+        }
+        auto &td = *(dreg[in.t] = dstore+in.t);
+        loopi(packetnum) store(&td[i*soaf::size], soaf(FLT_MAX));
+        if (grad) cleargrad(*(greg[in.t] = gstore+in.t), packetnum);
+        pc++;
+      }
+      break;
+      case OP_INTERSECTION_END: {
+        pc++;
+        auto &dist = *dreg[in.d];
+        const auto &tempdist = *dreg[in.t];
+        auto &matindex = *mreg[in.m];
+        if (grad) loopi(packetnum) {
+          const auto idx = i*soaf::size;
+          const auto take = soaf::load(&tempdist[idx]) > soaf::load(&dist[idx]);
+          sset(*greg[in.d], select(take, sget(*greg[in.t],i), sget(*greg[in.d],i)), i);
+        }
+        loopi(packetnum) {
+          const auto idx = i*soaf::size;
+          const auto md = max(soaf::load(&dist[idx]), soaf::load(&tempdist[idx]));
+          const auto oldindex = soai::load(&matindex[idx]);
+          const auto airindex = soai(int(MAT_AIR_INDEX));
+          store(&dist[idx], md);
+          store(&matindex[idx], select(md>=soaf(zero), airindex, oldindex));
+        }
+      }
+      break;
+      case OP_DIFFERENCE:
+        pc = culled(in.box[0], qbox) ? in.next : pc+1;
+      break;
+      case OP_DIFFERENCE_RIGHT: {
+        if (culled(in.box[1], qbox)) {
+          pc = in.next;
+          break;
+        }
+        auto &td = *(dreg[in.t] = dstore+in.t);
+        mreg[in.t] = mstore+in.t;
+        loopi(packetnum) store(&td[i*soaf::size], soaf(FLT_MAX));
+        if (grad) cleargrad(*(greg[in.t] = gstore+in.t), packetnum);
+        pc++;
+      }
+      break;
+      case OP_DIFFERENCE_END: {
+        pc++;
+        auto &dist = *dreg[in.d];
+        const auto &tempdist = *dreg[in.t];
+        auto &matindex = *mreg[in.m];
+        if (grad) loopi(packetnum) {
+          const auto idx = i*soaf::size;
+          const auto take = -soaf::load(&tempdist[idx]) > soaf::load(&dist[idx]);
+          sset(*greg[in.d], select(take, -sget(*greg[in.t],i), sget(*greg[in.d],i)), i);
+        }
+        loopi(packetnum) {
+          const auto idx = i*soaf::size;
+          const auto md = max(soaf::load(&dist[idx]), -soaf::load(&tempdist[idx]));
+          const auto oldindex = soai::load(&matindex[idx]);
+          const auto airindex = soai(int(MAT_AIR_INDEX));
+          store(&dist[idx], md);
+          store(&matindex[idx], select(md>=soaf(zero), airindex, oldindex));
+        }
+      }
+      break;
+      case OP_ROTATION: {
+        if (culled(in.box[0], qbox)) {
+          pc = in.next;
+          break;
+        }
+        const auto &src = *preg[in.p];
+        auto &dst = pstore[in.t];
+        const auto rq = quat<soaf>(in.q);
+        const auto org = soa3f(in.org);
+        loopi(packetnum) sset(dst, xfmpoint(rq, sget(src,i)-org), i);
+        preg[in.t] = &dst;
+        pc++;
+      }
+      break;
+
+#define PRIMITIVE(OP, DIST, GRAD) \
+      case OP: {\
+        pc++;\
+        if (culled(in.box[0], qbox)) break;\
+        const auto &p = *preg[in.p];\
+        auto &dist = *dreg[in.d];\
+        auto &matindex = *mreg[in.m];\
+        const auto newindex = soai(int(in.matindex));\
+        loopi(packetnum) {\
+          const auto idx = i*soaf::size;\
+          const auto oldindex = soai::load(&matindex[idx]);\
+          const auto nd = DIST;\
+          store(&dist[idx], nd);\
+          store(&matindex[idx], select(nd<soaf(zero), newindex, oldindex));\
+        }\
+        if (grad) {\
+          const auto rq = quat<soaf>(in.q);\
+          loopi(packetnum) sset(*greg[in.d], xfmvector(rq, GRAD), i);\
+        }\
+      }\
+      break;
+      PRIMITIVE(OP_SPHERE, length(sget(p,i)-soa3f(in.org))-soaf(in.param.x),
+        unit(sget(p,i)-soa3f(in.org)))
+      PRIMITIVE(OP_PLANE, dot(sget(p,i), soa3f(in.param.xyz()))+soaf(in.param.w),
+        soa3f(in.param.xyz()))
+      PRIMITIVE(OP_CYLINDERXY, length(sget(p,i).xy()-soa2f(in.param.xy()))-soaf(in.param.z),
+        unit(soa3f(sget(p,i).x-soaf(in.param.x), sget(p,i).y-soaf(in.param.y), soaf(zero))))
+      PRIMITIVE(OP_CYLINDERXZ, length(sget(p,i).xz()-soa2f(in.param.xy()))-soaf(in.param.z),
+        unit(soa3f(sget(p,i).x-soaf(in.param.x), soaf(zero), sget(p,i).z-soaf(in.param.y))))
+      PRIMITIVE(OP_CYLINDERYZ, length(sget(p,i).yz()-soa2f(in.param.xy()))-soaf(in.param.z),
+        unit(soa3f(soaf(zero), sget(p,i).y-soaf(in.param.x), sget(p,i).z-soaf(in.param.y))))
+      PRIMITIVE(OP_BOX, boxdist(abs(sget(p,i)-soa3f(in.org))-soa3f(in.param.xyz())),
+        boxgrad(sget(p,i)-soa3f(in.org), abs(sget(p,i)-soa3f(in.org))-soa3f(in.param.xyz())))
+      PRIMITIVE(OP_CAPPEDCYLINDERXZ,
+        cappedcylinderdist((sget(p,i)-soa3f(in.org)).xz(), (sget(p,i)-soa3f(in.org)).y, in.param.x, in.param.y),
+        cappedcylindergrad(sget(p,i)-soa3f(in.org), vec3f(0.f,1.f,0.f), in.param.x, in.param.y))
+      PRIMITIVE(OP_CAPPEDCYLINDERXY,
+        cappedcylinderdist((sget(p,i)-soa3f(in.org)).xy(), (sget(p,i)-soa3f(in.org)).z, in.param.x, in.param.y),
+        cappedcylindergrad(sget(p,i)-soa3f(in.org), vec3f(0.f,0.f,1.f), in.param.x, in.param.y))
+      PRIMITIVE(OP_CAPPEDCYLINDERYZ,
+        cappedcylinderdist((sget(p,i)-soa3f(in.org)).yz(), (sget(p,i)-soa3f(in.org)).x, in.param.x, in.param.y),
+        cappedcylindergrad(sget(p,i)-soa3f(in.org), vec3f(1.f,0.f,0.f), in.param.x, in.param.y))
+      PRIMITIVE(OP_CAPSULE, capsuledist(sget(p,i)-soa3f(in.org), in.param.x, in.param.y),
+        capsulegrad(sget(p,i)-soa3f(in.org), in.param.x))
+      PRIMITIVE(OP_TORUS, torusdist(sget(p,i)-soa3f(in.org), in.param.x, in.param.y),
+        torusgrad(sget(p,i)-soa3f(in.org), in.param.x))
+      PRIMITIVE(OP_CONE, conedist(sget(p,i)-soa3f(in.org), in.param.x, in.param.y, in.param.z),
+        conegrad(sget(p,i)-soa3f(in.org), in.param.x, in.param.y, in.param.z))
+      PRIMITIVE(OP_ROUNDBOX, roundboxdist(sget(p,i)-soa3f(in.org), in.param.xyz(), in.param.w),
+        boxgrad(sget(p,i)-soa3f(in.org), abs(sget(p,i)-soa3f(in.org))-soa3f(in.param.xyz()-vec3f(in.param.w))))
+#undef PRIMITIVE
+      default: assert("unreachable" && false);
+    }
+  }
+  scratch.rewind(marker);
+  AVX_ZERO_UPPER();
+}
 } /* namespace NAMESPACE */
 } /* namespace rt */
 } /* namespace q */
@@ -7,3 +7,8 @@ void dist(const node *RESTRICT, const array3f &RESTRICT,
           const arrayf *RESTRICT, arrayf &RESTRICT, arrayi &RESTRICT,
           int num, const aabb &RESTRICT);
 
+
+// many points evaluation of a compiled tree. the gradients are optional
+void dist(const program *RESTRICT, const array3f &RESTRICT,
+          const arrayf *RESTRICT, arrayf &RESTRICT, arrayi &RESTRICT,
+          int num, const aabb &RESTRICT, array3f *RESTRICT grad = NULL);
@@ -4,6 +4,7 @@
  -------------------------------------------------------------------------*/
 #pragma once
 #include "csg.hpp"
+#include "base/vector.hpp"
 
 namespace q {
 namespace csg {
@@ -18,6 +19,31 @@ static INLINE ref<node> fixednode(const ref<node> &n) {
   return NULL!=n.ptr?n:NEWE(emptynode);
 }
 
+// planes and cylinders have infinite boxes that we do not want to transform
+static const float UNBOUNDED = 1e30f;
+static INLINE bool isempty(const aabb &box) {
+  return any(gt(box.pmin, box.pmax));
+}
+static INLINE bool isbounded(const aabb &box) {
+  return all(gt(box.pmin, vec3f(-UNBOUNDED))) && all(lt(box.pmax, vec3f(UNBOUNDED)));
+}
+
+// conservative bounds of a rotated box: we rotate its eight corners
+static INLINE aabb rotatedaabb(const quat3f &q, const aabb &box) {
+  if (isempty(box)) return aabb::empty();
+  if (!isbounded(box)) return aabb::all();
+  auto res = aabb::empty();
+  loopi(8) {
+    const vec3f corner(i&1 ? box.pmax.x : box.pmin.x,
+                       i&2 ? box.pmax.y : box.pmin.y,
+                       i&4 ? box.pmax.z : box.pmin.z);
+    const auto p = xfmpoint(q, corner);
+    res.pmin = min(res.pmin, p);
+    res.pmax = max(res.pmax, p);
+  }
+  return res;
+}
+
 #define BINARY(NAME,TYPE,C_BOX) \
 struct NAME : node { \
   INLINE NAME(const ref<node> &nleft, const ref<node> &nright) :\
@@ -93,6 +119,96 @@ struct cylinderyz : materialnode {
   vec2f cyz;
   float r;
 };
+
+// finite primitives. they replace compositions of cylinders and planes and
+// their boxes are tight. all but the capped cylinders are centered on the
+// origin with y as their axis
+struct cappedcylinder : materialnode {
+  INLINE cappedcylinder(CSGOP type, const vec3f &c, const vec3f &extent,
+                        float r, float h, u32 matindex) :
+    materialnode(type, aabb(c-extent, c+extent), matindex), c(c), r(r), h(h) {}
+  vec3f c;    // center of the cylinder
+  float r, h; // radius and half height
+};
+struct cappedcylinderxz : cappedcylinder {
+  INLINE cappedcylinderxz(float x, float z, float r, float ymin, float ymax,
+                          u32 matindex = MAT_SIMPLE_INDEX) :
+    cappedcylinder(C_CAPPEDCYLINDERXZ, vec3f(x,0.5f*(ymin+ymax),z),
+                   vec3f(r,0.5f*(ymax-ymin),r), r, 0.5f*(ymax-ymin), matindex) {}
+};
+struct cappedcylinderxy : cappedcylinder {
+  INLINE cappedcylinderxy(float x, float y, float r, float zmin, float zmax,
+                          u32 matindex = MAT_SIMPLE_INDEX) :
+    cappedcylinder(C_CAPPEDCYLINDERXY, vec3f(x,y,0.5f*(zmin+zmax)),
+                   vec3f(r,r,0.5f*(zmax-zmin)), r, 0.5f*(zmax-zmin), matindex) {}
+};
+struct cappedcylinderyz : cappedcylinder {
+  INLINE cappedcylinderyz(float y, float z, float r, float xmin, float xmax,
+                          u32 matindex = MAT_SIMPLE_INDEX) :
+    cappedcylinder(C_CAPPEDCYLINDERYZ, vec3f(0.5f*(xmin+xmax),y,z),
+                   vec3f(0.5f*(xmax-xmin),r,r), r, 0.5f*(xmax-xmin), matindex) {}
+};
+struct capsule : materialnode {
+  INLINE capsule(float h, float r, u32 matindex = MAT_SIMPLE_INDEX) :
+    materialnode(C_CAPSULE, aabb(vec3f(-r,-h-r,-r), vec3f(r,h+r,r)), matindex),
+    h(h), r(r) {}
+  float h, r; // half length of the segment and radius
+};
+struct torus : materialnode {
+  INLINE torus(float R, float r, u32 matindex = MAT_SIMPLE_INDEX) :
+    materialnode(C_TORUS, aabb(vec3f(-R-r,-r,-R-r), vec3f(R+r,r,R+r)), matindex),
+    R(R), r(r) {}
+  float R, r; // radius of the ring and of the tube
+};
+struct cone : materialnode {
+  INLINE cone(float h, float r0, float r1, u32 matindex = MAT_SIMPLE_INDEX) :
+    materialnode(C_CONE, aabb(vec3f(-max(r0,r1),-h,-max(r0,r1)),
+                              vec3f(+max(r0,r1),+h,+max(r0,r1))), matindex),
+    h(h), r0(r0), r1(r1) {}
+  float h, r0, r1; // half height, bottom and top radii
+};
+struct roundbox : materialnode {
+  INLINE roundbox(const vec3f &extent, float r, u32 matindex = MAT_SIMPLE_INDEX) :
+    materialnode(C_ROUNDBOX, aabb(-extent,+extent), matindex), extent(extent), r(r) {}
+  INLINE roundbox(float x, float y, float z, float r, u32 matindex = MAT_SIMPLE_INDEX) :
+    roundbox(vec3f(x,y,z), r, matindex) {}
+  vec3f extent;
+  float r;
+};
+
+/*--------------------------------------------------------------------------
+ - distances of the finite primitives shared by the scalar (T=float) and the
+ - simd (T=soaf) evaluators. positions are relative to the primitive center
+ -------------------------------------------------------------------------*/
+template <typename T> INLINE T boxdist2(const vec2<T> &q) {
+  return min(max(q.x,q.y),T(zero)) + length(max(q,vec2<T>(zero)));
+}
+template <typename T>
+INLINE T cappedcylinderdist(const vec2<T> &radial, const T &axial, float r, float h) {
+  return boxdist2(vec2<T>(length(radial)-T(r), abs(axial)-T(h)));
+}
+template <typename T> INLINE T capsuledist(const vec3<T> &p, float h, float r) {
+  return length(vec3<T>(p.x, p.y-clamp(p.y,T(-h),T(h)), p.z)) - T(r);
+}
+template <typename T> INLINE T torusdist(const vec3<T> &p, float R, float r) {
+  return length(vec2<T>(length(p.xz())-T(R), p.y)) - T(r);
+}
+// closest point on the side or on the caps in the (radius, height) plane
+template <typename T>
+INLINE T conedist(const vec3<T> &p, float h, float r0, float r1) {
+  const vec2<T> q(length(p.xz()), p.y);
+  const auto k1 = vec2<T>(T(r1), T(h)), k2 = vec2<T>(T(r1-r0), T(2.f*h));
+  const auto rcp = T(1.f/((r1-r0)*(r1-r0)+4.f*h*h));
+  const vec2<T> ca(q.x-min(q.x, select(q.y<T(zero), T(r0), T(r1))), abs(q.y)-T(h));
+  const auto cb = q - k1 + k2*clamp(dot(k1-q,k2)*rcp, T(zero), T(1.f));
+  const auto s = select(cb.x<T(zero), select(ca.y<T(zero), T(-1.f), T(1.f)), T(1.f));
+  return s*sqrt(min(dot(ca,ca), dot(cb,cb)));
+}
+template <typename T>
+INLINE T roundboxdist(const vec3<T> &p, const vec3f &extent, float r) {
+  const auto pd = abs(p)-vec3<T>(extent-vec3f(r));
+  return min(max(pd.x,max(pd.y,pd.z)),T(zero)) + length(max(pd,vec3<T>(zero))) - T(r);
+}
 struct translation : node {
   INLINE translation(const vec3f &p, const ref<node> &n) :
     node(C_TRANSLATION, aabb(p+fixedaabb(n).pmin, p+fixedaabb(n).pmax)), p(p),
@@ -104,13 +220,47 @@ struct translation : node {
 };
 struct rotation : node {
   INLINE rotation(const quat3f &q, const ref<node> &n) :
-    node(C_ROTATION, aabb::all()), q(q),
+    node(C_ROTATION, rotatedaabb(q, fixedaabb(n))), q(q),
     n(fixednode(n)) {}
   INLINE rotation(float deg0, float deg1, float deg2, const ref<node> &n) :
     rotation(quat3f(deg2rad(deg0),deg2rad(deg1),deg2rad(deg2)),n) {}
   quat3f q;
   ref<node> n;
 };
+
+/*--------------------------------------------------------------------------
+ - csg tree lowered to a flat instruction stream. translations are folded
+ - into the primitives, culling boxes are given in world space and every
+ - instruction knows where its subtree ends to skip it. registers are
+ - allocated by depth (dist and matindex share the same indices). 0 is
+ - always the output register and the input position
+ -------------------------------------------------------------------------*/
+enum OPCODE : u32 {
+  OP_UNION, OP_UNION_RIGHT, OP_UNION_END,
+  OP_REPLACE, OP_REPLACE_RIGHT, OP_REPLACE_END,
+  OP_INTERSECTION, OP_INTERSECTION_END,
+  OP_DIFFERENCE, OP_DIFFERENCE_RIGHT, OP_DIFFERENCE_END,
+  OP_ROTATION,
+  OP_SPHERE, OP_BOX, OP_PLANE, OP_CYLINDERXZ, OP_CYLINDERXY, OP_CYLINDERYZ,
+  OP_CAPPEDCYLINDERXZ, OP_CAPPEDCYLINDERXY, OP_CAPPEDCYLINDERYZ,
+  OP_CAPSULE, OP_TORUS, OP_CONE, OP_ROUNDBOX
+};
+struct instruction {
+  aabb box[2];  // left and right culling boxes (box[0] only for leaves)
+  vec4f param;  // primitive parameters with the translations folded in
+  quat3f q;     // inverse rotation (to world space for the leaves)
+  vec3f org;    // translation applied before the primitive or rotation
+  u32 op, matindex;
+  u16 d, m;     // destination registers for distance and material
+  u16 p, t;     // input position and temporary (or output position)
+  u32 right;    // first instruction of the right operand
+  u32 next;     // first instruction after the subtree
+};
+struct program {
+  const node *root; // tree the program was compiled from
+  vector<instruction> code;
+  u32 regnum, posnum;
+};
 } /* namespace csg */
 } /* namespace q */
 
@@ -8,6 +8,8 @@
 #include "monster.hpp"
 #include "world.hpp"
 #include "network.hpp"
+#include "csginternal.hpp"
+#include "renderer.hpp"
 #include "base/script.hpp"
 #include "base/console.hpp"
 
@@ -46,6 +48,20 @@ bool noteditmode(void) {
   return !editmode;
 }
 
+// carve a sphere of the given radius centered on the feet of the player in the
+// csg scene. only the part of the mesh around it is contoured again
+static void carvesphere(int radius) {
+  if (noteditmode() || radius <= 0) return;
+  const auto scene = csg::makescene();
+  if (scene == NULL) return;
+  const auto r = float(radius);
+  const auto p = game::player1->o - vec3f(0.f, game::player1->eyeheight, 0.f);
+  const auto sphere = NEW(csg::sphere, r);
+  const ref<csg::node> root = NEW(csg::D, scene, NEW(csg::translation, p, sphere));
+  rr::updatescene(root, aabb(p-r, p+r));
+}
+CMD(carvesphere);
+
 // static bool noselection(void) { return true; }
 void editdrag(bool) {}
 void cursorupdate(void) {} // called every frame from hud
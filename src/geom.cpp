@@ -38,19 +38,20 @@ static const quadmesh qmesh[2] = {{{{0,1,2},{0,2,3}}},{{{0,1,3},{3,1,2}}}};
 
 // test first configuration for non self intersection. If ok, take it, otherwise
 // take the other one
-static INLINE const quadmesh &findbestmesh(iso::mesh::octree::point **pt) {
+static INLINE const quadmesh &findbestmesh(const vec3f *pos) {
   const auto qm0 = qmesh[0].tri;
-  const auto e00 = pt[qm0[0][0]]->pos-pt[qm0[0][1]]->pos;
-  const auto e01 = pt[qm0[0][0]]->pos-pt[qm0[0][2]]->pos;
+  const auto e00 = pos[qm0[0][0]]-pos[qm0[0][1]];
+  const auto e01 = pos[qm0[0][0]]-pos[qm0[0][2]];
   const auto n0 = cross(e00,e01);
-  const auto e10 = pt[qm0[1][0]]->pos-pt[qm0[1][1]]->pos;
-  const auto e11 = pt[qm0[1][0]]->pos-pt[qm0[1][2]]->pos;
+  const auto e10 = pos[qm0[1][0]]-pos[qm0[1][1]];
+  const auto e11 = pos[qm0[1][0]]-pos[qm0[1][2]];
   const auto n1 = cross(e10,e11);
   return dot(n0,n1) > 0.f ? qmesh[0] : qmesh[1];
 }
 
 /*-------------------------------------------------------------------------
- - build a regular "to-process" mesh from the qef points and quads
+ - build a regular "to-process" mesh from the qef points and quads of the
+ - dirty leaves (all of them after a complete contouring)
  -------------------------------------------------------------------------*/
 struct procmesh {
   vector<vec3f> pos, nor;
@@ -78,7 +79,7 @@ struct fastptrhash<8> {
 
 static u32 compute_vertex_count(const iso::mesh::octree::node &node) {
   if (node.isleaf)
-    return node.leaf != NULL ? node.leaf->pts.size() : 0;
+    return node.leaf != NULL && node.dirty ? node.leaf->pts.size() : 0;
   u32 tot = 0;
   loopi(8) tot += compute_vertex_count(node.children[i]);
   return tot;
@@ -89,59 +90,53 @@ typedef hash_map<uintptr,int,fastptrhash<ptrbytesize>,LOADFACTOR> point_hash_map
 static void build_mesh(const iso::mesh::octree &o,
                        const iso::mesh::octree::node &node,
                        point_hash_map &vert_map,
-                       procmesh &pm)
+                       procmesh &pm, float cellsize)
 {
   if (!node.isleaf) {
-    loopi(8) build_mesh(o, node.children[i], vert_map, pm);
+    loopi(8) build_mesh(o, node.children[i], vert_map, pm, cellsize);
     return;
-  } else if (node.leaf == NULL)
+  } else if (node.leaf == NULL || !node.dirty)
     return;
 
-#if DEBUGOCTREE
-  bool missingpoint = false;
-#endif /* DEBUGOCTREE */
-
+  const auto shift = o.cellshift(node);
   loopv(node.leaf->quads) {
-    // get four points
+    // get four points. with levels of detail, a quad on the border of a leaf
+    // may point to a coarser neighbor that misses a point (its cell does not
+    // see the sign changes that ours see). we drop it
     const auto &q = node.leaf->quads[i];
     const auto quadmat = q.matindex;
     iso::mesh::octree::point *pt[4];
-    vec3i ptpos[4];
+    vec3f pos[4];
+    bool missingpoint = false;
     loopk(4) {
       const auto lpos = vec3i(q.index[k]);
-      const auto ipos = lpos + node.org;
-      assert(all(ge(lpos,vec3i(zero))) && "inconsistant position");
-      const auto leaf = all(lt(lpos,iso::mesh::SUBGRID)) ? &node : o.findleaf(ipos);
-
-#if DEBUGOCTREE
+      const auto ipos = node.org + lpos*(1<<shift);
+      const auto inside = all(ge(lpos,vec3i(zero))) &&
+                          all(lt(lpos,vec3i(iso::mesh::SUBGRID)));
+      const auto leaf = inside ? &node : o.findleaf(ipos);
       if (leaf == NULL || leaf->leaf == NULL) {
         missingpoint = true;
         break;
       }
-#else
-      assert(leaf != NULL && leaf->leaf != NULL &&
-        "leaf node is missing from the octree");
-#endif /* DEBUGOCTREE */
-
-      const auto vidx = ipos % iso::mesh::SUBGRID;
+      const auto vidx = (ipos - leaf->org) >> vec3i(o.cellshift(*leaf));
       const auto qef = leaf->leaf->get(vidx);
-      assert(qef != NULL && "point is missing from leaf octree");
+      if (qef == NULL) {
+        missingpoint = true;
+        break;
+      }
       pt[k] = qef;
-      ptpos[k] = ipos;
+      pos[k] = o.pos(*leaf, *qef, cellsize);
     }
-
-#if DEBUGOCTREE
     if (missingpoint)
       continue;
-#endif /* DEBUGOCTREE */
 
     // get the right convex configuration
-    const auto tri = findbestmesh(pt).tri;
+    const auto tri = findbestmesh(pos).tri;
 
     // append positions in the vertex buffer and the index buffer
     loopk(2) {
       const auto t = tri[k];
-      if (isdegenerated(pt[t[0]],pt[t[1]],pt[t[2]]))
+      if (isdegenerated(pos[t[0]],pos[t[1]],pos[t[2]]))
         continue;
       pm.mat.push_back(quadmat);
       loopl(3) {
@@ -150,7 +145,7 @@ static void build_mesh(const iso::mesh::octree &o,
         if (it == vert_map.end()) {
           const auto idx = int(pm.pos.size());
           vert_map.insert(makepair(uintptr(qef), idx));
-          pm.pos.push_back(qef->pos);
+          pm.pos.push_back(pos[t[l]]);
           pm.idx.push_back(idx);
         } else
           pm.idx.push_back(it->second);
@@ -197,6 +192,7 @@ struct qemcontext {
   vector<qemedge> eqem;       // qem information per edge
   vector<qemheapitem> heap;   // heap to decimate the mesh
   vector<int> mergelist;      // temporary structure when merging triangle lists
+  vector<char> locked;        // vertices that must not move
 };
 
 static void extraplane(const procmesh &pm, const qemedge &edge, int tri,
@@ -343,10 +339,13 @@ static bool merge(qemcontext &ctx, procmesh &pm, const qemedge &edge, int idx0,
     }
   }
 
-  // now we need to know if this is going to flip normals. if so, the merge is
-  // invalid
+  // locked vertices stay where they are
   const auto from = edge.best == 0 ? idx1 : idx0;
   const auto to = edge.best == 0 ? idx0 : idx1;
+  if (ctx.locked[from]) return false;
+
+  // now we need to know if this is going to flip normals. if so, the merge is
+  // invalid
   const auto begin = edge.best == 0 ? pivot : 0;
   const auto end = edge.best == 0 ? ctx.mergelist.size() : pivot;
   rangei(begin,end) {
@@ -415,7 +414,7 @@ static void decimate_mesh(qemcontext &ctx, procmesh &pm, float edgeminlen) {
 
   // first we just remove all edges smaller than the given threshold. we iterate
   // until there is nothing left to remove
-  while (anychange) {
+  while (anychange && !task::cancelled()) {
     anychange = false;
     loopv(eqem) {
       auto &edge = eqem[i];
@@ -440,8 +439,8 @@ static void decimate_mesh(qemcontext &ctx, procmesh &pm, float edgeminlen) {
     }
   }
 
-  // we remove zero cost edges
-  for (;;) {
+  // we remove zero cost edges. if cancelled, we still output a valid mesh
+  while (!heap.empty() && !task::cancelled()) {
     const auto item = heap.removeheap();
     if (item.len2 > MAX_EDGE_LEN*MAX_EDGE_LEN) continue;
     auto &edge = eqem[item.idx];
@@ -545,7 +544,27 @@ static void build_triangle_lists(qemcontext &ctx, const procmesh &pm) {
   }
 }
 
-static void decimate_mesh(procmesh &pm, float cellsize) {
+// the border of the mesh may be the border with the leaves that are not built
+// again or with the next bricks so its vertices never move. in a patchable
+// mesh, triangles must also stay in their octree leaf such that any leaf can
+// be built again alone and patched in the mesh. we then lock the vertices
+// shared by several leaves too
+static void build_locks(qemcontext &ctx, const procmesh &pm, bool patchable) {
+  auto &locked = ctx.locked;
+  locked.resize(pm.pos.size());
+  loopv(locked) locked[i] = 0;
+  if (patchable) loopv(ctx.vtri) {
+    const auto first = ctx.vtri[i].first, n = ctx.vtri[i].second;
+    loopj(n) if (pm.owner[ctx.vidx[first+j]] != pm.owner[ctx.vidx[first]]) {
+      locked[i] = 1;
+      break;
+    }
+  }
+  loopv(ctx.eqem) if (ctx.eqem[i].num == 1)
+    locked[ctx.eqem[i].idx[0]] = locked[ctx.eqem[i].idx[1]] = 1;
+}
+
+static void decimate_mesh(procmesh &pm, float cellsize, bool patchable) {
   if (pm.idx.size() == 0) return;
   qemcontext ctx;
   // printf("before\n");
@@ -564,6 +583,9 @@ static void decimate_mesh(procmesh &pm, float cellsize) {
   // generate the lists of triangles per-vertex
   build_triangle_lists(ctx, pm);
 
+  // find the vertices we cannot move
+  build_locks(ctx, pm, patchable);
+
   // decimate the mesh using quadric error functions
   const auto minlen = cellsize*MIN_EDGE_FACTOR;
   decimate_mesh(ctx, pm, minlen);
@@ -644,6 +666,110 @@ static void sharpen_mesh(procmesh &pm) {
   pm.owner = move(newowner);
 }
 
+/*-------------------------------------------------------------------------
+ - patch the previous mesh with the triangles of the dirty leaves. both list
+ - their triangles in the octree order with one range per leaf so we just go
+ - over the leaves and take the triangles from one or the other
+ -------------------------------------------------------------------------*/
+static void set_ranges(procmesh &pm) {
+  loopv(pm.owner) {
+    const auto node = pm.owner[i];
+    if (i == 0 || pm.owner[i-1] != node) {
+      node->first = i;
+      node->num = 0;
+    }
+    ++node->num;
+  }
+}
+
+struct patchcontext {
+  INLINE patchcontext(const dcmesh &m, const procmesh &pm) :
+    m(m), pm(pm), oldmat(m.m_indexnum/3), oldmap(m.m_vertnum), newmap(pm.pos.size())
+  {
+    loopi(m.m_segmentnum) {
+      const auto &seg = m.m_segment[i];
+      loopj(seg.num/3) oldmat[seg.start/3+j] = seg.mat;
+    }
+    loopv(oldmap) oldmap[i] = -1;
+    loopv(newmap) newmap[i] = -1;
+  }
+  const dcmesh &m;
+  const procmesh &pm;
+  vector<u32> oldmat;
+  vector<int> oldmap, newmap;
+  procmesh res;
+};
+
+static void append_triangles(procmesh &res, iso::mesh::octree::node *node,
+                             const vec3f *pos, const vec3f *nor,
+                             const u32 *idx, const u32 *mat, vector<int> &map)
+{
+  rangei(node->first, node->first+node->num) {
+    loopj(3) {
+      const auto v = idx[3*i+j];
+      if (map[v] == -1) {
+        map[v] = res.pos.size();
+        res.pos.push_back(pos[v]);
+        res.nor.push_back(nor[v]);
+      }
+      res.idx.push_back(map[v]);
+    }
+    res.mat.push_back(mat[i]);
+    res.owner.push_back(node);
+  }
+}
+
+static void patch_mesh(patchcontext &ctx, iso::mesh::octree::node *curr) {
+  if (!curr->isleaf) {
+    loopi(8) patch_mesh(ctx, curr->children+i);
+    return;
+  }
+  if (curr->dirty) {
+    const auto &pm = ctx.pm;
+    append_triangles(ctx.res, curr, pm.pos.data(), pm.nor.data(), pm.idx.data(),
+                     pm.mat.data(), ctx.newmap);
+  } else {
+    const auto &m = ctx.m;
+    append_triangles(ctx.res, curr, m.m_pos, m.m_nor, m.m_index,
+                     ctx.oldmat.data(), ctx.oldmap);
+  }
+}
+
+/*-------------------------------------------------------------------------
+ - sort the triangles by level of detail i.e. by resolution of their leaf. it
+ - keeps the triangles of each leaf together so the leaf ranges are just set
+ - again. returns the number of levels
+ -------------------------------------------------------------------------*/
+static u32 sort_lods(const iso::mesh::octree &o, procmesh &pm, u32 *lodtri) {
+  const auto trinum = pm.trinum();
+  u32 lodnum = 0;
+  loopi(MAX_LOD_NUM) lodtri[i] = 0;
+  loopi(trinum) {
+    const auto lod = o.cellshift(*pm.owner[i]);
+    assert(lod < MAX_LOD_NUM && "too many levels of detail");
+    ++lodtri[lod];
+    lodnum = max(lodnum, lod+1);
+  }
+  if (lodnum <= 1) return lodnum;
+
+  u32 first[MAX_LOD_NUM];
+  first[0] = 0;
+  rangei(1,lodnum) first[i] = first[i-1] + lodtri[i-1];
+  vector<u32> newidx(pm.idx.size()), newmat(trinum);
+  vector<iso::mesh::octree::node*> newowner(trinum);
+  loopi(trinum) {
+    const auto to = first[o.cellshift(*pm.owner[i])]++;
+    loopj(3) newidx[3*to+j] = pm.idx[3*i+j];
+    newmat[to] = pm.mat[i];
+    newowner[to] = pm.owner[i];
+  }
+  pm.idx = move(newidx);
+  pm.mat = move(newmat);
+  pm.owner = move(newowner);
+  set_ranges(pm);
+  return lodnum;
+}
+
 /*-------------------------------------------------------------------------
  - boiler plate to build bvh from procmesh
  -------------------------------------------------------------------------*/
@@ -708,9 +834,20 @@ static int build_bvh_jobs(iso::mesh::octree::node *curr,
     return total;
 }
 
-// push all triangles that belongs to this node in vector of primitives
+// number of triangles that belongs to this node
+static u32 count_triangles(const iso::mesh::octree::node *curr,
+                           const vector<leaf_submesh> &submeshes)
+{
+  if (curr->isleaf)
+    return curr->flag == 0 ? 0u : u32(submeshes[curr->flag-1].size());
+  u32 n = 0;
+  loopi(8) n += count_triangles(curr->children+i, submeshes);
+  return n;
+}
+
+// write all triangles that belongs to this node in the array of primitives
 static void gather_triangles(const iso::mesh::octree::node *curr,
-                             vector<rt::primitive> &prims,
+                             rt::primitive *&prims,
                              const procmesh &pm,
                              const vector<leaf_submesh> &submeshes)
 {
@@ -722,31 +859,25 @@ static void gather_triangles(const iso::mesh::octree::node *curr,
       const auto v0 = pm.pos[tri[0]];
       const auto v1 = pm.pos[tri[1]];
       const auto v2 = pm.pos[tri[2]];
-      prims.push_back(rt::primitive(v0,v1,v2));
+      new (prims++) rt::primitive(v0,v1,v2);
     }
   } else loopi(8)
     gather_triangles(curr->children+i, prims, pm, submeshes);
 }
 
-// build bvhs for submeshes
-struct task_build_submesh_bvh : public task {
-  INLINE task_build_submesh_bvh(iso::mesh::octree &o,
-                                procmesh &pm,
-                                const vector<leaf_submesh> &submeshes,
-                                const vector<iso::mesh::octree::node*> &jobs) :
-    task("task_build_submesh_bvh", jobs.size()), o(o), pm(pm),
-    submeshes(submeshes), jobs(jobs)
-  {}
-  virtual void run(u32 idx) {
-    vector<rt::primitive> prims;
-    gather_triangles(jobs[idx], prims, pm, submeshes);
-    jobs[idx]->bvh = NEW(rt::intersector, &prims[0], prims.size());
-  }
-  iso::mesh::octree &o;
-  procmesh &pm;
-  const vector<leaf_submesh> &submeshes;
-  const vector<iso::mesh::octree::node*> &jobs;
-};
+// forget the per-node data of the previous build. the bvhs above the dirty
+// leaves are out-dated and are removed
+static bool reset_nodes(iso::mesh::octree::node *curr) {
+  auto dirty = false;
+  curr->flag = 0;
+  if (curr->isleaf) {
+    dirty = curr->dirty;
+    curr->dirty = 0;
+  } else loopi(8)
+    if (reset_nodes(curr->children+i)) dirty = true;
+  if (dirty) curr->bvh = NULL;
+  return dirty;
+}
 
 // build the bvh of bvhs for the complete scene
 struct task_build_two_level_bvh : public task {
@@ -754,23 +885,34 @@ struct task_build_two_level_bvh : public task {
     task("task_build_two_level_bvh"), jobs(jobs), o(o)
   {}
   virtual void run(u32) {
-    vector<rt::primitive> prims;
-    loopv(jobs) prims.push_back(rt::primitive(jobs[i]->bvh.ptr));
-    o.bvh = NEW(rt::intersector, &prims[0], prims.size());
+    const auto prims = task::scratch().alloc<rt::primitive>(jobs.size());
+    loopv(jobs) new (prims+i) rt::primitive(jobs[i]->bvh);
+    o.bvh = NEW(rt::intersector, prims, jobs.size());
+    loopv(jobs) prims[i].~primitive();
   }
   const vector<iso::mesh::octree::node*> &jobs;
   iso::mesh::octree &o;
 };
 
-// build a bvh from octree nodes
+// build a bvh from octree nodes. the nodes that still have one keep it
 struct task_build_bvh : public task {
   INLINE task_build_bvh(procmesh &pm, iso::mesh::octree &o) :
     task("task_build_bvh"), pm(pm), o(o)
   {}
   virtual void run(u32) {
+    reset_nodes(&o.m_root);
+    set_ranges(pm);
     build_leaf_submesh(pm, submeshes);
     build_bvh_jobs(&o.m_root, jobs, submeshes);
-    ref<task> submesh_task = NEW(task_build_submesh_bvh, o, pm, submeshes, jobs);
+    ref<task> submesh_task = make_parallel_for("task_build_submesh_bvh", 0, jobs.size(), 0,
+      [this](u32 idx) {
+        if (jobs[idx]->bvh) return;
+        const auto n = count_triangles(jobs[idx], submeshes);
+        const auto prims = task::scratch().alloc<rt::primitive>(n);
+        auto end = prims;
+        gather_triangles(jobs[idx], end, pm, submeshes);
+        jobs[idx]->bvh = NEW(rt::intersector, prims, n);
+      });
     ref<task> twolevel_task = NEW(task_build_two_level_bvh, o, jobs);
     submesh_task->starts(*twolevel_task);
     twolevel_task->ends(*this);
@@ -789,50 +931,85 @@ struct task_build_bvh : public task {
 
 // build a procmesh from a contoured octree
 struct task_iso_mesh : public task {
-  INLINE task_iso_mesh(iso::mesh::octree &o, procmesh &pm) :
-    task("task_iso_mesh"), o(o), pm(pm)
+  INLINE task_iso_mesh(iso::mesh::octree &o, procmesh &pm, float cellsize) :
+    task("task_iso_mesh"), o(o), pm(pm), cellsize(cellsize)
   {}
   virtual void run(u32) {
     point_hash_map vert_map;
     const auto vertcount = compute_vertex_count(o.m_root);
     vert_map.reserve(vertcount * LOADFACTOR);
-    build_mesh(o, o.m_root, vert_map, pm);
+    build_mesh(o, o.m_root, vert_map, pm, cellsize);
     con::out("iso: procmesh: %d vertices", pm.pos.size());
     con::out("iso: procmesh: %d triangles", pm.idx.size()/3);
   }
   iso::mesh::octree &o;
   procmesh &pm;
+  float cellsize;
+};
+
+// merge the new triangles with the ones of the clean leaves
+struct task_patch_mesh : public task {
+  INLINE task_patch_mesh(const dcmesh &m, iso::mesh::octree &o, procmesh &pm) :
+    task("task_patch_mesh"), m(m), o(o), pm(pm)
+  {}
+  virtual void run(u32) {
+    set_ranges(pm);
+    patchcontext ctx(m, pm);
+    patch_mesh(ctx, &o.m_root);
+    pm.pos = move(ctx.res.pos);
+    pm.nor = move(ctx.res.nor);
+    pm.idx = move(ctx.res.idx);
+    pm.mat = move(ctx.res.mat);
+    pm.owner = move(ctx.res.owner);
+  }
+  const dcmesh &m;
+  iso::mesh::octree &o;
+  procmesh &pm;
 };
 
 // decimate a procmesh using qem
 struct task_decimate : public task {
-  INLINE task_decimate(procmesh &pm, float cellsize) :
-    task("task_decimate"), pm(pm), cellsize(cellsize)
+  INLINE task_decimate(procmesh &pm, float cellsize, bool patchable) :
+    task("task_decimate"), pm(pm), cellsize(cellsize), patchable(patchable)
   {}
-  virtual void run(u32) { decimate_mesh(pm, cellsize); }
+  virtual void run(u32) { decimate_mesh(pm, cellsize, patchable); }
   procmesh &pm;
   float cellsize;
+  bool patchable;
 };
 
-// create proper (possible sharpened) normals and finish the mesh
+// create proper (possible sharpened) normals
+struct task_sharpen_mesh : public task {
+  INLINE task_sharpen_mesh(procmesh &pm) : task("task_sharpen_mesh"), pm(pm) {}
+  virtual void run(u32) { sharpen_mesh(pm); }
+  procmesh &pm;
+};
+
+// finish the mesh (and replace the previous one if any)
 struct task_finish_mesh : public task {
-  INLINE task_finish_mesh(dcmesh &m, procmesh &pm) :
-    task("task_finish_mesh"), m(m), pm(pm)
+  INLINE task_finish_mesh(dcmesh &m, const iso::mesh::octree &o, procmesh &pm) :
+    task("task_finish_mesh"), m(m), o(o), pm(pm)
   {}
   virtual void run(u32) {
-    // handle sharp edges and create normals
-    sharpen_mesh(pm);
-
-    // build the segment list
+    // build the segment list of each level of detail
+    u32 lodtri[MAX_LOD_NUM], lodseg[MAX_LOD_NUM+1];
+    const auto lodnum = sort_lods(o, pm, lodtri);
     vector<segment> seg;
-    u32 currmat = ~0x0;
-    loopv(pm.mat) {
-      if (pm.mat[i] != currmat) {
-        seg.push_back({3u*i,0u,pm.mat[i]});
-        currmat = pm.mat[i];
+    u32 first = 0;
+    loopi(lodnum) {
+      u32 currmat = ~0x0;
+      lodseg[i] = seg.size();
+      rangej(first, first+lodtri[i]) {
+        if (pm.mat[j] != currmat) {
+          seg.push_back({3u*j,0u,pm.mat[j]});
+          currmat = pm.mat[j];
+        }
+        seg.back().num += 3;
       }
-      seg.back().num += 3;
+      first += lodtri[i];
+      if (lodnum > 1) con::out("iso: final: lod %d: %d triangles", i, lodtri[i]);
     }
+    lodseg[lodnum] = seg.size();
 
 #if !defined(NDEBUG)
     loopv(pm.pos) assert(!isnan(pm.pos[i].x)&&!isnan(pm.pos[i].y)&&!isnan(pm.pos[i].z));
@@ -847,49 +1024,68 @@ struct task_finish_mesh : public task {
     const auto s = seg.move();
     con::out("iso: final: %d vertices", p.second);
     con::out("iso: final: %d triangles", idx.second/3);
+    m.destroy();
     m.init(p.first, n.first, idx.first, s.first, p.second, idx.second, s.second);
+    loopi(lodnum+1) m.m_lodsegment[i] = lodseg[i];
+    m.m_lodnum = lodnum;
   }
 
   dcmesh &m;
+  const iso::mesh::octree &o;
   procmesh &pm;
 };
 
-// task to build the mesh from a "contoured" octree
+// task to build the mesh from a "contoured" octree. when patching, only the
+// triangles of the dirty leaves are built and processed
 struct task_build_mesh : public task {
-  INLINE task_build_mesh(dcmesh &m, iso::mesh::octree &o, float cellsize, int waiternum) :
-    task("task_build_mesh", 1, waiternum), m(m), o(o), cellsize(cellsize)
+  INLINE task_build_mesh(dcmesh &m, iso::mesh::octree &o, float cellsize,
+                         bool patch, bool patchable, int waiternum) :
+    task("task_build_mesh", 1, waiternum), m(m), o(o), cellsize(cellsize),
+    patch(patch), patchable(patchable)
   {}
 
   virtual void run(u32) {
     // create all tasks needed for the mesh processing
-    ref<task> init = NEW(task_iso_mesh, o, pm);
-    ref<task> decimate[DECIMATION_NUM];
-    loopi(DECIMATION_NUM) decimate[i] = NEW(task_decimate, pm, cellsize);
-    ref<task> finish = NEW(task_finish_mesh, m, pm);
-    ref<task> bvhtask = NEW(task_build_bvh, pm, o);
+    taskgraph graph;
+    auto &init = graph.add(NEW(task_iso_mesh, o, pm, cellsize));
+    task *decimate[DECIMATION_NUM];
+    loopi(DECIMATION_NUM)
+      decimate[i] = &graph.add(NEW(task_decimate, pm, cellsize, patchable));
+    auto &sharpen = graph.add(NEW(task_sharpen_mesh, pm));
+    auto &finish = graph.add(NEW(task_finish_mesh, m, o, pm));
+    auto &bvhtask = graph.add(NEW(task_build_bvh, pm, o));
 
     // handle dependencies and completion of parent task
-    init->starts(*decimate[0]);
+    init.starts(*decimate[0]);
     rangei(1,DECIMATION_NUM) decimate[i-1]->starts(*decimate[i]);
-    decimate[DECIMATION_NUM-1]->starts(*bvhtask);
-    finish->ends(*this);
-    bvhtask->starts(*finish);
+    decimate[DECIMATION_NUM-1]->starts(sharpen);
+    if (patch) {
+      auto &patchtask = graph.add(NEW(task_patch_mesh, m, o, pm));
+      sharpen.starts(patchtask);
+      patchtask.starts(bvhtask);
+    } else
+      sharpen.starts(bvhtask);
+    finish.ends(*this);
+    bvhtask.starts(finish);
 
     // schedule everything
-    bvhtask->scheduled();
-    finish->scheduled();
-    loopi(DECIMATION_NUM) decimate[i]->scheduled();
-    init->scheduled();
+    task::schedule(graph);
   }
 
   dcmesh &m;
   iso::mesh::octree &o;
   float cellsize;
+  bool patch, patchable;
   procmesh pm;
 };
 
-ref<task> create_task(dcmesh &m, iso::mesh::octree &o, float cellsize, int waiternum) {
-  return NEW(task_build_mesh, m, o, cellsize, waiternum);
+ref<task> create_task(dcmesh &m, iso::mesh::octree &o, float cellsize,
+                      int waiternum, bool patchable) {
+  return NEW(task_build_mesh, m, o, cellsize, false, patchable, waiternum);
+}
+
+ref<task> create_update_task(dcmesh &m, iso::mesh::octree &o, float cellsize, int waiternum) {
+  return NEW(task_build_mesh, m, o, cellsize, true, true, waiternum);
 }
 
 /*-------------------------------------------------------------------------
@@ -906,6 +1102,9 @@ void dcmesh::init(vec3f *pos, vec3f *nor, u32 *index,
   m_vertnum = vn;
   m_indexnum = idxn;
   m_segmentnum = segn;
+  m_lodsegment[0] = 0;
+  m_lodsegment[1] = segn;
+  m_lodnum = 1;
 }
 
 void dcmesh::destroy() {
@@ -915,10 +1114,30 @@ void dcmesh::destroy() {
   if (m_segment) {FREE(m_segment); m_segment=NULL;}
 }
 
+/*-------------------------------------------------------------------------
+ - mesh files start with a magic number and a version. the files written
+ - before have no header and no level of detail: they are loaded as one lod
+ -------------------------------------------------------------------------*/
+static const u32 MESHMAGIC = 0x68736d71u; // "qmsh"
+static const u32 MESHVERSION = 1;
 
-void store(const char *filename, const dcmesh &m) {
-  auto f = fopen(filename, "wb");
-  assert(f);
+static void writeheader(FILE *f) {
+  const u32 header[] = {MESHMAGIC, MESHVERSION};
+  fwrite(header, sizeof(header), 1, f);
+}
+
+// returns the version of the file (0 for the files without header) or -1 if
+// we cannot read it
+static int readheader(FILE *f) {
+  u32 header[2];
+  if (fread(header, sizeof(header), 1, f) != 1 || header[0] != MESHMAGIC) {
+    fseek(f, 0, SEEK_SET);
+    return 0;
+  }
+  return header[1] == MESHVERSION ? int(header[1]) : -1;
+}
+
+static void write(FILE *f, const dcmesh &m) {
   fwrite(&m.m_vertnum, sizeof(u32), 1, f);
   fwrite(&m.m_indexnum, sizeof(u32), 1, f);
   fwrite(&m.m_segmentnum, sizeof(u32), 1, f);
@@ -926,16 +1145,17 @@ void store(const char *filename, const dcmesh &m) {
   fwrite(m.m_nor, sizeof(vec3f) * m.m_vertnum, 1, f);
   fwrite(m.m_index, sizeof(u32) * m.m_indexnum, 1, f);
   fwrite(m.m_segment, sizeof(segment) * m.m_segmentnum, 1, f);
-  fclose(f);
+  fwrite(&m.m_lodnum, sizeof(u32), 1, f);
+  fwrite(m.m_lodsegment, sizeof(u32) * (m.m_lodnum+1), 1, f);
 }
 
-bool load(const char *filename, dcmesh &m) {
-  auto f = fopen(filename, "rb");
-  if (f==NULL) return false;
+static bool read(FILE *f, dcmesh &m, int version) {
   m.destroy();
-  fread(&m.m_vertnum, sizeof(u32), 1, f);
-  fread(&m.m_indexnum, sizeof(u32), 1, f);
-  fread(&m.m_segmentnum, sizeof(u32), 1, f);
+  u32 num[3];
+  if (fread(num, sizeof(u32), 3, f) != 3) return false;
+  m.m_vertnum = num[0];
+  m.m_indexnum = num[1];
+  m.m_segmentnum = num[2];
   m.m_pos = (vec3f*) MALLOC(sizeof(vec3f) * m.m_vertnum);
   m.m_nor = (vec3f*) MALLOC(sizeof(vec3f) * m.m_vertnum);
   m.m_index = (u32*) MALLOC(sizeof(u32) * m.m_indexnum);
@@ -944,7 +1164,67 @@ bool load(const char *filename, dcmesh &m) {
   fread(m.m_nor, sizeof(vec3f) * m.m_vertnum, 1, f);
   fread(m.m_index, sizeof(u32) * m.m_indexnum, 1, f);
   fread(m.m_segment, sizeof(segment) * m.m_segmentnum, 1, f);
+  if (version == 0) {
+    m.m_lodsegment[0] = 0;
+    m.m_lodsegment[1] = m.m_segmentnum;
+    m.m_lodnum = 1;
+    return true;
+  }
+  u32 lodnum = 0;
+  fread(&lodnum, sizeof(u32), 1, f);
+  m.m_lodnum = min(lodnum, MAX_LOD_NUM);
+  fread(m.m_lodsegment, sizeof(u32) * (m.m_lodnum+1), 1, f);
+  if (lodnum > m.m_lodnum) fseek(f, long(sizeof(u32)*(lodnum-m.m_lodnum)), SEEK_CUR);
+  return true;
+}
+
+void store(const char *filename, const dcmesh &m) {
+  auto f = fopen(filename, "wb");
+  assert(f);
+  writeheader(f);
+  write(f, m);
   fclose(f);
+}
+
+bool load(const char *filename, dcmesh &m) {
+  auto f = fopen(filename, "rb");
+  if (f==NULL) return false;
+  const auto version = readheader(f);
+  const auto ok = version >= 0 && read(f, m, version);
+  fclose(f);
+  return ok;
+}
+
+/*-------------------------------------------------------------------------
+ - chunked meshes. the file has one header (there is no chunk file without
+ - it) and each chunk is laid out as a mesh written by store
+ -------------------------------------------------------------------------*/
+chunkwriter::chunkwriter(const char *filename) :
+  m_file(fopen(filename, "wb")), m_chunknum(0)
+{
+  assert(m_file);
+  writeheader(m_file);
+}
+
+chunkwriter::~chunkwriter() {fclose(m_file);}
+
+void chunkwriter::append(const dcmesh &m) {
+  if (m.m_indexnum == 0) return;
+  write(m_file, m);
+  ++m_chunknum;
+}
+
+chunkreader::chunkreader(const char *filename) :
+  m_file(fopen(filename, "rb")), m_version(0), m_chunknum(0)
+{
+  if (m_file) m_version = readheader(m_file);
+}
+
+chunkreader::~chunkreader() {if (m_file) fclose(m_file);}
+
+bool chunkreader::next(dcmesh &m) {
+  if (m_file == NULL || m_version <= 0 || !read(m_file, m, m_version)) return false;
+  ++m_chunknum;
   return true;
 }
 } /* namespace geom */
@@ -22,7 +22,12 @@ namespace geom {
 // describe a set of consecutive primitives with same material
 struct segment {u32 start, num, mat;};
 
-// simple structure to describe meshes generated by dual contouring
+// maximum number of levels of detail in a mesh
+static const u32 MAX_LOD_NUM = 16;
+
+// simple structure to describe meshes generated by dual contouring. triangles
+// are sorted by level of detail (0 is full resolution) and the segments of lod
+// i are [m_lodsegment[i], m_lodsegment[i+1])
 struct dcmesh {
   dcmesh();
   void init(vec3f *pos, vec3f *nor, u32 *index,
@@ -34,14 +39,47 @@ struct dcmesh {
   u32 m_vertnum;
   u32 m_indexnum;
   u32 m_segmentnum;
+  u32 m_lodsegment[MAX_LOD_NUM+1];
+  u32 m_lodnum;
 };
 
-// create a task to build a mesh from a "contoured" octree
-ref<task> create_task(dcmesh &m, iso::mesh::octree &o, float cellsize, int waitnum = 1);
+// create a task to build a mesh from a "contoured" octree. the triangles of a
+// patchable mesh stay in their octree leaf so create_update_task can patch it
+// later. it restricts the decimation (a few percent more triangles)
+ref<task> create_task(dcmesh &m, iso::mesh::octree &o, float cellsize,
+                      int waitnum = 1, bool patchable = false);
+
+// create a task to patch a patchable mesh built from the same octree once its
+// dirty leaves are contoured again. only their triangles and the bvhs above
+// them are built again
+ref<task> create_update_task(dcmesh &m, iso::mesh::octree &o, float cellsize, int waitnum = 1);
 
-// load/store the mesh in the given stream
+// load/store the mesh in the given file. load fails on files of an unknown
+// version
 void store(const char *filename, const dcmesh &m);
 bool load(const char *filename, dcmesh &m);
+
+// write meshes one after the other in the same file. this is used when the
+// world is built brick by brick: each brick is appended as soon as it is done
+// and forgotten. empty meshes are skipped
+struct chunkwriter {
+  chunkwriter(const char *filename);
+  ~chunkwriter();
+  void append(const dcmesh &m);
+  FILE *m_file;
+  u32 m_chunknum;
+};
+
+// read back the chunks one by one such that only one of them is in memory.
+// next destroys the previous chunk and returns false after the last one
+struct chunkreader {
+  chunkreader(const char *filename);
+  ~chunkreader();
+  bool next(dcmesh &m);
+  FILE *m_file;
+  int m_version;
+  u32 m_chunknum;
+};
 } /* namespace geom */
 } /* namespace q */
 
@@ -8,10 +8,14 @@
 #include "csg.scalar.hpp"
 #include "csg.sse.hpp"
 #include "csg.avx.hpp"
+#include "csg.avx2.hpp"
+#include "csg.avx512.hpp"
 #include "geom.hpp"
 #include "base/vector.hpp"
+#include "base/hash_map.hpp"
 #include "base/task.hpp"
 #include "base/console.hpp"
+#include <SDL_thread.h>
 
 namespace {
 STATS(iso_num);
@@ -19,8 +23,12 @@ STATS(iso_edgepos_num);
 STATS(iso_edge_num);
 STATS(iso_gradient_num);
 STATS(iso_grid_num);
+STATS(iso_block_num);
+STATS(iso_shared_grid_num);
+STATS(iso_shared_edge_num);
 STATS(iso_octree_num);
 STATS(iso_qef_num);
+STATS(iso_qef_clamped_num);
 STATS(iso_edgepos);
 
 #if !defined(RELEASE)
@@ -31,11 +39,15 @@ static void stats() {
   printf("*************************************************\n");
   STATS_OUT(iso_num);
   STATS_OUT(iso_qef_num);
+  STATS_RATIO(iso_qef_clamped_num, iso_qef_num);
   STATS_OUT(iso_edge_num);
   STATS_RATIO(iso_edgepos_num, iso_edge_num);
   STATS_RATIO(iso_edgepos_num, iso_num);
   STATS_RATIO(iso_gradient_num, iso_num);
   STATS_RATIO(iso_grid_num, iso_num);
+  STATS_RATIO(iso_block_num, iso_num);
+  STATS_RATIO(iso_shared_grid_num, iso_grid_num);
+  STATS_RATIO(iso_shared_edge_num, iso_edge_num);
   STATS_RATIO(iso_octree_num, iso_num);
   printf("\n");
 }
@@ -48,20 +60,26 @@ static const q::vec3f debugpos(19.f,3.0f,13.f);
 static const float debugsize = 0.8f;
 #endif /* DEBUGOCTREE */
 
+// contour again the neighbors of each leaf and check their shared edges
+#define DEBUGEDGES 0
+
 namespace q {
 namespace iso {
 namespace mesh {
 
 // callback to perform distance to iso-surface
 static void (*isodist)(
-  const csg::node *RESTRICT, const csg::array3f &RESTRICT,
+  const csg::program *RESTRICT, const csg::array3f &RESTRICT,
   const csg::arrayf *RESTRICT, csg::arrayf &RESTRICT, csg::arrayi &RESTRICT,
-  int num, const aabb &RESTRICT);
+  int num, const aabb &RESTRICT, csg::array3f *RESTRICT);
 
 static const u32 SUBGRIDDEPTH = ilog2(SUBGRID);
-static const auto DEFAULT_GRAD_STEP = 1e-3f;
 static const int MAX_STEPS = 8;
+static const float EDGE_DIST_EPS = 1.f/1024.f; // in cells, for regula falsi
+static const float EDGE_BRACKET_EPS = 1.f/256.f; // what 8 bisections give
+static const float EDGE_T_MIN = 1.f/512.f; // never interpolate on the ends
 static const double QEM_LEAF_MIN_ERROR = 1e-6;
+static const float QEF_MAX_OFFSET = 1.f; // in cells, around the cell of the point
 
 struct fielditem {
   INLINE fielditem(float d, u32 m) : d(d), m(m) {}
@@ -91,10 +109,13 @@ static const int interptable[12][2] = {
   {6,7},{7,4},{0,4},{1,5},{2,6},{3,7}
 };
 static const u32 octreechildmap[8] = {0, 4, 3, 7, 1, 5, 2, 6};
+static const u32 quadowner[] = {2,1,3,0};
 static const pair<int,int> airmat = makepair(csg::MAT_AIR_INDEX, csg::MAT_AIR_INDEX);
 static const u32 FIELDDIM = SUBGRID+2;
 static const u32 FIELDNUM = FIELDDIM*FIELDDIM*FIELDDIM;
 static const u32 QEFNUM = SUBGRID*SUBGRID*SUBGRID;
+static const u32 BLOCKDIM = (FIELDDIM+3)/4;
+static const u32 BLOCKNUM = BLOCKDIM*BLOCKDIM*BLOCKDIM;
 static const u32 NOINDEX = ~0x0u;
 
 /*-------------------------------------------------------------------------
@@ -154,11 +175,15 @@ INLINE u32 leafoctreebase::descend(vec3i &xyz, u32 level, u32 idx) {
 /*-------------------------------------------------------------------------
  - global octree implementation
  -------------------------------------------------------------------------*/
-octree::node::~node() {
-  if (isleaf)
+void octree::node::clear() {
+  if (isleaf) {
     SAFE_DEL(leaf);
-  else
+    leaf = NULL;
+  } else
     SAFE_DELA(children);
+  bvh = NULL;
+  isleaf = empty = dirty = 0;
+  num = 0;
 }
 
 const octree::node *octree::findleaf(vec3i xyz) const {
@@ -180,10 +205,32 @@ const octree::node *octree::findleaf(vec3i xyz) const {
   return NULL;
 }
 
+static void memory(const octree::node &node, octree::memstats &stats) {
+  if (!node.isleaf) {
+    loopi(8) memory(node.children[i], stats);
+    return;
+  } else if (node.empty || node.leaf == NULL)
+    return;
+  const auto &leaf = *node.leaf;
+  ++stats.leafnum;
+  stats.leaves += sizeof(octree::leaftype);
+  stats.nodes += leaf.root.capacity() * sizeof(leafoctreebase::node);
+  stats.points += leaf.pts.capacity() * sizeof(octree::point);
+  stats.quads += leaf.quads.capacity() * sizeof(quad);
+}
+
+octree::memstats octree::memory() const {
+  memstats stats = {0,0,0,0,0};
+  mesh::memory(m_root, stats);
+  return stats;
+}
+
 struct edgeitem {
   vec3f org, p0, p1;
   float v0, v1;
   u32 m0, m1;
+  int side;    // end replaced by the last step (-1 if none)
+  bool bisect; // no sign change to interpolate: bisection only
 };
 
 struct CACHE_LINE_ALIGNED edgestack {
@@ -207,7 +254,6 @@ INLINE pair<vec3i,int> getedge(const vec3i &start, const vec3i &end) {
 struct procleaf {
   struct vertex {
     INLINE bool multimat() const {return mat==airmat;}
-    vec3f world;       // position in world space
     vec3f local;       // relative position in local grid
     qef::qem qem;      // qem matrix used to merge vertices
     vec3<char> xyz;    // coordinates in the local grid
@@ -290,27 +336,120 @@ static const vec3f ov0(1.f/sqrt(6.f), -1.f/sqrt(2.f), -1.f/sqrt(3.f));
 static const vec3f ov1(1.f/sqrt(6.f),  1.f/sqrt(2.f), -1.f/sqrt(3.f));
 static const vec3f ov2(-sqrt(2.f/3.f),            0.f, -1.f/sqrt(3.f));
 
+/*-------------------------------------------------------------------------
+ - programs of the leaves. each thread compiles all its leaves in the same
+ - program such that the instructions reuse the memory of the previous leaf.
+ - finish frees them and changes the generation so that every thread gets a
+ - new one afterwards
+ -------------------------------------------------------------------------*/
+static SDL_mutex *programmutex = NULL;
+static vector<csg::program*> programs;
+static atomic programgeneration(0);
+static THREAD csg::program *thisprogram = NULL;
+static THREAD s32 programthreadgeneration = 0;
+
+static csg::program *&threadprogram() {
+  if (programthreadgeneration != programgeneration) {
+    programthreadgeneration = programgeneration;
+    thisprogram = NULL;
+  }
+  return thisprogram;
+}
+
+static csg::program *threadcompile(const csg::node &n, const aabb &bounds) {
+  auto &prog = threadprogram();
+  const auto fresh = prog == NULL;
+  prog = csg::compile(n, bounds, prog);
+  if (fresh) {
+    SDL_LockMutex(programmutex);
+    programs.push_back(prog);
+    SDL_UnlockMutex(programmutex);
+  }
+  return prog;
+}
+
+static void destroyprograms() {
+  loopv(programs) csg::destroyprogram(programs[i]);
+  programs = vector<csg::program*>();
+  ++programgeneration;
+}
+
+/*-------------------------------------------------------------------------
+ - the first two layers of the field of a leaf are the last two layers of the
+ - leaves of the same level before it on x, y and z. the leaves run from the
+ - last one and a leaf publishes these layers and the crossings of the edges
+ - that start on them. the leaves before it copy them instead of evaluating
+ - them again. a shared item is evaluated by both leaves with the same
+ - culling box and the same nodes of the tree so the copy is the same bit for
+ - bit. a leaf not done yet is just not used
+ -------------------------------------------------------------------------*/
+static const int BORDERDIM = 2;
+
+struct crossing {
+  vec3f p, n;
+  vec2i mat;
+};
+
+struct border {
+  // first axis of the point below BORDERDIM gives the layers that hold it
+  INLINE const fielditem &get(const vec3i &xyz) const {
+    const auto a = xyz.x < BORDERDIM ? 0 : (xyz.y < BORDERDIM ? 1 : 2);
+    return field[a][xyz[a]][xyz[(a+2)%3]][xyz[(a+1)%3]];
+  }
+  // crossing of the edge with the given index if it was found
+  INLINE const crossing *find(u32 idx) const {
+    int first = 0, last = edges.size();
+    while (first < last) {
+      const auto mid = (first+last)/2;
+      if (edges[mid].first < idx) first = mid+1; else last = mid;
+    }
+    return first < edges.size() && edges[first].first == idx ? &edges[first].second : NULL;
+  }
+  fielditem field[3][BORDERDIM][FIELDDIM][FIELDDIM];
+  vector<pair<u32,crossing>> edges; // sorted by edge index
+};
+
+struct borderslot {
+  INLINE borderslot() : data(NULL), ready(0), refs(1) { loopi(7) after[i] = -1; }
+  border *data; // published border of the leaf
+  atomic ready; // data can be read
+  atomic refs;  // leaves that may still read it plus the leaf itself
+  s32 after[7]; // leaves after it by one leaf on x, y and/or z (-1 if none)
+};
+
+// index of a direction made of zeros and ones (but all zeros) in after
+INLINE u32 afterindex(const vec3i &dir) { return dir.x + 2*dir.y + 4*dir.z - 1; }
+
+static void release(borderslot &slot) {
+  if (--slot.refs != 0) return;
+  SAFE_DEL(slot.data);
+  slot.data = NULL;
+}
+
 /*-------------------------------------------------------------------------
  - iso surface extraction is done here
  -------------------------------------------------------------------------*/
 struct gridbuilder {
-  gridbuilder() :
-    m_node(NULL),
-    m_field(FIELDNUM),
-    m_qef_index(QEFNUM),
-    m_edge_index(6*FIELDNUM),
-    stack((edgestack*)ALIGNEDMALLOC(sizeof(edgestack), CACHE_LINE_ALIGNMENT)),
+  // the builder lives for one leaf. all its buffers come from the scratch
+  // arena of the thread and its program is the one of the thread
+  gridbuilder(arena &scratch) :
+    m_csgnode(NULL),
+    m_program(NULL),
+    m_slots(NULL),
+    m_after(NULL),
+    m_field(scratch.alloc<fielditem>(FIELDNUM)),
+    m_qef_index(scratch.alloc<u32>(QEFNUM)),
+    m_edge_index(scratch.alloc<u32>(6*FIELDNUM)),
+    stack(scratch.alloc<edgestack>(1)),
     m_octree(NULL),
     m_iorg(zero),
     maxlvl(0),
     level(0)
-  {}
-  ~gridbuilder() {ALIGNEDFREE(stack);}
+  {
+    loopi(7) m_borders[i] = NULL;
+  }
 
-  struct edge {
-    vec3f p, n;
-    vec2i mat;
-  };
+  typedef crossing edge;
 
   struct qef_output {
     INLINE qef_output(vec3f p, vec3f n, bool valid):p(p),n(n),valid(valid){}
@@ -318,14 +457,17 @@ struct gridbuilder {
     bool valid;
   };
 
+  // cellsize is the one of the leaf. we scale the position on the finest grid
+  // by the finest cell size (exact division) so that neighbors of any level
+  // compute the exact same positions
   INLINE vec3f vertex(const vec3i &p) {
     const vec3i ipos = m_iorg+(p<<(int(maxlvl-level)));
-    return vec3f(ipos)*cellsize;
+    return vec3f(ipos)*(cellsize/float(1<<(maxlvl-level)));
   }
   INLINE void setoctree(const octree &o) { m_octree = &o; }
   INLINE void setorg(const vec3f &org) { m_org = org; }
   INLINE void setcellsize(float size) { cellsize = size; }
-  INLINE void setnode(const csg::node *node) { m_node = node; }
+  INLINE void setnode(const csg::node &node) { m_csgnode = &node; }
   INLINE u32 qef_index(const vec3i &xyz) const {
     assert(all(ge(xyz,vec3i(zero))) && all(lt(xyz,vec3i(SUBGRID))));
     return xyz.x + (xyz.y + xyz.z * SUBGRID) * SUBGRID;
@@ -340,41 +482,180 @@ struct gridbuilder {
     return offset + edge * FIELDNUM;
   }
   INLINE fielditem &field(const vec3i &xyz) {return m_field[field_index(xyz)];}
+  INLINE bool inside(const vec3i &xyz) const {
+    return all(ge(xyz,vec3i(zero))) && all(lt(xyz,vec3i(SUBGRID)));
+  }
+
+  // level of the (non-empty) leaf that holds the given cell of the local grid
+  INLINE int celllevel(const vec3i &xyz) const {
+    if (inside(xyz)) return level;
+    const auto leaf = m_octree->findleaf(m_iorg + xyz*(1<<(maxlvl-level)));
+    return leaf == NULL || leaf->empty ? -1 : int(leaf->level);
+  }
+
+  // the cells around an edge may belong to leaves of different resolutions.
+  // the finest one outputs the quad since its edges see all the sign changes
+  // and the vertices of the coarser ones are shared by several of its quads.
+  // among leaves of the same level, the one with the lowest cell wins
+  INLINE bool ownquad(const vec3i *p) const {
+    if (inside(p[2]) && inside(p[0])) return true;
+    int lvl[4], finest = -1;
+    loopi(4) finest = max(finest, lvl[i] = celllevel(p[i]));
+    loopi(4) if (lvl[quadowner[i]] == finest) return inside(p[quadowner[i]]);
+    return false;
+  }
+
+  // the borders of the leaves after us that are already published
+  void getborders() {
+    loopi(7) {
+      const auto slot = m_after ? m_after[i] : -1;
+      const auto ready = slot >= 0 && m_slots[slot].ready;
+      m_borders[i] = ready ? m_slots[slot].data : NULL;
+    }
+  }
+
+  // copy the points of the block sampled by the leaves after us and return
+  // their mask. far items may be copies of a block center. we only take the
+  // near ones that are exact
+  u64 sharedfield(const vec3i &org, const vec3i &end) {
+    u64 shared = 0ull;
+    int bit = 0;
+    loopxyz(org, end) {
+      const auto mask = 1ull << bit++;
+      const auto dir = select(ge(xyz,vec3i(SUBGRID)), vec3i(one), vec3i(zero));
+      if (all(eq(dir,vec3i(zero)))) continue;
+      const auto b = m_borders[afterindex(dir)];
+      if (b == NULL) continue;
+      const auto &item = b->get(xyz-SUBGRID*dir);
+      if (abs(item.d) > 3.f*cellsize) continue;
+      field(xyz) = item;
+      shared |= mask;
+    }
+    return shared;
+  }
 
+  // get the crossing from the leaf after us that owns the start of the edge
+  bool sharededge(const pair<vec3i,vec4i> &e, edge &out) {
+    const auto edge = getedge(icubev[e.second.x], icubev[e.second.y]);
+    const auto start = e.first+edge.first;
+    const auto dir = select(ge(start,vec3i(SUBGRID)), vec3i(one), vec3i(zero));
+    if (all(eq(dir,vec3i(zero)))) return false;
+    const auto b = m_borders[afterindex(dir)];
+    if (b == NULL) return false;
+    const auto c = b->find(edge_index(start-SUBGRID*dir, edge.second));
+    if (c == NULL) return false;
+    if (min(c->mat.x,c->mat.y) != min(e.second.z,e.second.w) ||
+        max(c->mat.x,c->mat.y) != max(e.second.z,e.second.w))
+      return false;
+    out = *c;
+    return true;
+  }
+
+  // our first layers and the crossings of the edges that start on them
+  border *makeborder() {
+    const auto b = NEWE(border);
+    loopi(3) loopj(BORDERDIM) loopk(FIELDDIM) loopl(FIELDDIM) {
+      vec3i p;
+      p[i] = j;
+      p[(i+1)%3] = l;
+      p[(i+2)%3] = k;
+      b->field[i][j][k][l] = field(p);
+    }
+    loopv(m_delayed_edges) {
+      const auto &e = m_delayed_edges[i];
+      const auto edge = getedge(icubev[e.second.x], icubev[e.second.y]);
+      const auto start = e.first+edge.first;
+      if (any(eq(start,vec3i(zero))))
+        b->edges.push_back(makepair(edge_index(start, edge.second), m_edges[i]));
+    }
+    quicksort(b->edges.begin(), b->edges.end(),
+      [](const pair<u32,crossing> &a, const pair<u32,crossing> &b) {
+        return a.first < b.first;
+      });
+    return b;
+  }
+
+  INLINE vec3i blockorg(u32 idx) {
+    const auto x = idx%BLOCKDIM, y = (idx/BLOCKDIM)%BLOCKDIM, z = idx/(BLOCKDIM*BLOCKDIM);
+    return 4*vec3i(x,y,z);
+  }
+
+  // block of the field that holds the start of the edge
+  INLINE u32 edgeblock(const pair<vec3i,vec4i> &e) {
+    const auto edge = getedge(icubev[e.second.x], icubev[e.second.y]);
+    const auto b = (e.first+edge.first) >> vec3i(2);
+    return b.x + (b.y + b.z * BLOCKDIM) * BLOCKDIM;
+  }
+
+  // the field is only needed near the surface since tesselate skips the points
+  // farther than two cells. we first sample the center of each block of 4^3
+  // points and sample the complete block only if the surface may be close (the
+  // distance field is 1-lipschitz). other blocks just copy the center item that
+  // has the right sign and is far enough to be skipped as well
   void init_fields() {
-    stepxyz(vec3i(zero), vec3i(FIELDDIM), vec3i(4)) {
-      auto &pos = stack->p;
-      auto &d = stack->d;
-      auto &m = stack->m;
+    auto &pos = stack->p;
+    auto &d = stack->d;
+    auto &m = stack->m;
+    fielditem blocks[BLOCKNUM];
+    const auto pad = vec3f(4.f*cellsize);
+    const aabb blockbox(vertex(vec3i(zero))-pad, vertex(vec3i(FIELDDIM))+pad);
+    for (u32 first = 0; first < BLOCKNUM; first += csg::MAXPOINTNUM) {
+      const auto num = min(BLOCKNUM-first, csg::MAXPOINTNUM);
+      loopi(num) {
+        const auto org = blockorg(first+i);
+        const auto end = min(org+4,vec3i(FIELDDIM));
+        csg::set(pos, vertex(org)+vec3f(end-org-1)*(0.5f*cellsize), i);
+      }
+      isodist(m_program, pos, NULL, d, m, num, blockbox, NULL);
+      loopi(num) blocks[first+i] = fielditem(d[i], m[i]);
+      STATS_ADD(iso_num, num);
+      STATS_ADD(iso_block_num, num);
+    }
+
+    loopi(BLOCKNUM) {
+      const auto sxyz = blockorg(i);
+      const auto end = min(sxyz+4,vec3i(FIELDDIM));
+      const auto radius = 0.5f*cellsize*length(vec3f(end-sxyz-1));
+      if (abs(blocks[i].d) > radius+3.f*cellsize) {
+        loopxyz(sxyz, end) field(xyz) = blocks[i];
+        continue;
+      }
+      // the points already sampled by the leaves after us are just copied
       const auto p = vertex(sxyz);
       const auto box = aabb(p-2.f*cellsize, p+6.f*cellsize);
-      int index = 0;
-      const auto end = min(sxyz+4,vec3i(FIELDDIM));
-      loopxyz(sxyz, end) csg::set(pos, vertex(xyz), index++);
-      isodist(m_node, pos, NULL, d, m, index, box);
+      const auto onborder = any(gt(end,vec3i(SUBGRID)));
+      const auto shared = onborder ? sharedfield(sxyz, end) : 0ull;
+      int index = 0, bit = 0;
+      loopxyz(sxyz, end)
+        if ((shared & (1ull<<bit++)) == 0)
+          csg::set(pos, vertex(xyz), index++);
+      STATS_ADD(iso_shared_grid_num, bit-index);
+      STATS_ADD(iso_grid_num, bit);
+      if (index == 0) continue;
+      isodist(m_program, pos, NULL, d, m, index, box, NULL);
 #if !defined(NDEBUG)
       loopi(index) assert(d[i] <= 0.f || m[i] == csg::MAT_AIR_INDEX);
       loopi(index) assert(d[i] >= 0.f || m[i] != csg::MAT_AIR_INDEX);
 #endif /* NDEBUG */
       STATS_ADD(iso_num, index);
-      STATS_ADD(iso_grid_num, index);
-      index = 0;
-      loopxyz(sxyz, end) {
-        field(xyz) = fielditem(d[index], m[index]);
-        ++index;
-      }
+      index = bit = 0;
+      loopxyz(sxyz, end)
+        if ((shared & (1ull<<bit++)) == 0) {
+          field(xyz) = fielditem(d[index], m[index]);
+          ++index;
+        }
     }
   }
 
   void init_edges() {
-    m_edge_index.memset(u8(0xff));
+    memset(m_edge_index, 0xff, sizeof(u32)*6*FIELDNUM);
     m_edges.resize(0);
     m_delayed_edges.resize(0);
   }
 
   void init_qef() {
     m_qefnum = 0;
-    m_qef_index.memset(u8(0xff));
+    memset(m_qef_index, 0xff, sizeof(u32)*QEFNUM);
     delayed_qef.resize(0);
   }
 
@@ -395,127 +676,159 @@ struct gridbuilder {
     return edgemap;
   }
 
-  void edgepos(const csg::node *node, edgestack &stack, int num) {
+  // edges between air and solid are solved with a regula falsi (illinois
+  // variant) on the distances that keeps the crossing bracketed. edges between
+  // two solids only see the material change and use bisection. lanes stop
+  // once converged and only the others are evaluated again. all the steps
+  // use the culling box of the block of the edges and then only depend on
+  // the edge itself such that neighbor grids output the exact same result
+  void edgepos(edgestack &stack, int num, const aabb &box) {
     assert(num <= 64);
     auto &it = stack.it;
     auto &pos = stack.pos, &p = stack.p;
     auto &d = stack.d;
     auto &m = stack.m;
+    int lanes[64], active = num, evalnum = 0;
+    loopi(num) {
+      const auto air = int(csg::MAT_AIR_INDEX);
+      lanes[i] = i;
+      it[i].side = -1;
+      it[i].bisect = (it[i].m0 != air && it[i].m1 != air) || !(it[i].v0 < 0.f);
+    }
 
-    loopk(MAX_STEPS) {
-      auto box = aabb::empty();
-      loopi(num) {
-        const auto mid = (it[i].p0 + it[i].p1) * 0.5f;
-        const auto worldmid = it[i].org+cellsize*mid;
-        csg::set(p, mid, i);
-        csg::set(pos, worldmid, i);
-        box.pmin = min(worldmid, box.pmin);
-        box.pmax = max(worldmid, box.pmax);
+    for (int k = 0; k < MAX_STEPS && active != 0; ++k) {
+      loopi(active) {
+        const auto &e = it[lanes[i]];
+        const auto t = min(max(e.v0/(e.v0-e.v1), EDGE_T_MIN), 1.f-EDGE_T_MIN);
+        const auto x = e.bisect ? (e.p0+e.p1)*0.5f : e.p0+(e.p1-e.p0)*t;
+        csg::set(p, x, i);
+        csg::set(pos, e.org+cellsize*x, i);
       }
-      box.pmin -= 3.f * cellsize;
-      box.pmax += 3.f * cellsize;
-      isodist(m_node, pos, NULL, d, m, num, box);
-      if (k != MAX_STEPS-1) {
-        loopi(num) {
-          assert(!isnan(d[i]));
-          if (m[i] == int(it[i].m0)) {
-            it[i].p0 = csg::get(p,i);
-            it[i].v0 = d[i];
+      isodist(m_program, pos, NULL, d, m, active, box, NULL);
+      evalnum += active;
+
+      // update the brackets and only keep the lanes still running
+      const auto last = k == MAX_STEPS-1;
+      int next = 0;
+      loopi(active) {
+        auto &e = it[lanes[i]];
+        const auto x = csg::get(p,i);
+        assert(!isnan(d[i]));
+        auto done = last || (!e.bisect && abs(d[i]) < EDGE_DIST_EPS*cellsize);
+        if (!done) {
+          if (m[i] == int(e.m0)) {
+            if (e.side == 0) e.v1 *= 0.5f;
+            e.p0 = x;
+            e.v0 = d[i];
+            e.side = 0;
           } else {
-            it[i].p1 = csg::get(p,i);
-            it[i].v1 = d[i];
+            if (e.side == 1) e.v0 *= 0.5f;
+            e.p1 = x;
+            e.v1 = d[i];
+            e.side = 1;
           }
+          e.bisect = e.bisect || !(e.v0 < 0.f) || e.v1 < 0.f;
+          done = !e.bisect && reduceadd(abs(e.p1-e.p0)) < EDGE_BRACKET_EPS;
         }
-      } else {
-        loopi(num) {
-          const auto src = csg::get(p,i);
-          it[i].p0 = src;
+        if (done) {
+          e.p0 = x;
 #if !defined(NDEBUG)
-          assert(!isnan(src.x)&&!isnan(src.y)&&!isnan(src.z));
-          assert(!isinf(src.x)&&!isinf(src.y)&&!isinf(src.z));
+          assert(!isnan(x.x)&&!isnan(x.y)&&!isnan(x.z));
+          assert(!isinf(x.x)&&!isinf(x.y)&&!isinf(x.z));
 #endif /* !defined(NDEBUG) */
-        }
+        } else
+          lanes[next++] = lanes[i];
+      }
+      active = next;
+    }
+    STATS_ADD(iso_edgepos_num, evalnum);
+    STATS_ADD(iso_num, evalnum);
+  }
+
+  // solve the given edges with packets of (up-to) 64 points. we need to be
+  // careful FP wise. We ensure here that the position computation is
+  // invariant from grids to grids such that neighbor grids will output the
+  // exact same result
+  void finish_packet(const u32 *edges, int num, const aabb &box) {
+    auto &it = stack->it;
+
+    // step 1 - find the crossing on each edge
+    loopj(num) {
+      const auto &e = m_delayed_edges[edges[j]];
+      const auto idx0 = e.second.x, idx1 = e.second.y;
+      const auto xyz = e.first;
+      const auto edge = getedge(icubev[idx0], icubev[idx1]);
+      it[j].org = vertex(xyz+edge.first);
+      it[j].p0 = vec3f(icubev[idx0]-edge.first);
+      it[j].p1 = vec3f(icubev[idx1]-edge.first);
+      it[j].v0 = field(xyz + icubev[idx0]).d;
+      it[j].v1 = field(xyz + icubev[idx1]).d;
+      it[j].m0 = e.second.z;
+      it[j].m1 = e.second.w;
+      if (it[j].v1 < 0.f) {
+        swap(it[j].p0,it[j].p1);
+        swap(it[j].v0,it[j].v1);
+        swap(it[j].m0,it[j].m1);
       }
     }
-    STATS_ADD(iso_edgepos_num, num*MAX_STEPS);
-    STATS_ADD(iso_num, num*MAX_STEPS);
+    edgepos(*stack, num, box);
+
+    // step 2 - compute normals for each point with the gradient of the field
+    auto &p = stack->p;
+    auto &g = stack->pos;
+    auto &d = stack->d;
+    auto &m = stack->m;
+    auto &nd = stack->nd;
+    loopk(num) {
+      csg::set(p, it[k].org + it[k].p0 * cellsize, k);
+      const auto m0 = it[k].m0, m1 = it[k].m1;
+      bool const solidsolid = m0 != csg::MAT_AIR_INDEX && m1 != csg::MAT_AIR_INDEX;
+      nd[k] = solidsolid ? cellsize : 0.f;
+    }
+    isodist(m_program, p, &nd, d, m, num, box, &g);
+    STATS_ADD(iso_num, num);
+    STATS_ADD(iso_gradient_num, num);
+
+    loopk(num) {
+      const auto grad = csg::get(g, k);
+      const auto n = grad==vec3f(zero) ? vec3f(zero) : normalize(grad);
+      m_edges[edges[k]] = {it[k].p0,n,vec2i(it[k].m0,it[k].m1)};
+    }
   }
 
+  // the packets only hold edges that start in the same block of 4^3 points
+  // and their queries are culled with the box of the block. the blocks are
+  // aligned on the global grid and this box is within the bounds of the
+  // program of every leaf that sees the block. the leaves then see the same
+  // nodes of the tree for the same edge. the crossings already found by the
+  // leaves after us are just copied
   void finish_edges() {
     const auto len = m_delayed_edges.size();
     STATS_ADD(iso_edge_num, len);
-    for (int i = 0; i < len; i += 64) {
-      auto &it = stack->it;
-
-      // step 1 - run bisection with packets of (up-to) 64 points. we need
-      // to be careful FP wise. We ensure here that the position computation is
-      // invariant from grids to grids such that neighbor grids will output the
-      // exact same result
-      const int num = min(64, len-i);
-      loopj(num) {
-        const auto &e = m_delayed_edges[i+j];
-        const auto idx0 = e.second.x, idx1 = e.second.y;
-        const auto xyz = e.first;
-        const auto edge = getedge(icubev[idx0], icubev[idx1]);
-        it[j].org = vertex(xyz+edge.first);
-        it[j].p0 = vec3f(icubev[idx0]-edge.first);
-        it[j].p1 = vec3f(icubev[idx1]-edge.first);
-        it[j].v0 = field(xyz + icubev[idx0]).d;
-        it[j].v1 = field(xyz + icubev[idx1]).d;
-        it[j].m0 = e.second.z;
-        it[j].m1 = e.second.w;
-        if (it[j].v1 < 0.f) {
-          swap(it[j].p0,it[j].p1);
-          swap(it[j].v0,it[j].v1);
-          swap(it[j].m0,it[j].m1);
-        }
-      }
-      edgepos(m_node, *stack, num);
-
-      // step 2 - compute normals for each point using packets of 16x4 points
-      const auto dx = vec3f(DEFAULT_GRAD_STEP, 0.f, 0.f);
-      const auto dy = vec3f(0.f, DEFAULT_GRAD_STEP, 0.f);
-      const auto dz = vec3f(0.f, 0.f, DEFAULT_GRAD_STEP);
-      for (int j = 0; j < num; j += 16) {
-        const int subnum = min(num-j, 16);
-        auto &p = stack->p;
-        auto &d = stack->d;
-        auto &m = stack->m;
-        auto &nd = stack->nd;
-        auto box = aabb::empty();
-        loopk(subnum) {
-          const auto center = it[j+k].org + it[j+k].p0 * cellsize;
-          csg::set(p, center,    4*k+0);
-          csg::set(p, center-dx, 4*k+1);
-          csg::set(p, center-dy, 4*k+2);
-          csg::set(p, center-dz, 4*k+3);
-          box.pmin = min(center, box.pmin);
-          box.pmax = max(center, box.pmax);
-        }
-        box.pmin -= 3.f * cellsize;
-        box.pmax += 3.f * cellsize;
-
-        loopk(4*subnum) {
-          const auto m0 = it[j+k/4].m0;
-          const auto m1 = it[j+k/4].m1;
-          bool const solidsolid = m0 != csg::MAT_AIR_INDEX && m1 != csg::MAT_AIR_INDEX;
-          nd[k] = solidsolid ? cellsize : 0.f;
-        }
-        isodist(m_node, p, &nd, d, m, 4*subnum, box);
-        STATS_ADD(iso_num, 4*subnum);
-        STATS_ADD(iso_gradient_num, 4*subnum);
-
-        loopk(subnum) {
-          const auto c    = d[4*k+0];
-          const auto dfdx = d[4*k+1];
-          const auto dfdy = d[4*k+2];
-          const auto dfdz = d[4*k+3];
-          const auto grad = vec3f(c-dfdx, c-dfdy, c-dfdz);
-          const auto n = grad==vec3f(zero) ? vec3f(zero) : normalize(grad);
-          const auto p = it[j+k].p0;
-          m_edges.push_back({p,n,vec2i(it[j+k].m0,it[j+k].m1)});
-        }
-      }
+    m_edges.resize(len);
+    getborders();
+
+    // sort the edges by block. first[b] is then the end of block b
+    u32 first[BLOCKNUM+1];
+    memset(first, 0, sizeof(first));
+    auto &scratch = task::scratch();
+    const auto blocks = scratch.alloc<u32>(max(len,1));
+    loopi(len) {
+      const auto &e = m_delayed_edges[i];
+      const auto shared = sharededge(e, m_edges[i]);
+      blocks[i] = shared ? BLOCKNUM : edgeblock(e);
+      if (shared) STATS_INC(iso_shared_edge_num);
+      else ++first[blocks[i]+1];
+    }
+    loopi(BLOCKNUM) first[i+1] += first[i];
+    const auto order = scratch.alloc<u32>(max(len,1));
+    loopi(len) if (blocks[i] != BLOCKNUM) order[first[blocks[i]]++] = i;
+
+    for (u32 block = 0, start = 0; block < BLOCKNUM; start = first[block++]) {
+      const auto org = blockorg(block);
+      const aabb box(vertex(org-3), vertex(org+7));
+      for (auto i = start; i < first[block]; i += 64)
+        finish_packet(order+i, min(64u, first[block]-i), box);
     }
   }
 
@@ -565,13 +878,17 @@ struct gridbuilder {
         const auto d = p[i] - mass;
         vector[i] = double(dot(n[i],d));
       }
-      const auto pos = mass + qef::evaluate(matrix, vector, num);
-      const auto worldpos = vertex(xyz) + pos*cellsize;
+      const auto qefpos = mass + qef::evaluate(matrix, vector, num);
+
+      // the point may be far away when the normals are almost parallel. we
+      // keep it in its cell and the cells around it
+      const auto pos = clamp(qefpos, vec3f(-QEF_MAX_OFFSET), vec3f(1.f+QEF_MAX_OFFSET));
+      if (any(ne(pos, qefpos))) STATS_INC(iso_qef_clamped_num);
       const auto localpos = (vec3f(xyz)+pos)*cellsize;
 
       // insert the point in the leaf octree
       pl.leaf.insert(xyz,pl.leaf.pts.size());
-      pl.leaf.pts.push_back({worldpos,localpos,q,xyz,multimat?airmat:mat});
+      pl.leaf.pts.push_back({localpos,q,xyz,multimat?airmat:mat});
     }
   }
 
@@ -581,10 +898,6 @@ struct gridbuilder {
       const auto startsign = startfield.d < 0.f ? 1 : 0;
       if (abs(field(xyz).d) > 2.f*cellsize) continue;
 
-      // some quads belong to our neighbor. we will not push them but we need to
-      // compute their vertices such that our neighbor can output these quads
-      const auto outside = any(eq(xyz,0));
-
       // look at the three edges that start on xyz
       loopi(3) {
 
@@ -613,8 +926,9 @@ struct gridbuilder {
           }
         }
 
-        // we must use a more compact storage for it
-        if (outside) continue;
+        // some quads belong to our neighbors. we will not push them but we
+        // need to compute their vertices such that they can output these quads
+        if (!ownquad(p)) continue;
         const auto qor = startsign==1 ? quadorder : quadorder_cc;
         const quad q = {
           {p[qor[0]],p[qor[1]],p[qor[2]],p[qor[3]]},
@@ -635,14 +949,8 @@ struct gridbuilder {
     if (from->isleaf) {
       if (!from->empty) {
         to->idx = node.leaf->pts.size();
-        const octree::point pt = {
-          pl.leaf.pts[from->idx].world,
-          u32(uintptr(node.leaf)),
-#if POINTER_BYTE_SIZE == 8
-          u32(uintptr(node.leaf) >> 32ull)
-#endif /* POINTER_BYTE_SIZE == 8 */
-        };
-        node.leaf->pts.push_back(pt);
+        const auto local = pl.leaf.pts[from->idx].local / cellsize;
+        node.leaf->pts.push_back(octree::point::encode(local));
       }
       return;
     }
@@ -662,11 +970,29 @@ struct gridbuilder {
     node.leaf->quads = move(pl.leaf.quads);
   }
 
+  // empty but valid leaf when the build is abandoned
+  void abandon(octree::node &node) {
+    node.leaf->root.resize(1);
+    node.leaf->root[0].setemptyleaf();
+  }
+
+  // all queries of the leaf stay within a few cells around its grid. the tree
+  // is lowered once for these bounds and the nodes far from the leaf are gone
+  void compile() {
+    const auto pad = vec3f(8.f*cellsize);
+    const aabb bounds(vertex(vec3i(zero))-pad, vertex(vec3i(FIELDDIM))+pad);
+    m_program = threadcompile(*m_csgnode, bounds);
+  }
+
   void build(octree::node &node) {
     pl.leaf.init();
+    compile();
+    getborders();
     init_fields();
+    if (task::cancelled()) return abandon(node);
     init_edges();
     init_qef();
+    if (task::cancelled()) return abandon(node);
     tesselate();
     finish_edges();
     finish_vertices();
@@ -674,14 +1000,18 @@ struct gridbuilder {
     output(node);
   }
 
-  const csg::node *m_node;
+  const csg::node *m_csgnode;
+  csg::program *m_program;
+  borderslot *m_slots;
+  const s32 *m_after;
+  const border *m_borders[7];
   ref<rt::intersector> bvh;
-  vector<fielditem> m_field;
-  vector<u32> m_qef_index;
-  vector<u32> m_edge_index;
-  vector<edge> m_edges;
-  vector<pair<vec3i,vec4i>> m_delayed_edges;
-  vector<pair<vec3i,int>> delayed_qef;
+  fielditem *m_field;
+  u32 *m_qef_index;
+  u32 *m_edge_index;
+  vector<edge,scratchallocator> m_edges;
+  vector<pair<vec3i,vec4i>,scratchallocator> m_delayed_edges;
+  vector<pair<vec3i,int>,scratchallocator> delayed_qef;
   edgestack *stack;
   const octree *m_octree;
   procleaf pl;
@@ -695,99 +1025,209 @@ struct gridbuilder {
 /*-------------------------------------------------------------------------
  - multi-threaded implementation of the iso surface extraction
  -------------------------------------------------------------------------*/
-static THREAD gridbuilder *localbuilder = NULL;
-struct context {
-  INLINE context() : m_mutex(SDL_CreateMutex()) {}
-  SDL_mutex *m_mutex;
-  vector<gridbuilder*> m_builders;
+// what to run per leaf of octree when contouring with small grids
+struct contouringitem {
+  const csg::node *csgnode;
+  struct octree::node *octnode;
+  struct octree *oct;
+  vec3i iorg;
+  vec3f org;
+  int level;
+  int maxlvl;
+  float cellsize;
+  ref<rt::intersector> bvh;
+  borderslot *slots; // the borders of all the leaves (NULL to share nothing)
+  u32 slot;
 };
-static context *ctx = NULL;
-
-// run the contouring part per leaf of octree using small grids
-struct task_contouring : public task {
-
-  // what to run per task iteration
-  struct workitem {
-    const csg::node *csgnode;
-    struct octree::node *octnode;
-    struct octree *oct;
-    vec3i iorg;
-    vec3f org;
-    int level;
-    int maxlvl;
-    float cellsize;
-    ref<rt::intersector> bvh;
-  };
 
-  INLINE task_contouring(vector<workitem> &items) :
-    task("task_contouring", items.size()), items(items)
-  {}
+static gridbuilder &newbuilder(arena &scratch, const contouringitem &job) {
+  auto &b = *new (scratch.alloc<gridbuilder>(1)) gridbuilder(scratch);
+  b.m_octree = job.oct;
+  b.m_iorg = job.iorg;
+  b.level = job.level;
+  b.maxlvl = job.maxlvl;
+  b.setcellsize(job.cellsize);
+  b.setnode(*job.csgnode);
+  b.setorg(job.org);
+  if (job.slots) {
+    b.m_slots = job.slots;
+    b.m_after = job.slots[job.slot].after;
+  }
+  return b;
+}
+
+// give our border to the leaves before us that still need it and release the
+// ones of the leaves after us
+static void publish(const contouringitem &job, gridbuilder &b) {
+  if (job.slots == NULL) return;
+  auto &slot = job.slots[job.slot];
+  if (slot.refs > 1 && !task::cancelled()) {
+    slot.data = b.makeborder();
+    storerelease(slot.ready, 1);
+  }
+  loopi(7) if (slot.after[i] >= 0) release(job.slots[slot.after[i]]);
+  release(slot);
+}
 
-  virtual void run(u32 idx) {
-    if (localbuilder == NULL) {
-      localbuilder = NEWE(gridbuilder);
-      SDL_LockMutex(ctx->m_mutex);
-      ctx->m_builders.push_back(localbuilder);
-      SDL_UnlockMutex(ctx->m_mutex);
+#if DEBUGEDGES
+// the neighbors of the same level after the leaf find the crossings of the
+// edges they share with it again. they must be the same bit for bit
+static void checkedges(const contouringitem &job, const gridbuilder &b) {
+  auto &scratch = task::scratch();
+  rangei(1,8) {
+    const auto delta = icubev[i]*SUBGRID;
+    auto other = job;
+    other.slots = NULL;
+    other.iorg = job.iorg + delta*(1<<(job.maxlvl-job.level));
+    other.org = job.org + vec3f(delta)*job.cellsize;
+    const auto leaf = job.oct->findleaf(other.iorg);
+    if (leaf == NULL || leaf->empty || int(leaf->level) != job.level) continue;
+    auto &n = newbuilder(scratch, other);
+    n.compile();
+    n.init_fields();
+    n.init_edges();
+    n.init_qef();
+    n.tesselate();
+    n.finish_edges();
+    loopvj(b.m_delayed_edges) {
+      const auto &e = b.m_delayed_edges[j];
+      const auto edge = getedge(icubev[e.second.x], icubev[e.second.y]);
+      const auto start = e.first + edge.first - delta;
+      if (any(lt(start, vec3i(zero)))) continue;
+      const auto idx = n.m_edge_index[n.edge_index(start, edge.second)];
+      if (idx == NOINDEX) continue;
+      const auto &e0 = b.m_edges[j], &e1 = n.m_edges[idx];
+      if (memcmp(&e0, &e1, sizeof(gridbuilder::edge)) == 0) continue;
+      con::out("iso: edge (%d %d %d) %d differs in the neighbor leaf",
+        other.iorg.x+start.x, other.iorg.y+start.y, other.iorg.z+start.z, edge.second);
+      assert("shared edge differs" && false);
     }
-    const auto &job = items[idx];
-    localbuilder->m_octree = job.oct;
-    localbuilder->m_iorg = job.iorg;
-    localbuilder->level = job.octnode->level;
-    localbuilder->maxlvl = job.maxlvl;
-    localbuilder->setcellsize(job.cellsize);
-    localbuilder->setnode(job.csgnode);
-    localbuilder->setorg(job.org);
-    localbuilder->build(*job.octnode);
-  }
-  vector<workitem> &items;
-};
+    n.~gridbuilder();
+  }
+}
+#endif /* DEBUGEDGES */
+
+// run the contouring part for one leaf of octree. the leaves of a loop chunk
+// run in the same element so we rewind the arena ourselves
+static void contouring(const contouringitem &job) {
+  auto &scratch = task::scratch();
+  const auto marker = scratch.mark();
+  auto &b = newbuilder(scratch, job);
+  b.build(*job.octnode);
+#if DEBUGEDGES
+  checkedges(job, b);
+#endif /* DEBUGEDGES */
+  publish(job, b);
+  b.~gridbuilder();
+  scratch.rewind(marker);
+}
 
-// build the octree topology needed to run contouring
+// build the octree topology needed to run contouring. with a dirty box, only
+// the part of an existing octree that sees it is built again
 struct task_iso : public task {
-  typedef task_contouring::workitem workitem;
+  typedef contouringitem workitem;
   INLINE task_iso(octree &o, const csg::node &csgnode,
                  const vec3f &org, float cellsize,
-                 u32 dim, u32 waiternum = 0) :
+                 u32 dim, const aabb &dirty = aabb::all(), u32 waiternum = 0) :
     task("task_iso", 1, waiternum),
-    oct(&o), csgnode(&csgnode),
-    org(org), cellsize(cellsize), dim(dim)
+    slots(NULL), cache(NULL), oct(&o), csgnode(&csgnode),
+    org(org), dirty(dirty), cellsize(cellsize), dim(dim),
+    bmin(zero), bmax(int(dim))
   {
     assert(ispoweroftwo(dim) && dim % SUBGRID == 0);
     maxlvl = ilog2(dim / SUBGRID);
   }
-
+  virtual ~task_iso() {
+    if (slots == NULL) return;
+    loopv(items) SAFE_DEL(slots[i].data);
+    SAFE_DELA(slots);
+  }
   virtual void run(u32) {
-    build(oct->m_root);
+    assert((all(eq(bmin,vec3i(zero))) && all(eq(bmax,vec3i(dim)))) ||
+           oct->m_lod.distance == 0.f);
+    update(oct->m_root);
     build_iso_jobs(oct->m_root);
-    ref<task> contouring = NEW(task_contouring, items);
-    contouring->ends(*this);
-    contouring->scheduled();
+    link_borders();
+
+    // the leaves run from the last one such that the leaves after a leaf
+    // (whose borders it reads) are mostly done before it
+    ref<task> leaves = make_parallel_for("task_contouring", 0, items.size(), 0,
+      [this](u32 idx) {contouring(items[items.size()-1-idx]);});
+    leaves->ends(*this);
+    leaves->scheduled();
   }
 
   INLINE vec3f pos(const vec3i &xyz) {return org+cellsize*vec3f(xyz);}
 
+  // the leaves just after the brick are only contoured for their vertices
+  INLINE bool afterbrick(const vec3i &xyz) const {
+    return all(ge(xyz, bmin)) && any(ge(xyz, bmax));
+  }
+
+  // far enough from all viewpoints to be contoured with coarser cells
+  bool coarse(const vec3i &xyz, int cellnum) {
+    const auto &lod = oct->m_lod;
+    if (lod.distance == 0.f) return false;
+    const auto pmin = pos(xyz), pmax = pos(xyz + cellnum);
+    const auto mindist = max(lod.distance, 2.f) * cellsize * float(cellnum);
+    loopv(lod.viewpoints) {
+      const auto p = lod.viewpoints[i];
+      const auto d = max(max(pmin-p, p-pmax), vec3f(zero));
+      if (length(d) < mindist) return false;
+    }
+    return true;
+  }
+
+  // a leaf sees the dirty box through its field (two cells around it) and
+  // through the quads it shares with its neighbors in the positive directions
+  // that point to their vertices. the subtrees that see it are built again
+  // and all others are kept as they are. with levels of detail, the quads may
+  // also point to a coarser neighbor (twice as large at most) on both sides
+  void update(octree::node &node, const vec3i &xyz = vec3i(zero), u32 level = 0) {
+    const auto cellnum = int(dim >> level);
+    const auto lod = oct->m_lod.distance != 0.f;
+    const auto lo = lod ? 3*cellnum : 2, hi = lod ? 3*cellnum : SUBGRID+2;
+    const aabb box(pos(xyz - lo), pos(xyz + cellnum + hi));
+    if (!intersect(box, dirty)) return;
+    if (node.isleaf || node.children == NULL) {
+      node.clear();
+      build(node, xyz, level);
+    } else loopi(8) {
+      const auto childxyz = xyz+cellnum*icubev[i]/2;
+      update(node.children[i], childxyz, level+1);
+    }
+  }
+
   void build(octree::node &node, const vec3i &xyz = vec3i(zero), u32 level = 0) {
     node.level = level;
     node.org = xyz;
 
-    // bounding box of this octree cell
-    const auto lod = maxlvl - level;
-    const vec3f pmin = pos(xyz - int(4<<lod));
-    const vec3f pmax = pos(xyz + int((SUBGRID+4)<<lod));
-
-    // center of the box where to evaluate the distance field
+    // bounding box of this octree cell with a two cell margin
     const auto cellnum = int(dim >> level);
-    const auto icenter = xyz + cellnum/2;
-    const auto center = pos(icenter);
-    const auto dist = csg::dist(csgnode, center, aabb(pmin,pmax));
+    const vec3f pmin = pos(xyz - 2);
+    const vec3f pmax = pos(xyz + cellnum + 2);
+    if (task::cancelled()) {
+      node.isleaf = node.empty = 1;
+      return;
+    }
+
+    // with a brick, we only go down to its leaves and to the ones around it.
+    // the leaves after it own vertices its quads also use and the ones before
+    // tell which quads its leaves own
+    if (any(ge(xyz, bmax+SUBGRID)) || any(le(xyz+cellnum, bmin-SUBGRID))) {
+      node.isleaf = node.empty = 1;
+      return;
+    }
+
+    // fully inside or fully outside cells have nothing to contour
+    const auto range = csg::dist(csgnode, aabb(pmin,pmax));
     STATS_INC(iso_octree_num);
     STATS_INC(iso_num);
-    if (abs(dist) > sqrt(3.f) * cellsize * float(cellnum/2+2)) {
+    if (range.m > 0.f || range.M < 0.f) {
       node.isleaf = node.empty = 1;
       return;
     }
-    if (cellnum == SUBGRID) {
+    if (cellnum == SUBGRID || coarse(xyz, cellnum)) {
 #if DEBUGOCTREE
       const vec3f minpos = pos(xyz) - vec3f(debugsize);
       const vec3f maxpos = pos(xyz+vec3i(SUBGRID)) + vec3f(debugsize);
@@ -796,8 +1236,11 @@ struct task_iso : public task {
         return;
       }
 #endif /* DEBUGOCTREE */
-      node.leaf = NEWE(octree::leaftype);
       node.isleaf = 1;
+      node.dirty = all(ge(xyz, bmin)) && all(lt(xyz, bmax));
+      node.leaf = NULL;
+      if (cache && (node.dirty || afterbrick(xyz))) node.leaf = cache->take(xyz);
+      if (node.leaf == NULL) node.leaf = NEWE(octree::leaftype);
     } else {
       node.children = NEWAE(octree::node, 8);
       loopi(8) {
@@ -807,8 +1250,36 @@ struct task_iso : public task {
     }
   }
 
+  // find the leaves of the same level after each leaf by one leaf on x, y
+  // and/or z. a leaf border is read by the leaves before it
+  void link_borders() {
+    if (items.size() == 0) return;
+    slots = NEWAE(borderslot, items.size());
+    hash_map<const octree::node*, s32> index;
+    loopv(items) index.insert(makepair((const octree::node*) items[i].octnode, s32(i)));
+    loopv(items) {
+      auto &job = items[i];
+      job.slots = slots;
+      job.slot = i;
+      const auto leafsize = SUBGRID << (maxlvl-job.level);
+      rangej(1,8) {
+        const auto dir = vec3i(j&1, (j>>1)&1, (j>>2)&1);
+        const auto xyz = job.iorg + dir*leafsize;
+        const auto leaf = oct->findleaf(xyz);
+        if (leaf == NULL || int(leaf->level) != job.level) continue;
+        if (any(ne(leaf->org, xyz))) continue;
+        const auto it = index.find(leaf);
+        if (it == index.end()) continue;
+        slots[i].after[afterindex(dir)] = it->second;
+        ++slots[it->second].refs;
+      }
+    }
+  }
+
   void build_iso_jobs(octree::node &node, const vec3i &xyz = vec3i(zero)) {
     if (node.isleaf && !node.empty) {
+      if (!node.dirty && !afterbrick(xyz)) return;
+      if (node.leaf->root.size() != 0) return; // contoured by another brick
       workitem job;
       job.oct = oct;
       job.octnode = &node;
@@ -818,6 +1289,8 @@ struct task_iso : public task {
       job.level = node.level;
       job.cellsize = float(1<<(maxlvl-node.level)) * cellsize;
       job.org = pos(xyz);
+      job.slots = NULL;
+      job.slot = 0;
       items.push_back(job);
     } else if (!node.isleaf) loopi(8) {
       const auto cellnum = dim >> node.level;
@@ -827,20 +1300,85 @@ struct task_iso : public task {
   }
 
   vector<workitem> items;
+  borderslot *slots;
+  brickcache *cache;
   octree *oct;
   const csg::node *csgnode;
   vec3f org;
+  aabb dirty;
   float cellsize;
   u32 dim, maxlvl;
+  vec3i bmin, bmax;
 };
 
+// leaves are keyed by their origin. they all have the finest level
+static u64 leafkey(const vec3i &xyz) {
+  const auto p = xyz/SUBGRID;
+  return u64(p.x) | (u64(p.y)<<21) | (u64(p.z)<<42);
+}
+
+brickcache::~brickcache() {
+  for (auto it = m_leaves.begin(); it != m_leaves.end(); ++it) SAFE_DEL(it->second);
+}
+
+octree::leaftype *brickcache::take(const vec3i &xyz) {
+  const auto it = m_leaves.find(leafkey(xyz));
+  if (it == m_leaves.end()) return NULL;
+  const auto leaf = it->second;
+  m_leaves.erase(it);
+  return leaf;
+}
+
+static void keepleaves(octree::node &node, const vec3i &bmin, const vec3i &bmax,
+                       hash_map<u64, octree::leaftype*> &leaves) {
+  if (node.isleaf) {
+    if (node.empty || node.leaf == NULL) return;
+    if (any(lt(node.org, bmin)) || all(lt(node.org, bmax))) return;
+    leaves.insert(makepair(leafkey(node.org), node.leaf));
+    node.leaf = NULL;
+  } else if (node.children != NULL)
+    loopi(8) keepleaves(node.children[i], bmin, bmax, leaves);
+}
+
+void brickcache::keep(octree &o, const vec3i &bmin, const vec3i &bmax) {
+  keepleaves(o.m_root, bmin, bmax, m_leaves);
+}
+
 ref<task> create_task(octree &o, const csg::node &node, const vec3f &org, u32 cellnum, float cellsize) {
   return NEW(task_iso, o, node, org, cellsize, cellnum);
 }
 
+ref<task> create_brick_task(octree &o, const csg::node &node,
+                            const vec3i &bmin, const vec3i &bmax,
+                            const vec3f &org, u32 cellnum, float cellsize,
+                            brickcache *cache) {
+  assert(all(eq(bmin%SUBGRID,vec3i(zero))) && all(eq(bmax%SUBGRID,vec3i(zero))));
+  const auto t = NEW(task_iso, o, node, org, cellsize, cellnum);
+  t->bmin = bmin;
+  t->bmax = bmax;
+  t->cache = cache;
+  return t;
+}
+
+ref<task> create_update_task(octree &o, const csg::node &node, const aabb &dirty,
+                             const vec3f &org, u32 cellnum, float cellsize) {
+  return NEW(task_iso, o, node, org, cellsize, cellnum, dirty);
+}
+
+static bool initialized = false;
 void start() {
   using namespace sys;
-  if (/* hasfeature(CPU_YMM) && */ sys::hasfeature(CPU_AVX)) {
+  const auto ymm = hasfeature(CPU_YMM) && hasfeature(CPU_AVX);
+  const auto avx2 = ymm && hasfeature(CPU_AVX2) && hasfeature(CPU_FMA) &&
+                    hasfeature(CPU_BMI1) && hasfeature(CPU_LZCNT) &&
+                    hasfeature(CPU_F16C);
+  if (avx2 && hasfeature(CPU_AVX512F) && hasfeature(CPU_ZMM)) {
+    con::out("iso: avx512 path selected");
+    isodist = csg::avx512::dist;
+  } else if (avx2) {
+    con::out("iso: avx2 path selected");
+    isodist = csg::avx2::dist;
+  } else if (ymm) {
     con::out("iso: avx path selected");
     isodist = csg::avx::dist;
   } else if (hasfeature(CPU_SSE) && hasfeature(CPU_SSE2)) {
@@ -850,16 +1388,19 @@ void start() {
     con::out("iso: warning: slow path for isosurface extraction");
     isodist = csg::dist;
   }
-  ctx = NEWE(context);
+  programmutex = SDL_CreateMutex();
+  initialized = true;
 }
 
 void finish() {
-  if (ctx == NULL) return;
+  if (!initialized) return;
 #if !defined(RELEASE)
   stats();
 #endif
-  loopv(ctx->m_builders) SAFE_DEL(ctx->m_builders[i]);
-  DEL(ctx);
+  destroyprograms();
+  SDL_DestroyMutex(programmutex);
+  programmutex = NULL;
+  initialized = false;
 }
 } /* namespace mesh */
 } /* namespace iso */
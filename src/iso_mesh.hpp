@@ -8,6 +8,7 @@
 #include "bvh.hpp"
 #include "base/sys.hpp"
 #include "base/vector.hpp"
+#include "base/hash_map.hpp"
 #include "base/math.hpp"
 
 namespace q {
@@ -19,6 +20,8 @@ namespace mesh {
 ref<rt::intersector> get_voxel_bvh();
 #endif /* TEST_VOXEL_INTERSECTOR */
 
+static const int SUBGRID = 16;
+
 /*-------------------------------------------------------------------------
  - quad as generated by iso contouring
  -------------------------------------------------------------------------*/
@@ -63,52 +66,117 @@ struct leafoctree : leafoctreebase {
   vector<quad> quads; // all quads in the leaf
 };
 
+/*-------------------------------------------------------------------------
+ - distance based level of detail. a node of the octree is contoured as one
+ - leaf with coarser cells as soon as all the viewpoints are farther than
+ - 'distance' times its size. zero (the default) contours everything at full
+ - resolution. anything below 2 is taken as 2 so that neighbor leaves differ by
+ - one level at most
+ -------------------------------------------------------------------------*/
+struct lod {
+  INLINE lod() : distance(0.f) {}
+  vector<vec3f> viewpoints;
+  float distance;
+};
+
 /*-------------------------------------------------------------------------
  - spatial segmentation used for iso surface extraction
  -------------------------------------------------------------------------*/
 struct octree {
+  // qef point of a leaf. its position is relative to the leaf and quantized
+  // in 1/SCALE of its cells. points may be a bit outside of their cell (and
+  // of the leaf) so we keep MARGIN cells around the leaf. contouring keeps
+  // them closer than that so nothing is clamped here
   struct point {
-    INLINE void setasmerged() {ownerlo|=1;}
-    INLINE void setptr(uintptr ptr) {
-      assert(ptr % 2 == 0 && "pointer is not properly aligned");
-      ownerlo = (ownerlo & 1) | u32(ptr);
-#if POINTER_BYTE_SIZE == 8
-      ownerhi = u32(ptr >> 32ull);
-#endif
+    static const int SCALE = 1024;
+    static const int MARGIN = 16;
+    static INLINE point encode(const vec3f &local) {
+      const auto q = (local + float(MARGIN)) * float(SCALE) + 0.5f;
+      const auto c = clamp(q, vec3f(zero), vec3f(65535.f));
+      assert(all(eq(c, q)) && "qef point too far from its leaf");
+      const point pt = {vec3<u16>(u16(c.x), u16(c.y), u16(c.z))};
+      return pt;
     }
-    vec3f pos;   // world position (TODO relative and quantize)
-    u32 ownerlo; // parent leaf or other point if collapsed with this point
-#if POINTER_BYTE_SIZE == 8
-    u32 ownerhi; // high part of the pointer
-#endif
+    INLINE vec3f decode() const {
+      return vec3f(pos) * (1.f/float(SCALE)) - float(MARGIN);
+    }
+    vec3<u16> pos; // position in the leaf cells (see encode)
   };
   struct node {
-    INLINE node() : children(NULL), level(0), isleaf(0), empty(0), flag(0) {}
-    ~node();
+    INLINE node() :
+      children(NULL), level(0), isleaf(0), empty(0), dirty(0), flag(0),
+      first(0), num(0) {}
+    INLINE ~node() {clear();}
+    void clear(); // free the leaf or the children and the bvh
     union {
       node *children;
       leafoctree<point> *leaf;
     };
     ref<rt::intersector> bvh;
     vec3i org;
-    u32 level:30;
+    u32 level:29;
     u32 isleaf:1;
     u32 empty:1;
+    u32 dirty:1;      // leaf contoured again and its triangles to rebuild
     u32 flag;
+    u32 first, num;   // range of triangles of the leaf in the final mesh
   };
   typedef leafoctree<point> leaftype;
 
+  // bytes allocated by the non-empty leaves for their octree, points and quads
+  struct memstats {u32 leafnum; u64 leaves, nodes, points, quads;};
+
   INLINE octree(u32 dim) : m_dim(dim), m_logdim(ilog2(dim)) {}
   const node *findleaf(vec3i xyz) const;
+  memstats memory() const;
+  // log2 of the size of the leaf cells in cells of the finest grid. this is
+  // also the level of detail of the leaf (0 for full resolution)
+  INLINE u32 cellshift(const node &leaf) const {
+    return m_logdim - ilog2(SUBGRID) - leaf.level;
+  }
+  // world position of a point of the leaf (cellsize is the finest one)
+  INLINE vec3f pos(const node &leaf, const point &pt, float cellsize) const {
+    const auto scale = float(1<<cellshift(leaf));
+    return (vec3f(leaf.org) + pt.decode()*scale) * cellsize;
+  }
   node m_root;
   u32 m_dim, m_logdim;
+  lod m_lod;
   ref<rt::intersector> bvh;
 };
-static const int SUBGRID = 16;
 
 // tesselate along a grid the distance field with dual contouring algorithm
 ref<task> create_task(octree&, const csg::node&, const vec3f&, u32 cellnum, float cellsize);
 
+// contour again the leaves of an already built octree that see the dirty box
+// (the ones whose quads reach it included). the new leaves are set as dirty
+ref<task> create_update_task(octree&, const csg::node&, const aabb &dirty,
+                             const vec3f&, u32 cellnum, float cellsize);
+
+// contoured leaves kept from one brick to the next ones. a leaf just after a
+// brick is contoured by the first brick that needs it. the next bricks take
+// it from here and the one that owns it (the last one to need it) keeps it
+struct brickcache {
+  ~brickcache();
+  // give back the leaves just after the brick once its mesh is built
+  void keep(octree&, const vec3i &bmin, const vec3i &bmax);
+  // remove and return the contoured leaf at xyz (NULL if none)
+  octree::leaftype *take(const vec3i &xyz);
+  hash_map<u64, octree::leaftype*> m_leaves;
+};
+
+// contour in an empty octree only the leaves whose origin is in [bmin,bmax)
+// (in cells of the finest grid). they are the dirty ones. the leaves just
+// after the brick (along +x, +y and +z) are contoured too since the quads of
+// the brick use their vertices but they are not dirty: they are the ones of
+// the next bricks. with a cache, the leaves it holds are not contoured again.
+// the leaves just before it are created but not contoured. there is no level
+// of detail with bricks
+ref<task> create_brick_task(octree&, const csg::node&,
+                            const vec3i &bmin, const vec3i &bmax,
+                            const vec3f&, u32 cellnum, float cellsize,
+                            brickcache *cache = NULL);
+
 void start();
 void finish();
 } /* namespace mesh */
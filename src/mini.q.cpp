@@ -165,6 +165,7 @@ void swap() {
 // static const float CELLSIZE = 0.2f;
 void start(int argc, char *argv[]) {
   bool dedicated = false;
+  u32 threadflags = 0;
   int uprate = 0, maxcl = 4;
   const char *master = NULL;
   const char *sdesc = "", *ip = "", *passwd = "";
@@ -172,6 +173,10 @@ void start(int argc, char *argv[]) {
     const char *a = &argv[i][2];
     if (argv[i][0]=='-') switch (argv[i][1]) {
       case 'd': dedicated = true; break;
+      case 'a':
+        threadflags = task::pinflags(argv[i]);
+        if (threadflags == 0) con::out("unknown commandline option");
+        break;
       case 't': fullscreen = 0; break;
       case 'w': sys::scrw  = atoi(a); break;
       case 'h': sys::scrh  = atoi(a); break;
@@ -225,8 +230,8 @@ void start(int argc, char *argv[]) {
   _mm_setcsr(_mm_getcsr() | (1<<15) | (1<<6));
 #endif
   const u32 threadnum = sys::threadnumber() - 1;
-  con::out("init: tasking system: %d threads created", threadnum);
-  task::start(&threadnum, 1);
+  task::start(&threadnum, 1, threadflags);
+  con::out("init: tasking system: %d threads created", task::threadnum());
 
   con::out("init: video: sdl");
   rr::VIRTH = rr::VIRTW * float(sys::scrh) / float(sys::scrw);
@@ -274,7 +279,7 @@ void start(int argc, char *argv[]) {
 
   con::out("init: csg module");
   csg::start();
-  script::execscript("data/csg.lua");
+  csg::loadscene("data/csg.lua");
   inputgrab(false);
 
   con::out("localconnect");
@@ -304,8 +309,8 @@ void finish() {
   game::zapdynent(game::player1);
   game::cleanmonsters();
   rt::finish();
-  //iso::finish();
   rr::finish();
+  iso::mesh::finish();
   md2::finish();
   shaders::finish();
   text::finish();
@@ -23,6 +23,14 @@ static void outputcpufeatures() {
   }
   con::out(features.c_str());
 }
+static void outputmemory(const iso::mesh::octree &o) {
+  const auto mem = o.memory();
+  const auto n = double(max(mem.leafnum, 1u));
+  const auto tot = mem.leaves + mem.nodes + mem.points + mem.quads;
+  con::out("iso: memory: %d leaves, %.1f bytes/leaf", mem.leafnum, double(tot)/n);
+  con::out("iso: memory: leaf %.1f, nodes %.1f, points %.1f, quads %.1f bytes/leaf",
+    double(mem.leaves)/n, double(mem.nodes)/n, double(mem.points)/n, double(mem.quads)/n);
+}
 static geom::dcmesh dc(const vec3f &org, u32 cellnum, float cellsize, const csg::node &root) {
   iso::mesh::octree o(cellnum);
   geom::dcmesh m;
@@ -32,13 +40,71 @@ static geom::dcmesh dc(const vec3f &org, u32 cellnum, float cellsize, const csg:
   iso_task->scheduled();
   geom_task->scheduled();
   geom_task->wait();
+  outputmemory(o);
   return m;
 }
 
+// count the leaves a brick owns
+static u64 countleaves(const iso::mesh::octree::node &node) {
+  if (node.isleaf)
+    return node.empty || node.leaf == NULL || !node.dirty ? 0 : 1;
+  u64 num = 0;
+  if (node.children != NULL)
+    loopi(8) num += countleaves(node.children[i]);
+  return num;
+}
+
+// stream the world brick by brick: only the octree and the mesh of the
+// current brick live in memory and each mesh is appended to the file as a
+// chunk. the leaves just after a brick are kept for the next bricks that need
+// them too such that every leaf is contoured once
+static void dcstream(const char *filename, const vec3f &org, u32 cellnum,
+                     u32 bricknum, float cellsize, const csg::node &root)
+{
+  geom::chunkwriter w(filename);
+  iso::mesh::brickcache cache;
+  u64 leafnum = 0, keptnum = 0;
+  loopxyz(vec3i(zero), vec3i(int(cellnum/bricknum))) {
+    const auto bmin = int(bricknum)*xyz, bmax = bmin+int(bricknum);
+    iso::mesh::octree o(cellnum);
+    geom::dcmesh m;
+    ref<task> geom_task = geom::create_task(m, o, cellsize);
+    ref<task> iso_task = iso::mesh::create_brick_task(o, root, bmin, bmax, org,
+                                                      cellnum, cellsize, &cache);
+    iso_task->starts(*geom_task);
+    iso_task->scheduled();
+    geom_task->scheduled();
+    geom_task->wait();
+    leafnum += countleaves(o.m_root);
+    cache.keep(o, bmin, bmax);
+    keptnum = max(keptnum, u64(cache.m_leaves.size()));
+    w.append(m);
+    m.destroy();
+  }
+  con::out("iso: stream: %d chunks written", w.m_chunknum);
+  con::out("iso: stream: %d leaves, at most %d kept for the next bricks",
+           int(leafnum), int(keptnum));
+}
+
 static const float CELLSIZE = 0.1f;
+static const u32 CELLNUM = 4096;
 int main(int argc, const char **argv) {
   outputcpufeatures();
 
+  // -a[p][m] pins the threads to the cpus
+  const auto threadflags = argc > 1 ? task::pinflags(argv[1]) : 0u;
+  if (threadflags != 0) --argc, ++argv;
+
+  // stream the mesh in bricks of the given size (in cells) if any
+  const auto stream = argv[1] && argv[2];
+  const auto bricknum = stream ? u32(atoi(argv[2])) : 0u;
+  if (stream && (!ispoweroftwo(bricknum) ||
+      bricknum < u32(iso::mesh::SUBGRID) || bricknum > CELLNUM)) {
+    con::out("iso: brick size must be a power of two in [%d,%d]",
+             iso::mesh::SUBGRID, CELLNUM);
+    return 1;
+  }
+
   con::out("init: memory debugger");
   sys::memstart();
 
@@ -48,8 +114,8 @@ int main(int argc, const char **argv) {
   _mm_setcsr(_mm_getcsr() | (1<<15) | (1<<6));
 #endif
   const u32 threadnum = sys::threadnumber() - 1;
-  con::out("init: tasking system: %d threads created", threadnum);
-  task::start(&threadnum, 1);
+  task::start(&threadnum, 1, threadflags);
+  con::out("init: tasking system: %d threads created", task::threadnum());
   con::out("init: script module");
   script::start();
   con::out("init: isosurface module");
@@ -58,13 +124,24 @@ int main(int argc, const char **argv) {
   csg::start();
 
   // load the csg function
-  script::execscript(argv[1] ? argv[1] : "data/csg.lua");
-  const auto node = csg::makescene();
+  const auto node = csg::loadscene(argv[1] ? argv[1] : "data/csg.lua");
+  assert(node != NULL);
+
+  // stream the mesh in bricks
+  if (stream) {
+    const auto start = sys::millis();
+    dcstream("simple.chunks", vec3f(0.15f), CELLNUM, bricknum, CELLSIZE, *node);
+    const auto end = sys::millis();
+    printf("time %f ms\n", float(end-start));
+#if !defined(NDEBUG)
+    finish();
+#endif /* !defined(NDEBUG) */
+    return 0;
+  }
 
   // build the mesh
-  assert(node != NULL);
   const auto start = sys::millis();
-  auto m = dc(vec3f(0.15f), 4096, CELLSIZE, *node);
+  auto m = dc(vec3f(0.15f), CELLNUM, CELLSIZE, *node);
   const auto end = sys::millis();
   printf("time %f ms\n", float(end-start));
   geom::store("simple.mesh", m);
@@ -5,6 +5,7 @@
 #include "mini.q.hpp"
 #include "bvh.hpp"
 #include "csg.hpp"
+#include "geom.hpp"
 #include "iso_mesh.hpp"
 #include "game.hpp"
 #include "rt.hpp"
@@ -18,6 +19,8 @@ static void playerpos(int x, int y, int z) {game::player1->o = vec3f(vec3i(x,y,z
 static void playerypr(int x, int y, int z) {game::player1->ypr = vec3f(vec3i(x,y,z));}
 CMD(playerpos);
 CMD(playerypr);
+// gzipped world (index, position, normal and segment arrays). this is not the
+// layout of geom::store which loadchunks reads
 static void loadworld(const char *name) {
   geom::dcmesh m;
   con::out("init: loading %s", name);
@@ -44,13 +47,49 @@ static void loadworld(const char *name) {
 }
 CMD(loadworld);
 
-static void run(int argc, const char *argv[]) {
+// load a world streamed by mini.q.iso chunk by chunk. each chunk gets its own
+// bvh and is freed before the next one is read. the bvhs of the chunks are
+// then gathered in the world bvh
+static void loadchunks(const char *name) {
+  con::out("init: loading %s", name);
+  const auto start = sys::millis();
+  geom::chunkreader r(name);
+  if (r.m_file==NULL) {
+    con::out("failed to open %s", name);
+    exit(EXIT_FAILURE);
+  }
+  vector<rt::primitive> chunks;
+  geom::dcmesh m;
+  u32 trinum = 0;
+  while (r.next(m)) {
+    const auto n = m.m_indexnum/3;
+    auto prim = NEWAE(rt::primitive, n);
+    loopi(n) {
+      loopj(3) prim[i].v[j] = m.m_pos[m.m_index[3*i+j]];
+      prim[i].type = rt::primitive::TRI;
+    }
+    chunks.push_back(rt::primitive(NEW(rt::intersector, prim, n)));
+    SAFE_DELA(prim);
+    trinum += n;
+  }
+  m.destroy();
+  if (chunks.empty()) {
+    con::out("no chunk in %s", name);
+    exit(EXIT_FAILURE);
+  }
+  rt::setbvh(NEW(rt::intersector, chunks.data(), chunks.size()));
+  con::out("init: %s loaded in %.2f ms (%d chunks, %d tris)",
+           name, float(sys::millis()-start), r.m_chunknum, trinum);
+}
+CMD(loadchunks);
+
+static void run(const char *argv[], u32 threadflags) {
   con::out("init: memory debugger");
   sys::memstart();
   con::out("init: tasking system");
   const u32 threadnum = sys::threadnumber() - 1;
-  con::out("init: tasking system: %d threads created", threadnum);
-  task::start(&threadnum, 1);
+  task::start(&threadnum, 1, threadflags);
+  con::out("init: tasking system: %d threads created", task::threadnum());
   con::out("init: iso::mesh module");
   iso::mesh::start();
 
@@ -63,12 +102,16 @@ static void run(int argc, const char *argv[]) {
 } /* namespace q */
 
 int main(int argc, const char *argv[]) {
+  // -a[p][m] pins the threads to the cpus
+  const auto name = argv[0];
+  const auto threadflags = argc > 1 ? q::task::pinflags(argv[1]) : 0u;
+  if (threadflags != 0) --argc, ++argv;
   if (argc != 3) {
-    q::con::out("usage: %s script outname", argv[0]);
+    q::con::out("usage: %s [-a[p][m]] script outname", name);
     q::finish();
     return 1;
   }
-  q::run(argc, argv);
+  q::run(argv, threadflags);
   q::finish();
   return 0;
 }
@@ -0,0 +1,196 @@
+/*-------------------------------------------------------------------------
+ - mini.q - a minimalistic multiplayer FPS
+ - mini.q.taskbench.cpp -> micro-benchmarks and stress for the task system
+ -------------------------------------------------------------------------*/
+#include "base/task.hpp"
+#include "base/sys.hpp"
+#include "base/math.hpp"
+
+// all results go to stdout as csv lines:
+// benchmark,threads,ops,total_ms,ns_per_op
+namespace q {
+static const u32 SPAWNNUM = 1<<16;
+static const u32 ELEMNUM = 1<<20;
+static const u32 LATENCYNUM = 1<<10;
+static const u32 CHAINLEN = 1<<14;
+static const u32 FANWIDTH = 1<<10;
+static const u32 FANNUM = 16;
+static const u32 FLOODNUM = 1<<12;
+static const u32 PREEMPTNUM = 64;
+
+// sys::millis is a float and loses precision after a few seconds
+static INLINE double now(void) { return double(sys::nanos())*1e-6; }
+
+static void output(const char *name, u32 threadnum, u32 opnum, double ms) {
+  printf("%s,%u,%u,%.3f,%.1f\n", name, threadnum, opnum, ms, ms*1e6/double(opnum));
+  fflush(stdout);
+}
+
+// busy loop to emulate some work in an element
+static void busy(double ms) {
+  const auto start = now();
+  while (now()-start < ms) {
+#if defined(__SSE__)
+    _mm_pause();
+#endif /* __SSE__ */
+  }
+}
+
+struct task_empty : public task {
+  INLINE task_empty(u32 n = 1, u32 waiternum = 0, u16 policy = 0) :
+    task("task_empty", n, waiternum, 0, policy) {}
+  virtual void run(u32) {}
+};
+
+// records when it starts to run
+struct task_stamp : public task {
+  INLINE task_stamp(u16 policy = 0) :
+    task("task_stamp", 1, 0, 0, policy), stamp(0.0), done(false) {}
+  virtual void run(u32) {
+    stamp = now();
+    done = true;
+  }
+  double stamp;
+  volatile bool done;
+};
+
+struct task_busy : public task {
+  INLINE task_busy(u32 n, double ms) : task("task_busy", n, 1), ms(ms) {}
+  virtual void run(u32) { busy(ms); }
+  double ms;
+};
+
+// cost of task creation and scheduling as seen by the spawning thread and
+// throughput of the workers for tasks that do nothing
+static void spawn(u32 threadnum) {
+  ref<task> sink = NEW(task_empty, 1, 1);
+  const auto start = now();
+  loopi(SPAWNNUM) {
+    ref<task> job = NEWE(task_empty);
+    job->starts(*sink);
+    job->scheduled();
+  }
+  const auto spawned = now();
+  sink->scheduled();
+  sink->wait();
+  const auto end = now();
+  output("spawn", threadnum, SPAWNNUM, spawned-start);
+  output("empty_task", threadnum, SPAWNNUM, end-start);
+}
+
+// throughput of empty elements from a single task and from parallel_for
+static void elements(u32 threadnum) {
+  auto start = now();
+  ref<task> job = NEW(task_empty, ELEMNUM, 1);
+  job->scheduled();
+  job->wait();
+  output("empty_elem", threadnum, ELEMNUM, now()-start);
+  start = now();
+  parallel_for(0, ELEMNUM, 1, [](u32) {});
+  output("parallel_for", threadnum, ELEMNUM, now()-start);
+}
+
+// delay between scheduled() and the start of run() on a worker
+static void latency(u32 threadnum) {
+  double sum = 0.0;
+  loopi(LATENCYNUM) {
+    ref<task_stamp> job = NEWE(task_stamp);
+    const auto start = now();
+    job->scheduled();
+    while (!job->done) {
+#if defined(__SSE__)
+      _mm_pause();
+#endif /* __SSE__ */
+    }
+    sum += job->stamp-start;
+  }
+  output("schedule_latency", threadnum, LATENCYNUM, sum);
+}
+
+// every task of the chain starts the next one
+static void chain(u32 threadnum) {
+  taskgraph graph;
+  task *prev = &graph.add(NEWE(task_empty));
+  loopi(CHAINLEN-1) {
+    auto &next = graph.add(NEW(task_empty, 1, i == CHAINLEN-2 ? 1 : 0));
+    prev->starts(next);
+    prev = &next;
+  }
+  ref<task> last = prev;
+  const auto start = now();
+  task::schedule(graph);
+  last->wait();
+  output("dependency_chain", threadnum, CHAINLEN, now()-start);
+}
+
+// one task starts a wide set of tasks that all start a single sink
+static void fan(u32 threadnum) {
+  double sum = 0.0;
+  loopi(FANNUM) {
+    taskgraph graph;
+    auto &src = graph.add(NEWE(task_empty));
+    auto &sink = graph.add(NEW(task_empty, 1, 1));
+    loopj(FANWIDTH) {
+      auto &leaf = graph.add(NEWE(task_empty));
+      src.starts(leaf);
+      leaf.starts(sink);
+    }
+    ref<task> wait = &sink;
+    const auto start = now();
+    task::schedule(graph);
+    wait->wait();
+    sum += now()-start;
+  }
+  output("fan_out_in", threadnum, FANNUM*FANWIDTH, sum);
+}
+
+// latency of a task while the workers are flooded with long elements. with
+// HI_PRIO, the task should start as soon as a worker finishes its element
+static void preemption(u32 threadnum) {
+  const char *names[] = {"lo_prio_latency", "hi_prio_latency"};
+  const u16 policies[] = {u16(task::LO_PRIO), u16(task::HI_PRIO)};
+  loopk(2) {
+    ref<task> flood = NEW(task_busy, FLOODNUM, 0.05);
+    flood->scheduled();
+    double sum = 0.0;
+    loopi(PREEMPTNUM) {
+      ref<task_stamp> job = NEW(task_stamp, policies[k]);
+      const auto start = now();
+      job->scheduled();
+      while (!job->done) {
+#if defined(__SSE__)
+        _mm_pause();
+#endif /* __SSE__ */
+      }
+      sum += job->stamp-start;
+    }
+    flood->wait();
+    output(names[k], threadnum, PREEMPTNUM, sum);
+  }
+}
+
+static void run(int argc, const char *argv[]) {
+  const auto cpunum = sys::threadnumber() > 1 ? sys::threadnumber()-1 : 1u;
+  const auto maxthreadnum = argc > 1 ? u32(atoi(argv[1])) : cpunum;
+  printf("benchmark,threads,ops,total_ms,ns_per_op\n");
+
+  // powers of two and the requested number of threads
+  for (u32 threadnum = 1;; threadnum = min(2*threadnum, maxthreadnum)) {
+    task::start(&threadnum, 1);
+    spawn(threadnum);
+    elements(threadnum);
+    latency(threadnum);
+    chain(threadnum);
+    fan(threadnum);
+    preemption(threadnum);
+    task::finish();
+    if (threadnum >= maxthreadnum) break;
+  }
+}
+} /* namespace q */
+
+int main(int argc, const char *argv[]) {
+  q::sys::memstart();
+  q::run(argc, argv);
+  return 0;
+}
@@ -585,8 +585,27 @@ static u32 scenenorbo = 0u, sceneposbo = 0u, sceneibo = 0u;
 static u32 indexnum = 0u;
 static bool initialized_m = false;
 static geom::segment *segment = NULL;
+static iso::mesh::octree *sceneoctree = NULL; // kept to update the scene
+static geom::dcmesh scenemesh;
+
+// full builds run in the background while the previous mesh stays on screen.
+// the build in flight is cancelled as soon as the csg scene is replaced
+struct task_scenedone : public task {
+  INLINE task_scenedone() : task("task_scenedone", 1, 1), done(false) {}
+  virtual void run(u32) { done = true; }
+  volatile bool done;
+};
+static ref<task_scenedone> scenedone; // runs once the build in flight ends
+static ref<canceltoken> scenetoken;   // cancels the build in flight
+static ref<csg::node> scenenode;      // csg scene we build (or built) the mesh of
+static float scenestart = 0.f;        // start time of the build in flight
+static bool patchable = false;        // scene mesh may be patched by updatescene
+static vec3f sceneviewpoint(zero);    // player position when the build started
+static float scenelod = 0.f;          // level of detail distance of the build
+static void cancelscene();
 
 static u32 segmentnum = 0;
+static u32 lodsegment[geom::MAX_LOD_NUM+1], lodnum = 0;
 void start() {
   initdeferred();
   initparticles();
@@ -596,11 +615,15 @@ void start() {
 
 #if !defined(RELEASE)
 void finish() {
+  cancelscene();
+  scenenode = NULL;
   if (initialized_m) {
     ogl::deletebuffers(1, &sceneposbo);
     ogl::deletebuffers(1, &scenenorbo);
     ogl::deletebuffers(1, &sceneibo);
     SAFE_DEL(segment);
+    SAFE_DEL(sceneoctree);
+    scenemesh.destroy();
   }
   cleanrt();
   cleanparticles();
@@ -608,55 +631,151 @@ void finish() {
 }
 #endif
 
-static geom::dcmesh dc(const vec3f &org, u32 cellnum, float cellsize, const csg::node &root) {
-  iso::mesh::octree o(cellnum);
-  geom::dcmesh m;
-  ref<task> geom_task = geom::create_task(m, o, cellsize);
-  ref<task> iso_task = iso::mesh::create_task(o, root, org, cellnum, cellsize);
+static const vec3f ORG(0.15f);
+static const u32 CELLNUM = 4096;
+static const float CELLSIZE = 0.1f;
+
+// leaves farther than this times their size from the player are contoured
+// with coarser cells. 0 contours the complete scene at full resolution
+VARP(loddistance, 0, 0, 64);
+
+// the levels of detail are chosen from the player position when the build
+// starts. the scene is built again in the background once the player is
+// farther than this from it. 0 keeps the levels of detail of the first build
+VARP(lodrebuild, 0, 16, 1024);
+
+// only draw the triangles of this level of detail. -1 (or a level the scene
+// does not have) draws all of them
+VAR(showlod, -1, -1, geom::MAX_LOD_NUM-1);
+
+// keep the triangles of the full build in their octree leaves such that the
+// edits patch the mesh instead of building it again. it costs a few percent
+// more triangles so only the scenes that are edited should enable it
+VARP(patchscene, 0, 0, 1);
+
+// update of the leaves that see dirty. run synchronously
+static void dc(const aabb &dirty) {
+  auto &o = *sceneoctree;
+  ref<task> geom_task = geom::create_update_task(scenemesh, o, CELLSIZE);
+  ref<task> iso_task = iso::mesh::create_update_task(o, *scenenode, dirty, ORG, CELLNUM, CELLSIZE);
   iso_task->starts(*geom_task);
   iso_task->scheduled();
   geom_task->scheduled();
   geom_task->wait();
   rt::setbvh(o.bvh);
-  return m;
 }
 
-static const float CELLSIZE = 0.1f;
-static void makescene() {
-  if (initialized_m) return;
+// start a full build of the current csg scene in the background
+static void buildscene() {
+  assert(!scenedone);
+  SAFE_DEL(sceneoctree);
+  sceneoctree = NEW(iso::mesh::octree, CELLNUM);
+  sceneviewpoint = game::player1->o;
+  scenelod = float(loddistance);
+  sceneoctree->m_lod.distance = scenelod;
+  sceneoctree->m_lod.viewpoints.push_back(sceneviewpoint);
+  auto &o = *sceneoctree;
+  scenetoken = NEWE(canceltoken);
+  scenedone = NEWE(task_scenedone);
+  patchable = patchscene != 0;
+  ref<task> geom_task = geom::create_task(scenemesh, o, CELLSIZE, 0, patchable);
+  ref<task> iso_task = iso::mesh::create_task(o, *scenenode, ORG, CELLNUM, CELLSIZE);
+  iso_task->settoken(scenetoken.ptr);
+  geom_task->settoken(scenetoken.ptr);
+  iso_task->starts(*geom_task);
+  geom_task->starts(*scenedone);
+  scenestart = sys::millis();
+  iso_task->scheduled();
+  geom_task->scheduled();
+  scenedone->scheduled();
 
-  // create the indexed mesh from the scene description
-  geom::dcmesh m;
-  auto start = sys::millis();
-  const auto node = csg::makescene();
-  assert(node != NULL);
-  m = dc(vec3f(0.15f), 4096, CELLSIZE, *node);
-  auto duration = sys::millis() - start;
-  con::out("csg: elapsed %f ms ", float(duration));
+  // without workers, nobody would run the build in the background
+  if (task::threadnum() == 0) scenedone->wait();
+}
+
+// abandon the build in flight if any. its octree is incomplete
+static void cancelscene() {
+  if (!scenedone) return;
+  scenetoken->cancel();
+  scenedone->wait();
+  scenedone = NULL;
+  scenetoken = NULL;
+  SAFE_DEL(sceneoctree);
+  con::out("csg: build cancelled after %f ms", float(sys::millis()-scenestart));
+}
 
-  ogl::genbuffers(1, &sceneposbo);
+static void uploadscene() {
+  const auto &m = scenemesh;
+  if (sceneposbo == 0u) ogl::genbuffers(1, &sceneposbo);
   ogl::bindbuffer(ogl::ARRAY_BUFFER, sceneposbo);
   OGL(BufferData, GL_ARRAY_BUFFER, m.m_vertnum*sizeof(vec3f), &m.m_pos[0].x, GL_STATIC_DRAW);
-  ogl::genbuffers(1, &scenenorbo);
+  if (scenenorbo == 0u) ogl::genbuffers(1, &scenenorbo);
   ogl::bindbuffer(ogl::ARRAY_BUFFER, scenenorbo);
   OGL(BufferData, GL_ARRAY_BUFFER, m.m_vertnum*sizeof(vec3f), &m.m_nor[0].x, GL_STATIC_DRAW);
   ogl::bindbuffer(ogl::ARRAY_BUFFER, 0);
-  ogl::genbuffers(1, &sceneibo);
+  if (sceneibo == 0u) ogl::genbuffers(1, &sceneibo);
   ogl::bindbuffer(ogl::ELEMENT_ARRAY_BUFFER, sceneibo);
   OGL(BufferData, GL_ELEMENT_ARRAY_BUFFER, m.m_indexnum*sizeof(u32), &m.m_index[0], GL_STATIC_DRAW);
   ogl::bindbuffer(ogl::ELEMENT_ARRAY_BUFFER, 0);
   indexnum = m.m_indexnum;
   con::out("csg: tris %i verts %i", m.m_indexnum/3, m.m_vertnum);
 
-  // create the bvh out of the mesh data
-  //rt::buildbvh(m.m_pos, m.m_index, m.m_indexnum);
   segmentnum = m.m_segmentnum;
+  if (segment) FREE(segment);
   segment = (geom::segment*) MALLOC(sizeof(geom::segment) * segmentnum);
   memcpy(segment, m.m_segment, segmentnum*sizeof(geom::segment));
-  m.destroy();
+  lodnum = m.m_lodnum;
+  loopi(lodnum+1) lodsegment[i] = m.m_lodsegment[i];
+}
+
+static void makescene() {
+  // a new csg scene replaces the build in flight
+  const auto node = csg::makescene();
+  if (node != scenenode.ptr) {
+    cancelscene();
+    scenenode = node;
+    if (node != NULL) buildscene();
+  }
+
+  // build the levels of detail again around the new player position
+  if (scenenode && !scenedone && initialized_m) {
+    const auto moved = distance(game::player1->o, sceneviewpoint);
+    const auto lodchanged = float(loddistance) != scenelod;
+    const auto away = loddistance != 0 && lodrebuild != 0 && moved > float(lodrebuild);
+    if (lodchanged || away) buildscene();
+  }
+
+  // upload the mesh once the build is done
+  if (!scenedone || !scenedone->done) return;
+  scenedone->wait();
+  scenedone = NULL;
+  scenetoken = NULL;
+  rt::setbvh(sceneoctree->bvh);
+  con::out("csg: elapsed %f ms ", float(sys::millis()-scenestart));
+  uploadscene();
   initialized_m = true;
 }
 
+void updatescene(const ref<csg::node> &root, const aabb &dirty) {
+  // makescene then sees that the scene did not change
+  const auto node = csg::setscene(root);
+  if (!scenenode || node == NULL) return;
+  scenenode = node;
+
+  // the build in flight may have read the scene before the change and a mesh
+  // decimated across the leaves cannot be patched
+  if (scenedone || !patchable) {
+    cancelscene();
+    buildscene();
+    return;
+  }
+  auto start = sys::millis();
+  dc(dirty);
+  auto duration = sys::millis() - start;
+  con::out("csg: update elapsed %f ms ", float(duration));
+  uploadscene();
+}
+
 struct screenquad {
   static INLINE screenquad get() {
     const auto w = float(sys::scrw), h = float(sys::scrh);
@@ -727,7 +846,10 @@ struct context {
       ogl::bindbuffer(ogl::ARRAY_BUFFER, scenenorbo);
       OGL(VertexAttribPointer, ogl::ATTRIB_COL, 3, GL_FLOAT, 0, sizeof(vec3f), NULL);
       ogl::bindbuffer(ogl::ELEMENT_ARRAY_BUFFER, sceneibo);
-      loopi(segmentnum) {
+      const auto drawall = showlod < 0 || u32(showlod) >= lodnum;
+      const auto first = drawall ? 0u : lodsegment[showlod];
+      const auto last = drawall ? segmentnum : lodsegment[showlod+1];
+      rangei(first, last) {
         const auto seg = segment[i];
         const ogl::shadertype simpleshader = simple_material::s;
         const ogl::shadertype noiseshader = noise_material::s;
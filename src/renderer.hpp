@@ -4,8 +4,12 @@
  -------------------------------------------------------------------------*/
 #pragma once
 #include "base/math.hpp"
+#include "base/ref.hpp"
 
 namespace q {
+namespace csg {
+struct node;
+} /* namespace csg */
 namespace rr {
 static const float VIRTW = 1024.f; // for scalable UI
 static const float PIXELTAB = 1.f; // tabulation size
@@ -38,6 +42,11 @@ void blendbox(float x1, float y1, float x2, float y2, bool border);
 void particle_splash(int type, int num, int fade, const vec3f &p);
 void particle_trail(int type, int fade, const vec3f &s, const vec3f &e);
 
+// make root the csg scene and contour again only the part of the mesh that
+// sees the dirty box. the box covers everything that differs between the old
+// and the new root
+void updatescene(const ref<csg::node> &root, const aabb &dirty);
+
 void hud(int w, int h, int curfps);
 void frame(int w, int h, int curfps);
 vec2f scrdim();
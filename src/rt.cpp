@@ -117,12 +117,11 @@ VAR(rtmode, 0, 2, 2);
 static const vec3f lpos0(35.f, 10.f, 11.f);
 static const vec3f lpos1(10.f, 15.f, 10.f);
 static atomic totalraynum;
-struct task_raycast : public task {
-  task_raycast(intersector *bvhisec, const camera &cam, int *pixels, vec2i dim, vec2i tile) :
-    task("task_raycast", tile.x*tile.y, 1, 0, UNFAIR),
+struct raycaster {
+  raycaster(intersector *bvhisec, const camera &cam, int *pixels, vec2i dim, vec2i tile) :
     bvhisec(bvhisec), cam(cam), pixels(pixels), dim(dim), tile(tile)
   {}
-  INLINE u32 primarypoint(vec2i tileorg, array3f &pos, array3f &nor, arrayi &mask) {
+  INLINE u32 primarypoint(vec2i tileorg, array3f &pos, array3f &nor, arrayi &mask) const {
     raypacket p;
     packethit hit;
     rtvisibilitypacket(cam, p, tileorg, dim);
@@ -130,7 +129,7 @@ struct task_raycast : public task {
     rtclosest(*bvhisec, p, hit);
     return rtprimarypoint(p, hit, pos, nor, mask);
   }
-  virtual void run(u32 tileID) {
+  void operator()(u32 tileID) const {
     const vec2i tilexy(tileID%tile.x, tileID/tile.x);
     const vec2i tileorg = int(TILESIZE) * tilexy;
 
@@ -178,9 +177,7 @@ void raytrace(int *pixels, const vec3f &pos, const vec3f &ypr,
   const camera cam(pos, -r.vy, -r.vz, fovy, aspect);
   const vec2i dim(w,h), tile(dim/int(TILESIZE));
   totalraynum=0;
-  ref<task> raycast = NEW(task_raycast, world, cam, pixels, dim, tile);
-  raycast->scheduled();
-  raycast->wait();
+  parallel_for(0, tile.x*tile.y, 0, raycaster(world, cam, pixels, dim, tile), task::UNFAIR);
 }
 
 static int *pixels=NULL;
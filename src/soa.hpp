@@ -3,6 +3,7 @@
  - soa.hpp -> factorizes code shared by all simd paths
  -------------------------------------------------------------------------*/
 #pragma once
+#include "base/avx512.hpp"
 #include "base/avx.hpp"
 #include "base/sse.hpp"
 #include "base/math.hpp"
@@ -12,7 +13,18 @@ namespace q {
 /*-------------------------------------------------------------------------
  - define soa structures based on the native ISA we use
  -------------------------------------------------------------------------*/
-#if defined(__AVX__)
+#if defined(__AVX512F__)
+typedef avx512f soaf;
+typedef avx512i soai;
+typedef avx512b soab;
+INLINE void store(void *ptr, const soai &x) {store16i(ptr, x);}
+INLINE void store(void *ptr, const soaf &x) {store16f(ptr, x);}
+INLINE void storeu(void *ptr, const soaf &x) {storeu16f(ptr, x);}
+INLINE void storeui(void *ptr, const soai &x) {storeu16i(ptr, x);}
+INLINE void storent(void *ptr, const soai &x) {store16i_nt(ptr, x);}
+INLINE void maskstore(const soab &m, void *ptr, const soaf &x) {store16f(m, ptr, x);}
+INLINE soaf splat(const soaf &v) {return splat0(v);}
+#elif defined(__AVX__)
 typedef avxf soaf;
 typedef avxi soai;
 typedef avxb soab;
@@ -47,6 +59,12 @@ INLINE soaf splat(const soaf &v) {return shuffle<0,0,0,0>(v,v);}
 typedef vec3<soai> soa3i;
 typedef vec3<soaf> soa3f;
 typedef vec2<soaf> soa2f;
+INLINE soa2f select(const soab &m, const soa2f &t, const soa2f &f) {
+  return soa2f(select(m,t.x,f.x), select(m,t.y,f.y));
+}
+INLINE soa3f select(const soab &m, const soa3f &t, const soa3f &f) {
+  return soa3f(select(m,t.x,f.x), select(m,t.y,f.y), select(m,t.z,f.z));
+}
 
 /*-------------------------------------------------------------------------
  - define soa structures based on array which are oblivious to the